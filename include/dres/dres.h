@@ -41,6 +41,7 @@ USA.
 
 
 #define DRES_MAGIC    ('D'<<24|('R'<<16)|('E'<<8)|'S')
+#define DRES_VERSION  2                    /* bump on any .dresc change */
 #define DRES_MAX_NAME 128
 
 #define DRES_SUFFIX_BINARY "dresc"
@@ -83,11 +84,17 @@ enum {
     static int b(void *data, char *name,                                \
                  vm_stack_entry_t *args, int narg, vm_stack_entry_t *rv)
 
+/* native handlers get their arguments as tagged cells (see vm_cell_t) */
+#define DRES_NATIVE(b)                                                  \
+    static int b(void *data, char *name,                                \
+                 vm_cell_t *args, int narg, vm_cell_t *rv)
+
 #define DRES_ACTION_SUCCEED    return TRUE
 #define DRES_ACTION_FAIL       return FALSE
 #define DRES_ACTION_ERROR(err) do { return (err) > 0 ? -(err):(err); } while (0)
 
 typedef vm_action_t dres_handler_t;
+typedef vm_native_t dres_native_t;
 
 struct dres_s;
 typedef struct dres_s dres_t;
@@ -308,16 +315,22 @@ enum {
 
 typedef struct {
     int   id;                               /* variable ID */
-    int   stamp;                            /* last update stamp */
     int   txid;                             /*   of stamp */
     int   txstamp;                          /* stamp before txid */
     char *name;                             /* variable name */
     int   flags;                            /* DRES_VAR_* */
+    char *field;                            /* for $name:field prereqs */
+    dres_select_t *selector;                /* for $name[...] prereqs */
+    uint64_t digest;                        /* of field values */
 } dres_variable_t;
 
 enum {
     DRES_VAR_UNKNOWN = 0x0,
-    DRES_VAR_PREREQ  = 0x1
+    DRES_VAR_PREREQ  = 0x1,
+    DRES_VAR_FIELD   = 0x2,                 /* field-qualified prereq */
+    DRES_VAR_CHANGED = 0x4,                 /* changed (during store check) */
+    DRES_VAR_SELECT  = 0x8,                 /* selector-qualified prereq */
+    DRES_VAR_QUALIFIED = DRES_VAR_FIELD | DRES_VAR_SELECT,
 };
 
 
@@ -327,12 +340,26 @@ typedef struct {
     dres_prereq_t *prereqs;                 /* prerequisites */
     dres_stmt_t   *statements;              /* associated actions */
     vm_chunk_t    *code;                    /* VM code */
-    int            stamp;                   /* last update stamp */
     int            txid;                    /* of stamp */
     int            txstamp;                 /* stamp before txid */
     int           *dependencies;            /* sorted depedencies */
+    int            ndependency;             /* number of dependencies */
+    int           *checks;                  /* stamp indices of prereqs */
+    int            ncheck;                  /* number of checks */
+    int           *reduced;                 /* transitively reduced checks */
+    int            nreduced;                /* number of reduced checks */
+    int            flags;                   /* DRES_TARGET_* */
+    uint64_t       digest;                  /* hash of last output */
 } dres_target_t;
 
+enum {
+    DRES_TARGET_UNKNOWN   = 0x0,
+    DRES_TARGET_DIRTY     = 0x1,            /* some prereq might be newer */
+    DRES_TARGET_DIGEST    = 0x2,            /* digest is valid */
+    DRES_TARGET_UNCHANGED = 0x4,            /* last run wrote same output */
+    DRES_TARGET_BROKEN    = 0x8,            /* code generation failed */
+};
+
 typedef struct {
     int            ntarget;
     int            nfactvar;
@@ -354,8 +381,27 @@ enum {
     DRES_TARGETS_FINALIZED  = 0x2,          /* sorted dependency graph */
     DRES_TRANSACTION_ACTIVE = 0x4,          /* has an active transaction */
     DRES_COMPILED           = 0x8,          /* compiled dres buffer */
+    DRES_EARLY_CUTOFF       = 0x10,         /* cut off on unchanged output */
+    DRES_LAZY_FINALIZE      = 0x20,         /* finalize targets on demand */
 };
 
+/*
+ * Stamps of all targets and variables are kept in a single array, targets
+ * first, followed by fact variables then dres variables.
+ */
+#define DRES_STAMP_INDEX(d, id) ({                                      \
+            int __i = DRES_INDEX(id);                                   \
+            switch (DRES_ID_TYPE(id)) {                                 \
+            case DRES_TYPE_DRESVAR: __i += (d)->nfactvar; /* fall through */ \
+            case DRES_TYPE_FACTVAR: __i += (d)->ntarget;  /* fall through */ \
+            default:                break;                              \
+            }                                                           \
+            __i;                                                        \
+        })
+
+#define DRES_STAMP(d, id) ((d)->stamps[DRES_STAMP_INDEX(d, id)])
+
+
 #define DRES_TST_FLAG(d, f) ((d)->flags &   DRES_##f)
 #define DRES_SET_FLAG(d, f) ((d)->flags |=  DRES_##f)
 #define DRES_CLR_FLAG(d, f) ((d)->flags &= ~DRES_##f)
@@ -369,6 +415,17 @@ struct dres_s {
     dres_variable_t *dresvars;
     int              ndresvar;
     dres_store_t     store;
+    dres_graph_t    *graph;                 /* reverse dependency index */
+    int             *stamps;                /* stamps by stamp index */
+    int             *checks;                /* prereq stamp indices */
+    int              ncheck;                /* total number of checks */
+    int             *reduced;               /* reduced prereq stamp indices */
+    int              nreduced;              /* total number of reduced ones */
+    int             *dependencies;          /* check orders of all targets */
+    int              ndependency;           /* total size of check orders */
+    int             *ranks;                 /* topological rank of targets */
+    int             *order;                 /* target indices by rank */
+    unsigned long   *dirty;                 /* dirty targets by rank */
     
     int              stamp;
     int              txid;                  /* transaction id */
@@ -382,8 +439,17 @@ struct dres_s {
 };
 
 
+typedef struct {
+    dres_t        *dres;                    /* resolver context */
+    dres_target_t *target;                  /* goal to update */
+    int           *locals;                  /* IDs of local variables */
+    int            nlocal;                  /* number of local variables */
+} dres_goal_t;
+
+
 typedef struct {
     u_int32_t magic;                               /* DRES_MAGIC */
+    u_int32_t version;                             /* DRES_VERSION */
     u_int32_t ssize;                               /* string table size */
     u_int32_t ntarget;                             /* # of targets */
     u_int32_t nprereq;                             /* # of prereqs */
@@ -394,6 +460,8 @@ typedef struct {
     u_int32_t ninit;                               /* # of initializers */
     u_int32_t nfield;                              /* # of fields */
     u_int32_t nmethod;                             /* # of methods */
+    u_int32_t nselect;                             /* # of prereq selectors */
+    u_int32_t nreduced;                            /* # of reduced checks */
 } dres_header_t;
 
 typedef struct {
@@ -431,6 +499,8 @@ dres_t *dres_init(char *prefix);
 void    dres_exit(dres_t *dres);
 dres_t *dres_parse_file(char *path);
 int     dres_finalize(dres_t *dres);
+int     dres_set_early_cutoff(dres_t *dres, int enable);
+int     dres_set_lazy_finalize(dres_t *dres, int enable);
 
 dres_variable_t *dres_lookup_variable(dres_t *dres, int id);
 void dres_update_var_stamp(dres_t *dres, dres_variable_t *var);
@@ -451,6 +521,7 @@ int            dres_add_target   (dres_t *dres, char *name);
 int            dres_target_id    (dres_t *dres, char *name);
 dres_target_t *dres_lookup_target(dres_t *dres, char *name);
 void           dres_free_targets (dres_t *dres);
+void           dres_unload_targets(dres_t *dres);
 void           dres_dump_targets (dres_t *dres);
 int            dres_check_target (dres_t *dres, int tid);
 int            dres_save_targets (dres_t *dres, dres_buf_t *buf);
@@ -460,6 +531,9 @@ int            dres_load_targets (dres_t *dres, dres_buf_t *buf);
 /* factvar.c */
 int         dres_add_factvar  (dres_t *dres, char *name);
 int         dres_factvar_id   (dres_t *dres, char *name);
+int         dres_factvar_field_id(dres_t *dres, char *name, char *field);
+int         dres_factvar_select_id(dres_t *dres, char *name,
+                                   dres_select_t *selector, char *field);
 const char *dres_factvar_name (dres_t *dres, int id);
 void        dres_free_factvars(dres_t *dres);
 int         dres_check_factvar(dres_t *dres, int id, int stamp);
@@ -491,6 +565,7 @@ void           dres_free_prereq(dres_prereq_t *dep);
 /* action.c */
 void           dres_free_locals(dres_local_t *locals);
 void           dres_free_varref(dres_varref_t *vref);
+void           dres_free_selector(dres_select_t *selector);
 
 void          dres_free_value (dres_value_t *value);
 int           dres_print_value(dres_t *dres,
@@ -499,6 +574,8 @@ int           dres_print_locals(dres_t *dres, dres_local_t *locals,
                                 char *buf, size_t size);
 int           dres_print_varref(dres_t *dres, dres_varref_t *vr,
                                 char *buf, size_t size);
+int           dres_print_selector(dres_t *dres, dres_select_t *s,
+                                  char *buf, size_t size);
 
 
 /* builtin.c */
@@ -540,6 +617,18 @@ dres_t *dres_load(char *path);
 
 dres_graph_t *dres_build_graph(dres_t *dres, dres_target_t *goal);
 void          dres_free_graph (dres_graph_t *graph);
+int           dres_build_index(dres_t *dres);
+void          dres_free_index (dres_t *dres);
+int           dres_sort_targets(dres_t *dres);
+int           dres_rank_targets(dres_t *dres);
+int           dres_sort_target (dres_t *dres, dres_target_t *target);
+int           dres_reduce_prereqs(dres_t *dres);
+void          dres_mark_dependents(dres_t *dres, int id);
+void          dres_set_dirty  (dres_t *dres, dres_target_t *target);
+void          dres_clear_dirty(dres_t *dres, dres_target_t *target);
+void          dres_seed_dirty (dres_t *dres, dres_target_t *goal, int seed);
+int           dres_next_dirty (dres_t *dres, int rank);
+int           dres_in_closure (dres_t *dres, dres_target_t *goal, int rank);
 
 char *dres_name(dres_t *, int id, char *buf, size_t bufsize);
 int   dres_print_varref(dres_t *dres, dres_varref_t *v, char *buf, size_t size);
@@ -547,12 +636,20 @@ int  *dres_sort_graph(dres_t *dres, dres_graph_t *graph);
 void  dres_dump_sort(dres_t *dres, int *list);
 
 int dres_update_goal(dres_t *dres, char *goal, char **locals);
+int dres_update_goals(dres_t *dres, char **goals, int ngoal, char **locals);
+
+dres_goal_t *dres_prepare_goal(dres_t *dres, char *goal, char **locals);
+int          dres_update_prepared(dres_goal_t *goal, dres_value_t *values);
+void         dres_free_prepared(dres_goal_t *goal);
 
 dres_handler_t dres_lookup_handler(dres_t *dres, char *name);
 
 int dres_register_handler(dres_t *dres, char *name, dres_handler_t handler);
+int dres_register_native(dres_t *dres, char *name, dres_native_t handler);
 int dres_unregister_handler(dres_t *dres, char *name, dres_handler_t handler);
 
+vm_global_t *dres_global_alloc(dres_t *dres, int nfact);
+
 int dres_run_actions(dres_t *dres, dres_target_t *target);
 
 
@@ -40,7 +40,6 @@ USA.
 #define VM_ALIGNMENT     (sizeof(void *))
 #define VM_ALIGNED_OK(n) VM_ALIGNED(n, VM_ALIGNMENT)
 
-#define VM_ALIGN_TO_INSTR(n)    (VM_ALIGN_TO(n, sizeof(uintptr_t)) / sizeof(uintptr_t))
 
 /*
  * VM logging
@@ -74,6 +73,7 @@ typedef enum {
     VM_TYPE_LOCAL,                            /* local variables */
     VM_TYPE_FACTS,                            /* an array of facts */
     VM_TYPE_GLOBAL = VM_TYPE_FACTS,           /* globals are facts */
+    VM_TYPE_FIELD,                            /* a field name (GQuark) */
 } vm_type_t;
 
 
@@ -91,14 +91,155 @@ typedef struct vm_global_s {
 } vm_global_t;
 
 
+/*
+ * global pool
+ *
+ * Globals are short-lived: most of them are freed by the instruction
+ * following the one that allocated them. Each VM keeps size-classed free
+ * lists of globals to recycle them. Class k is for globals with room for
+ * up to 2^k facts. Bigger ones are allocated and freed directly.
+ */
+
+#define VM_GPOOL_NCLASS 7                     /* classes of 1 - 64 facts */
+#define VM_GPOOL_KEEP   16                    /* kept per class on reset */
+
+typedef struct {
+    void *free[VM_GPOOL_NCLASS];              /* free lists */
+    int   nfree[VM_GPOOL_NCLASS];             /* lengths of free lists */
+} vm_gpool_t;
+
+
+/*
+ * hash joins
+ *
+ * A temporary hash of the facts of a global on the values of a set of
+ * key fields, used to match facts against it without scanning.
+ */
+
+typedef struct {
+    GQuark     *fields;                       /* key fields */
+    int         nfield;                       /* number of key fields */
+    int         nslot;                        /* facts in the global */
+    GHashTable *heads;                        /* key hash -> 1st fact + 1 */
+    int        *chain;                        /* next fact + 1 by fact */
+} vm_join_t;
+
+
+/*
+ * batched fact store writes
+ *
+ * Facts inserted into or removed from the fact store by the VM are queued
+ * and written to the store in one pass, either at the end of vm_exec or
+ * once they need to be visible (see vm-global.c).
+ */
+
+enum {
+    VM_BATCH_NONE = 0,                        /* cancelled write */
+    VM_BATCH_INSERT,                          /* insert fact */
+    VM_BATCH_REMOVE,                          /* remove fact */
+};
+
+typedef struct {
+    OhmFact    *fact;                         /* fact, referenced */
+    int         op;                           /* VM_BATCH_* */
+} vm_write_t;
+
+typedef struct {
+    vm_write_t *writes;                       /* queued writes */
+    int         nwrite;                       /* number of writes */
+    int         nalloc;                       /* size of writes */
+    GHashTable *pending;                      /* fact -> its last write + 1 */
+    int         status;                       /* error of a failed write */
+} vm_batch_t;
+
+
 typedef union vm_value_s {
     double       d;                           /* VM_TYPE_DOUBLE  */
     int          i;                           /* VM_TYPE_INTEGER */
     char        *s;                           /* VM_TYPE_STRING */
     vm_global_t *g;                           /* VM_TYPE_GLOBAL */
+    GQuark       q;                           /* VM_TYPE_FIELD */
 } vm_value_t;
 
 
+/*
+ * tagged VM values
+ *
+ * A cell is a single 64-bit word carrying both the type and the value.
+ * Doubles are stored as such. Everything else is NaN-boxed: the top 13
+ * bits are all set, bits 48 - 50 hold the type and the low 48 bits the
+ * integer or pointer. Any NaN is canonicalized when stored, so a real
+ * double never looks tagged. This relies on user space pointers fitting
+ * in 48 bits, which holds for all our 32- and 64-bit targets.
+ */
+
+typedef uint64_t vm_cell_t;
+
+#define VM_CELL_TAGGED  0xfff8000000000000ULL /* mask/value of tagged cells */
+#define VM_CELL_PAYLOAD 0x0000ffffffffffffULL /* payload of tagged cells */
+#define VM_CELL_NAN     0x7ff8000000000000ULL /* canonical NaN */
+
+#define VM_CELL_IS_TAGGED(c) (((c) & VM_CELL_TAGGED) == VM_CELL_TAGGED)
+#define VM_CELL_TYPE(c)                                                 \
+    (VM_CELL_IS_TAGGED(c) ? (int)(((c) >> 48) & 0x7) : VM_TYPE_DOUBLE)
+
+#define VM_CELL_BOX(type, payload)                                      \
+    (VM_CELL_TAGGED | ((vm_cell_t)(type) << 48) |                       \
+     ((vm_cell_t)(payload) & VM_CELL_PAYLOAD))
+
+#define VM_CELL_UNKNOWN   VM_CELL_BOX(VM_TYPE_UNKNOWN, 0)
+#define VM_CELL_NIL       VM_CELL_BOX(VM_TYPE_NIL, 0)
+#define VM_CELL_INT(i)    VM_CELL_BOX(VM_TYPE_INTEGER, (uint32_t)(i))
+#define VM_CELL_STRING(s) VM_CELL_BOX(VM_TYPE_STRING, (uintptr_t)(s))
+#define VM_CELL_GLOBAL(g) VM_CELL_BOX(VM_TYPE_GLOBAL, (uintptr_t)(g))
+#define VM_CELL_FIELD(q)  VM_CELL_BOX(VM_TYPE_FIELD, (uint32_t)(q))
+#define VM_CELL_DOUBLE(dbl) ({                                          \
+            union { double d; vm_cell_t c; } __u;                       \
+            __u.d = (dbl);                                              \
+            __u.d != __u.d ? VM_CELL_NAN : __u.c;                       \
+        })
+
+#define VM_CELL_TO_INT(c)    ((int)(int32_t)(uint32_t)(c))
+#define VM_CELL_TO_STRING(c) ((char *)(uintptr_t)((c) & VM_CELL_PAYLOAD))
+#define VM_CELL_TO_GLOBAL(c) ((vm_global_t *)(uintptr_t)((c) & VM_CELL_PAYLOAD))
+#define VM_CELL_TO_FIELD(c)  ((GQuark)(uint32_t)(c))
+#define VM_CELL_TO_DOUBLE(cell) ({                                      \
+            union { double d; vm_cell_t c; } __u;                       \
+            __u.c = (cell);                                             \
+            __u.d;                                                      \
+        })
+
+/* box a type and vm_value_t into a cell */
+#define VM_CELL_PACK(type, v) ({                                        \
+            vm_cell_t __c;                                              \
+            switch (type) {                                             \
+            case VM_TYPE_INTEGER: __c = VM_CELL_INT((v).i);    break;   \
+            case VM_TYPE_DOUBLE:  __c = VM_CELL_DOUBLE((v).d); break;   \
+            case VM_TYPE_STRING:  __c = VM_CELL_STRING((v).s); break;   \
+            case VM_TYPE_GLOBAL:  __c = VM_CELL_GLOBAL((v).g); break;   \
+            case VM_TYPE_FIELD:   __c = VM_CELL_FIELD((v).q);  break;   \
+            default:              __c = VM_CELL_BOX(type, 0);  break;   \
+            }                                                           \
+            __c;                                                        \
+        })
+
+/* unbox a cell into a vm_value_t, evaluating to its type */
+#define VM_CELL_UNPACK(c, vp) ({                                        \
+            vm_cell_t __c = (c);                                        \
+            int       __t = VM_CELL_TYPE(__c);                          \
+            switch (__t) {                                              \
+            case VM_TYPE_INTEGER: (vp)->i = VM_CELL_TO_INT(__c);    break; \
+            case VM_TYPE_DOUBLE:  (vp)->d = VM_CELL_TO_DOUBLE(__c); break; \
+            case VM_TYPE_STRING:  (vp)->s = VM_CELL_TO_STRING(__c); break; \
+            case VM_TYPE_GLOBAL:  (vp)->g = VM_CELL_TO_GLOBAL(__c); break; \
+            case VM_TYPE_FIELD:   (vp)->q = VM_CELL_TO_FIELD(__c);  break; \
+            default:                                                break; \
+            }                                                           \
+            __t;                                                        \
+        })
+
+
+/* unpacked values, as passed to DRES_ACTION handlers */
 typedef struct vm_stack_entry_s {
     vm_value_t v;                             /* actual value on the stack */
     int        type;                          /* type of the value */
@@ -106,9 +247,9 @@ typedef struct vm_stack_entry_s {
 
 
 typedef struct vm_stack_s {
-    vm_stack_entry_t *entries;                /* actual stack entries */
-    int               nentry;                 /* top of the stack */
-    int               nalloc;                 /* size of the stack */
+    vm_cell_t *entries;                       /* actual stack entries */
+    int        nentry;                        /* top of the stack */
+    int        nalloc;                        /* size of the stack */
 } vm_stack_t;
 
 
@@ -118,16 +259,24 @@ typedef struct vm_stack_s {
 typedef struct vm_scope_s vm_scope_t;
 
 struct vm_scope_s {
-    vm_scope_t       *parent;                 /* parent scope */
-    unsigned int      nvariable;              /* number of variables */
-    vm_stack_entry_t  variables[0];           /* variable table */
+    unsigned int  nvariable;                  /* number of variables */
+    vm_cell_t     variables[0];               /* variable table */
 };
 
+#define VM_SCOPE_SIZE(n) (sizeof(vm_scope_t) + (n) * sizeof(vm_cell_t))
+
 
 /*
  * VM instructions
+ *
+ * Every instruction is a single 32-bit word with an 8-bit opcode and 24
+ * bits of arguments. Operands that do not fit (doubles, strings, global
+ * names and integers outside the inline range) live in the constant pool
+ * of the chunk and are referred to by their index.
  */
 
+typedef uint32_t vm_instr_t;
+
 typedef enum {
     VM_OP_UNKNOWN = 0,
     VM_OP_PUSH,                               /* push a value or scope */
@@ -143,77 +292,75 @@ typedef enum {
     VM_OP_DEBUG,                              /* VM debugging */
     VM_OP_HALT,                               /* stop VM execution */
     VM_OP_REPLACE,                            /* global replacement */
+    VM_OP_SELECT,                             /* push and filter global */
     VM_OP_MAXCODE = 0xff
 } vm_opcode_t;
 
 
 #define VM_OP_CODE(instr)      ((instr) & 0xff)
 #define VM_OP_ARGS(instr)      ((instr) >> 8)
-#define VM_INSTR(opcode, args) ((opcode) | ((args) << 8))
+#define VM_INSTR(opcode, args) ((opcode) | ((vm_instr_t)(args) << 8))
 
 
 /*
  * PUSH instructions
+ *
+ * Small non-negative integers are inlined as value + 1. Everything else
+ * is pushed from the constant pool, with VM_PUSH_CONST set in the type
+ * and the pool index as data.
  */
 
-#define VM_PUSH_TYPE(instr) (VM_OP_ARGS(instr) & 0xff)
+#define VM_PUSH_CONST       0x80
+#define VM_PUSH_TYPE(instr) (VM_OP_ARGS(instr) & 0x7f)
 #define VM_PUSH_DATA(instr) (VM_OP_ARGS(instr) >> 8)
+#define VM_PUSH_IS_CONST(instr) (VM_OP_ARGS(instr) & VM_PUSH_CONST)
 #define VM_PUSH_INSTR(t, d)  VM_INSTR(VM_OP_PUSH, (((d) << 8) | ((t) & 0xff)))
 
+#define VM_PUSH_MAXINT  0xfffd                /* max. inlined integer */
+#define VM_CONST_MAXIDX 0xffff                /* max. constant pool index */
+
+#define VM_INSTR_PUSH_CONST(c, errlbl, ec, type, valp) do {             \
+        vm_instr_t instr;                                               \
+        int        idx;                                                 \
+        ec = vm_chunk_const(c, type, valp, &idx);                       \
+        if (ec)                                                         \
+            goto errlbl;                                                \
+        instr = VM_PUSH_INSTR((type) | VM_PUSH_CONST, idx);             \
+        ec    = vm_chunk_add(c, &instr, 1, sizeof(instr));              \
+        if (ec)                                                         \
+            goto errlbl;                                                \
+    } while (0)
+
 #define VM_INSTR_PUSH_INT(c, errlbl, ec, val) do {                      \
-        if (0 <= val && val < 0xfffe) {                                 \
-            uintptr_t instr;                                            \
-            instr = VM_PUSH_INSTR(VM_TYPE_INTEGER, val + 1);            \
+        int __val = (val);                                              \
+        if (0 <= __val && __val <= VM_PUSH_MAXINT) {                    \
+            vm_instr_t instr;                                           \
+            instr = VM_PUSH_INSTR(VM_TYPE_INTEGER, __val + 1);          \
             ec = vm_chunk_add(c, &instr, 1, sizeof(instr));             \
             if (ec)                                                     \
                 goto errlbl;                                            \
         }                                                               \
-        else {                                                          \
-            uintptr_t instr[2];                                         \
-            instr[0] = VM_PUSH_INSTR(VM_TYPE_INTEGER, 0);               \
-            instr[1] = val;                                             \
-            ec = vm_chunk_add(c, instr, 1, sizeof(instr));              \
-            if (ec)                                                     \
-                goto errlbl;                                            \
-        }                                                               \
+        else                                                            \
+            VM_INSTR_PUSH_CONST(c, errlbl, ec,                          \
+                                VM_TYPE_INTEGER, &__val);               \
     } while (0)
 
 #define VM_INSTR_PUSH_DOUBLE(c, errlbl, ec, val) do {                   \
-        uintptr_t instr[1 + VM_ALIGN_TO_INSTR(sizeof(double))];         \
-        double   *dp = (double *)&instr[1];                             \
-        instr[0] = VM_PUSH_INSTR(VM_TYPE_DOUBLE, 0);                    \
-        *dp      = val;                                                 \
-        ec       = vm_chunk_add(c, instr, 1, sizeof(instr));            \
-        if (ec)                                                         \
-            goto errlbl;                                                \
+        double __val = (val);                                           \
+        VM_INSTR_PUSH_CONST(c, errlbl, ec, VM_TYPE_DOUBLE, &__val);     \
     } while (0)
 
-#define VM_INSTR_PUSH_STRING(c, errlbl, ec, val) do {                   \
-        int           len = strlen(val) + 1;                            \
-        int           n   = VM_ALIGN_TO_INSTR(len);                     \
-        uintptr_t     instr[1 + n];                                     \
-        instr[0] = VM_PUSH_INSTR(VM_TYPE_STRING, len);                  \
-        strcpy((char *)(instr + 1), val);                               \
-        /* could pad here with zeros if (len & 0x3) */                  \
-        ec = vm_chunk_add(c, instr, 1, sizeof(instr));                  \
-        if (ec)                                                         \
-            goto errlbl;                                                \
-    } while (0)
+#define VM_INSTR_PUSH_STRING(c, errlbl, ec, val)                        \
+    VM_INSTR_PUSH_CONST(c, errlbl, ec, VM_TYPE_STRING, (void *)(val))
 
-#define VM_INSTR_PUSH_GLOBAL(c, errlbl, ec, val) do {                   \
-        int           len = strlen(val) + 1;                            \
-        int           n   = VM_ALIGN_TO_INSTR(len);                     \
-        uintptr_t     instr[1 + n];                                     \
-        instr[0] = VM_PUSH_INSTR(VM_TYPE_GLOBAL, len);                  \
-        strcpy((char *)(instr + 1), val);                               \
-        /* could pad here with zeros if (len & 0x3) */                  \
-        ec = vm_chunk_add(c, instr, 1, sizeof(instr));                  \
-        if (ec)                                                         \
-            goto errlbl;                                                \
-    } while (0)
+#define VM_INSTR_PUSH_GLOBAL(c, errlbl, ec, val)                        \
+    VM_INSTR_PUSH_CONST(c, errlbl, ec, VM_TYPE_GLOBAL, (void *)(val))
+
+#define VM_INSTR_PUSH_FIELD(c, errlbl, ec, val)                         \
+    VM_INSTR_PUSH_CONST(c, errlbl, ec, VM_TYPE_FIELD, (void *)(val))
 
 #define VM_INSTR_PUSH_LOCALS(c, errlbl, ec, nvar) do {                  \
-        uintptr_t instr;                                                \
+        vm_instr_t instr;                                               \
         instr = VM_PUSH_INSTR(VM_TYPE_LOCAL, nvar);                     \
         ec = vm_chunk_add(c, &instr, 1, sizeof(instr));                 \
         if (ec)                                                         \
@@ -231,7 +378,7 @@ enum {
 };
 
 #define VM_INSTR_POP_LOCALS(c, errlbl, ec) do {                         \
-        uintptr_t instr;                                                \
+        vm_instr_t instr;                                               \
         instr = VM_INSTR(VM_OP_POP, VM_POP_LOCALS);                     \
         ec = vm_chunk_add(c, &instr, 1, sizeof(instr));                 \
         if (ec)                                                         \
@@ -240,7 +387,7 @@ enum {
 
 
 #define VM_INSTR_POP_DISCARD(c, errlbl, ec) do {                        \
-        uintptr_t instr;                                                \
+        vm_instr_t instr;                                               \
         instr = VM_INSTR(VM_OP_POP, VM_POP_DISCARD);                    \
         ec = vm_chunk_add(c, &instr, 1, sizeof(instr));                 \
         if (ec)                                                         \
@@ -255,7 +402,7 @@ enum {
 #define VM_FILTER_NFIELD(instr) VM_OP_ARGS(instr)
 
 #define VM_INSTR_FILTER(c, errlbl, ec, n) do {                          \
-        uintptr_t instr;                                                \
+        vm_instr_t instr;                                               \
         instr = VM_INSTR(VM_OP_FILTER, n);                              \
         ec = vm_chunk_add(c, &instr, 1, sizeof(instr));                 \
         if (ec)                                                         \
@@ -272,8 +419,8 @@ enum {
 #define VM_UPDATE_PARTIAL(instr) (VM_OP_ARGS(instr) & VM_ASSIGN_PARTIAL)
 
 #define VM_INSTR_UPDATE(c, errlbl, ec, n, partial) do {                 \
-        uintptr_t instr;                                                \
-        uintptr_t mod = n | (partial ? VM_ASSIGN_PARTIAL : 0);          \
+        vm_instr_t instr;                                               \
+        vm_instr_t mod = n | (partial ? VM_ASSIGN_PARTIAL : 0);         \
         instr = VM_INSTR(VM_OP_UPDATE, mod);                            \
         ec = vm_chunk_add(c, &instr, 1, sizeof(instr));                 \
         if (ec)                                                         \
@@ -287,8 +434,8 @@ enum {
 
 #define VM_REPLACE_NFIELD(instr) (VM_OP_ARGS(instr))
 #define VM_INSTR_REPLACE(c, errlbl, ec, n) do {                         \
-        uintptr_t instr;                                                \
-        uintptr_t mod = n;                                              \
+        vm_instr_t instr;                                               \
+        vm_instr_t mod = n;                                             \
         instr = VM_INSTR(VM_OP_REPLACE, mod);                           \
         ec = vm_chunk_add(c, &instr, 1, sizeof(instr));                 \
         if (ec)                                                         \
@@ -303,7 +450,7 @@ enum {
 #define VM_CREATE_NFIELD(instr) VM_OP_ARGS(instr)
 
 #define VM_INSTR_CREATE(c, errlbl, ec, n) do {                          \
-        uintptr_t instr;                                                \
+        vm_instr_t instr;                                               \
         instr = VM_INSTR(VM_OP_CREATE, n);                              \
         ec = vm_chunk_add(c, &instr, 1, sizeof(instr));                 \
         if (ec)                                                         \
@@ -321,7 +468,7 @@ enum {
 };
 
 #define VM_INSTR_SET(c, errlbl, ec) do {                                \
-        uintptr_t instr;                                                \
+        vm_instr_t instr;                                               \
         instr = VM_INSTR(VM_OP_SET, VM_SET_NONE);                       \
         ec = vm_chunk_add(c, &instr, 1, sizeof(instr));                 \
         if (ec)                                                         \
@@ -329,7 +476,7 @@ enum {
     } while (0)
 
 #define VM_INSTR_SET_FIELD(c, errlbl, ec) do {                          \
-        uintptr_t instr;                                                \
+        vm_instr_t instr;                                               \
         instr = VM_INSTR(VM_OP_SET, VM_SET_FIELD);                      \
         ec = vm_chunk_add(c, &instr, 1, sizeof(instr));                 \
         if (ec)                                                         \
@@ -348,7 +495,7 @@ enum {
 };
 
 #define VM_INSTR_GET_FIELD(c, errlbl, ec) do {                          \
-        uintptr_t instr;                                                \
+        vm_instr_t instr;                                               \
         instr = VM_INSTR(VM_OP_GET, VM_GET_FIELD);                      \
         ec = vm_chunk_add(c, &instr, 1, sizeof(instr));                 \
         if (ec)                                                         \
@@ -356,7 +503,7 @@ enum {
     } while (0)
 
 #define VM_INSTR_GET_LOCAL(c, errlbl, ec, idx) do {                     \
-        uintptr_t instr;                                                \
+        vm_instr_t instr;                                               \
         instr = VM_INSTR(VM_OP_GET, VM_GET_LOCAL | idx);                \
         ec    = vm_chunk_add(c, &instr, 1, sizeof(instr));              \
         if (ec)                                                         \
@@ -366,10 +513,26 @@ enum {
 
 /*
  * CALL instructions
+ *
+ * The peephole optimizer (cf. vm_chunk_optimize) folds the preceding push
+ * of the method ID and any following POP DISCARD into the call. The method
+ * ID is then encoded in the instruction and the number of arguments is
+ * limited to 8 bits.
  */
 
+#define VM_CALL_DISCARD 0x800000              /* discard return value */
+#define VM_CALL_METHOD  0x400000              /* method ID inlined */
+#define VM_CALL_MAXID   0x3fff
+
+#define VM_CALL_FLAGS(instr) (VM_OP_ARGS(instr) & (VM_CALL_DISCARD |    \
+                                                   VM_CALL_METHOD))
+#define VM_CALL_NARG(instr) (VM_OP_ARGS(instr) &                        \
+                             (VM_OP_ARGS(instr) & VM_CALL_METHOD ?      \
+                              0xff : (VM_CALL_METHOD - 1)))
+#define VM_CALL_ID(instr)   ((VM_OP_ARGS(instr) >> 8) & VM_CALL_MAXID)
+
 #define VM_INSTR_CALL(c, errlbl, ec, narg) do {                         \
-        uintptr_t instr;                                                \
+        vm_instr_t instr;                                               \
         instr = VM_INSTR(VM_OP_CALL, narg);                             \
         ec    = vm_chunk_add(c, &instr, 1, sizeof(instr));              \
         if (ec)                                                         \
@@ -397,7 +560,7 @@ typedef enum {
 #define VM_CMP_RELOP(instr) ((vm_relop_t)VM_OP_ARGS(instr))
 
 #define VM_INSTR_CMP(c, errlbl, ec, op) do {                    \
-        uintptr_t instr;                                        \
+        vm_instr_t instr;                                       \
         instr = VM_INSTR(VM_OP_CMP, (vm_relop_t)op);            \
         ec    = vm_chunk_add(c, &instr, 1, sizeof(instr));      \
         if (ec)                                                 \
@@ -425,7 +588,7 @@ typedef enum {
     __diff; })
 
 #define VM_INSTR_BRANCH(c, errlbl, ec, type, diff) ({           \
-        uintptr_t instr;                                        \
+        vm_instr_t instr;                                       \
         intptr_t  __d, __t;                                     \
         intptr_t  __offs;                                       \
         __d = (diff);                                           \
@@ -438,12 +601,12 @@ typedef enum {
         ec    = vm_chunk_add(c, &instr, 1, sizeof(instr));      \
         if (ec)                                                 \
             goto errlbl;                                        \
-        __offs = (c)->nsize / sizeof(uintptr_t) - 1;            \
+        __offs = (c)->nsize / sizeof(vm_instr_t) - 1;           \
         __offs;                                                 \
         })
 
 #define VM_BRANCH_PATCH(c, offs, errlbl, ec, type, diff) do {   \
-        uintptr_t *instr = (c)->instrs + (offs);                \
+        vm_instr_t *instr = (c)->instrs + (offs);               \
         intptr_t  __d, __t;                                     \
         __d = (diff);                                           \
         if (__d < 0)                                            \
@@ -454,23 +617,36 @@ typedef enum {
         *instr = VM_INSTR(VM_OP_BRANCH, __t | __d);             \
     } while (0)
 
-#define VM_CHUNK_OFFSET(c) ((c)->nsize / sizeof(uintptr_t))
+#define VM_CHUNK_OFFSET(c) ((c)->nsize / sizeof(vm_instr_t))
+
+
+/*
+ * SELECT instructions
+ *
+ * A fused PUSH GLOBAL and FILTER, generated by the peephole optimizer. The
+ * instruction is followed by the original PUSH GLOBAL then a PUSH INT
+ * relop, a constant or local value and a PUSH FIELD field name for each
+ * selector, all of which are decoded inline instead of being executed.
+ */
+
+#define VM_SELECT_NFIELD(instr) VM_OP_ARGS(instr)
+#define VM_SELECT_INSTR(n)      VM_INSTR(VM_OP_SELECT, n)
 
 /*
  * DEBUG instructions
  */
 
-#define VM_DEBUG_LEN(instr) VM_OP_ARGS(instr)
-#define VM_DEBUG_INSTR(len) VM_INSTR(VM_OP_DEBUG, len)
+#define VM_DEBUG_IDX(instr) VM_OP_ARGS(instr)
+#define VM_DEBUG_INSTR(idx) VM_INSTR(VM_OP_DEBUG, idx)
 
 #define VM_INSTR_DEBUG(c, errlbl, ec, val) do {                         \
-        int           len = strlen(val) + 1;                            \
-        int           n   = VM_ALIGN_TO_INSTR(len);                     \
-        uintptr_t     instr[1 + n];                                     \
-        instr[0] = VM_DEBUG_INSTR(len);                                 \
-        strcpy((char *)(instr + 1), val);                               \
-        /* could pad here with zeros if (len & 0x3) */                  \
-        ec = vm_chunk_add(c, instr, 1, sizeof(instr));                  \
+        vm_instr_t instr;                                               \
+        int        idx;                                                 \
+        ec = vm_chunk_const(c, VM_TYPE_STRING, (void *)(val), &idx);    \
+        if (ec)                                                         \
+            goto errlbl;                                                \
+        instr = VM_DEBUG_INSTR(idx);                                    \
+        ec    = vm_chunk_add(c, &instr, 1, sizeof(instr));              \
         if (ec)                                                         \
             goto errlbl;                                                \
     } while (0)
@@ -482,7 +658,7 @@ typedef enum {
  */
 
 #define VM_INSTR_HALT(c, errlbl, ec) do {                       \
-        uintptr_t instr;                                        \
+        vm_instr_t instr;                                       \
         instr = VM_INSTR(VM_OP_HALT, 0);                        \
         ec    = vm_chunk_add(c, &instr, 1, sizeof(instr));      \
         if (ec)                                                 \
@@ -496,26 +672,66 @@ typedef enum {
  */
 
 typedef struct vm_chunk_s {
-    uintptr_t    *instrs;                    /* actual VM instructions */
+    vm_instr_t   *instrs;                    /* actual VM instructions */
     int           ninstr;                    /* number of instructions */
     int           nsize;                     /* code size in bytes */
     int           nleft;                     /* number of bytes free */
+    char         *consts;                    /* constant pool */
+    int           nconst;                    /* pool size in bytes */
+    int           cleft;                     /* number of pool bytes free */
+    GQuark       *quarks;                    /* field names, by pool index */
+    int           nquark;                    /* size of quarks */
+    int           maxdepth;                  /* max. stack depth if verified */
+    int           flags;                     /* VM_CHUNK_* */
 } vm_chunk_t;
 
+enum {
+    VM_CHUNK_VERIFIED = 0x1,                 /* passed vm_chunk_verify */
+    VM_CHUNK_TYPED    = 0x2,                 /* checked operand types known */
+};
+
+
+/*
+ * constant pool
+ *
+ * The pool is a byte array kept in network byte order, so it can be saved
+ * and loaded as is. Constants are aligned to VM_CONST_ALIGN bytes and are
+ * referred to by their offset in such units. Integers take 4, doubles 8
+ * bytes, strings, global and field names are stored with their terminating
+ * \0. Field names are also resolved to quarks, when added to the pool or
+ * when the chunk is loaded, so the interpreter never needs to hash them.
+ */
+
+#define VM_CONST_ALIGN 4
+#define VM_CONST_ADDR(c, idx)   ((c)->consts + (idx) * VM_CONST_ALIGN)
+#define VM_CONST_STRING(c, idx) ((char *)VM_CONST_ADDR(c, idx))
+
 
 /*
  * VM function calls
  */
 
+/*
+ * Notes: Native handlers get their arguments as cells straight off the
+ *        VM stack. Classic handlers get them unpacked into a temporary
+ *        array of vm_stack_entry_t's (and have their return value packed
+ *        back), so existing DRES_ACTION handlers keep working unchanged.
+ */
+
 typedef int (*vm_action_t)(void *data, char *name,
                            vm_stack_entry_t *args, int narg,
                            vm_stack_entry_t *retval);
 
+typedef int (*vm_native_t)(void *data, char *name,
+                           vm_cell_t *args, int narg, vm_cell_t *retval);
+
 typedef struct vm_method_s {
     char        *name;                       /* function name */
     int          id;                         /* function ID */
-    vm_action_t  handler;                    /* function handler */
+    vm_action_t  handler;                    /* classic function handler */
+    vm_native_t  native;                     /* native function handler */
     void        *data;                       /* opaque user data */
+    int          pure;                       /* no effects but return value */
 } vm_method_t;
 
 
@@ -548,7 +764,7 @@ typedef struct vm_catch_s vm_catch_t;
 struct vm_catch_s {
     jmp_buf         location;                  /* catch exceptions here */
     int             depth;                     /* stack depth upon entry */
-    vm_scope_t     *scope;                     /* locals upon entry */
+    int             scope;                     /* scope depth upon entry */
     vm_exception_t  exception;                 /* exception details */
     vm_catch_t     *prev;                      /* previous entry if any */
 };
@@ -576,7 +792,7 @@ struct vm_catch_s {
         VM_RESET_EXCEPTION(&__catch.exception);                         \
         __catch.prev  = vm->catch;                                      \
         __catch.depth = vm->stack ? vm->stack->nentry : 0;              \
-        __catch.scope = vm->scope;                                      \
+        __catch.scope = vm->nscope;                                     \
         vm->catch     = &__catch;                                       \
                                                                         \
         if ((__status = setjmp(__catch.location)) != 0) {               \
@@ -626,9 +842,9 @@ struct vm_catch_s {
                 vm_stack_cleanup(vm->stack,                             \
                                  vm->stack->nentry - __catch.depth);    \
             }                                                           \
-            if (vm->scope != __catch.scope) {                           \
+            if (vm->nscope > __catch.scope) {                           \
                 VM_INFO("cleaning up the local/scope stack...");        \
-                while (vm->scope && vm->scope != __catch.scope)         \
+                while (vm->nscope > __catch.scope)                      \
                     vm_scope_pop(vm);                                   \
             }                                                           \
                                                                         \
@@ -678,6 +894,11 @@ struct vm_catch_s {
 enum {
     VM_FLAG_UNKNOWN  = 0x0,
     VM_FLAG_COMPILED = 0x1,                   /* loaded as precompiled */
+    VM_FLAG_DIGEST   = 0x2,                   /* hash facts written by code */
+    VM_FLAG_OPAQUE   = 0x4,                   /* code had unhashed effects */
+    VM_FLAG_VERIFIED = 0x8,                   /* running verified code */
+    VM_FLAG_TYPED    = 0x10,                  /* ... with known operand types */
+    VM_FLAG_WRITTEN  = 0x20,                  /* code wrote hashed facts */
 };
 
 
@@ -691,18 +912,28 @@ typedef struct vm_state_s {
     vm_stack_t    *stack;                     /* VM stack */
 
     vm_chunk_t    *chunk;                     /* code being executed */
-    uintptr_t     *pc;                        /* program counter */
+    vm_instr_t    *pc;                        /* program counter */
     int            ninstr;                    /* # of instructions left */
     int            nsize;                     /* of code left */
 
     vm_method_t   *methods;                   /* action handlers */
     int            nmethod;                   /* number of actions */
     vm_scope_t    *scope;                     /* current local variables */
+    char          *scopes;                    /* scope arena */
+    int            nscope;                    /* number of active scopes */
+    int            nscopealloc;               /* size of the arena */
     int            nlocal;                    /* number of local variables */
     char         **names;                     /* names of local variables */
 
+    vm_gpool_t     gpool;                     /* pool of globals */
+    GHashTable    *gcache;                    /* cached facts by name */
+    unsigned int   gstamp;                    /* fact cache stamp */
+    vm_batch_t     batch;                     /* queued fact store writes */
+    int            nexec;                     /* vm_exec nesting depth */
+
     vm_catch_t    *catch;                     /* catch exceptions here */
     int            flags;
+    uint64_t       digest;                    /* hash of facts written */
 
     const char    *info;                      /* debug info for current pc */
 } vm_state_t;
@@ -724,8 +955,9 @@ int vm_push_int   (vm_stack_t *s, int i);
 int vm_push_double(vm_stack_t *s, double d);
 int vm_push_string(vm_stack_t *s, char *str);
 int vm_push_global(vm_stack_t *s, vm_global_t *g);
+int vm_push_cell  (vm_stack_t *s, vm_cell_t c);
 
-vm_stack_entry_t *vm_args(vm_stack_t *s, int narg);
+vm_cell_t *vm_args(vm_stack_t *s, int narg);
 
 int         vm_pop (vm_stack_t *s, vm_value_t *value);
 int         vm_peek(vm_stack_t *s, int idx, vm_value_t *value);
@@ -733,17 +965,33 @@ int         vm_peek(vm_stack_t *s, int idx, vm_value_t *value);
 int         vm_pop_int   (vm_stack_t *s);
 double      vm_pop_double(vm_stack_t *s);
 char        *vm_pop_string(vm_stack_t *s);
+GQuark       vm_pop_field (vm_stack_t *s);
 vm_global_t *vm_pop_global(vm_stack_t *s);
 
 
 /* vm-instr.c */
-vm_chunk_t   *vm_chunk_new (int ninstr);
-void          vm_chunk_del (vm_chunk_t *chunk);
-uintptr_t    *vm_chunk_grow(vm_chunk_t *c, int nsize);
-int           vm_chunk_add (vm_chunk_t *c,
-                            uintptr_t *code, int ninstr, int nsize);
+vm_chunk_t   *vm_chunk_new  (int ninstr);
+void          vm_chunk_del  (vm_chunk_t *chunk);
+vm_instr_t   *vm_chunk_grow (vm_chunk_t *c, int nsize);
+int           vm_chunk_add  (vm_chunk_t *c,
+                             vm_instr_t *code, int ninstr, int nsize);
+int           vm_chunk_const(vm_chunk_t *c, int type, void *value, int *idx);
+int           vm_chunk_resolve(vm_chunk_t *c);
+
+int    vm_const_int   (vm_chunk_t *c, int idx);
+double vm_const_double(vm_chunk_t *c, int idx);
+GQuark vm_const_field (vm_chunk_t *c, int idx);
 
 int vm_run(vm_state_t *vm);
+int vm_instr_size(vm_instr_t *pc);
+
+
+/* vm-peephole.c */
+int vm_chunk_optimize(vm_chunk_t *c);
+
+
+/* vm-verify.c */
+int vm_chunk_verify(vm_chunk_t *c);
 
 
 /* vm-method.c */
@@ -752,6 +1000,11 @@ int          vm_method_add    (vm_state_t *vm,
 int          vm_method_del    (vm_state_t *vm, char *name, vm_action_t handler);
 int          vm_method_set    (vm_state_t *vm, char *name,
                                vm_action_t handler, void *data);
+int          vm_method_add_native(vm_state_t *vm, char *name,
+                                  vm_native_t native, void *data);
+int          vm_method_set_native(vm_state_t *vm, char *name,
+                                  vm_native_t native, void *data);
+int          vm_method_pure   (vm_state_t *vm, char *name);
 vm_method_t *vm_method_lookup (vm_state_t *vm, char *name);
 vm_method_t *vm_method_by_id  (vm_state_t *vm, int id);
 int          vm_method_id     (vm_state_t *vm, char *name);
@@ -768,9 +1021,22 @@ int  vm_exec(vm_state_t *vm, vm_chunk_t *code);
 
 
 /* vm-global.c */
-int          vm_global_lookup(char *name, vm_global_t **gp);
-vm_global_t *vm_global_name  (char *name);
+int          vm_global_lookup(vm_state_t *vm, char *name, vm_global_t **gp);
+vm_global_t *vm_global_name  (vm_state_t *vm, char *name);
 vm_global_t *vm_global_alloc (int nfact);
+vm_global_t *vm_global_pool_alloc(vm_state_t *vm, int nfact);
+void         vm_global_pool_reset(vm_state_t *vm, int keep);
+
+void         vm_global_cache_invalidate(vm_state_t *vm, const char *name);
+void         vm_global_cache_reset     (vm_state_t *vm);
+void         vm_global_cache_free      (vm_state_t *vm);
+
+void         vm_global_index_invalidate(vm_state_t *vm, const char *name);
+int          vm_global_select(vm_state_t *vm, char *name, GQuark field,
+                              int type, vm_value_t *value, vm_global_t **gp);
+int          vm_global_filter(vm_state_t *vm, vm_global_t *g, GQuark field,
+                              int type, vm_value_t *value, int neq,
+                              int *nfactp);
 
 void         vm_global_free  (vm_global_t *g);
 void         vm_global_print (FILE *fp, vm_global_t *g);
@@ -779,36 +1045,55 @@ void         vm_global_print (FILE *fp, vm_global_t *g);
 GSList      *vm_fact_lookup(char *name);
 void         vm_fact_reset (OhmFact *fact);
 OhmFact     *vm_fact_dup   (OhmFact *src, char *name);
-OhmFact     *vm_fact_copy  (OhmFact *dst, OhmFact *src);
-OhmFact     *vm_fact_update(OhmFact *dst, OhmFact *src);
+int          vm_fact_copy  (OhmFact *dst, OhmFact *src);
+int          vm_fact_update(OhmFact *dst, OhmFact *src);
 
 void         vm_fact_remove(char *name);
 void         vm_fact_remove_instance(OhmFact *fact);
 
 void         vm_fact_insert(OhmFact *fact);
 
-int          vm_fact_set_field  (vm_state_t *vm, OhmFact *fact, char *field,
+int          vm_batch_insert(vm_state_t *vm, OhmFact *fact);
+int          vm_batch_remove(vm_state_t *vm, OhmFact *fact);
+int          vm_batch_flush (vm_state_t *vm);
+void         vm_batch_free  (vm_state_t *vm);
+
+int          vm_fact_set_field  (vm_state_t *vm, OhmFact *fact, GQuark field,
                                  int type, vm_value_t *value);
-int          vm_fact_get_field  (vm_state_t *vm, OhmFact *fact, char *field,
+int          vm_fact_get_field  (vm_state_t *vm, OhmFact *fact, GQuark field,
                                  vm_value_t *value);
-int          vm_fact_match_field(vm_state_t *vm, OhmFact *fact, char *field,
+int          vm_fact_match_field(vm_state_t *vm, OhmFact *fact, GQuark field,
                                  GValue *gval, int type, vm_value_t *value);
+int          vm_value_match     (GValue *gval, int type, vm_value_t *value);
 
-int          vm_fact_collect_fields(OhmFact *f, char **fields, int nfield,
+int          vm_fact_collect_fields(OhmFact *f, GQuark *fields, int nfield,
                                     GValue **values);
-int          vm_fact_matches       (OhmFact *f, char **fields, GValue **values,
-                                    int nfield);
+int          vm_fact_matches       (OhmFact *f, GQuark *fields,
+                                    GValue **values, int nfield);
 int          vm_global_find_first(vm_global_t *g,
-                                  char **fields, GValue **values, int nfield);
+                                  GQuark *fields, GValue **values, int nfield);
 int          vm_global_find_next(vm_global_t *g, int idx,
-                                 char **fields, GValue **values, int nfield);
+                                 GQuark *fields, GValue **values, int nfield);
+
+void         vm_join_init (vm_join_t *j, vm_global_t *g,
+                           GQuark *fields, int nfield);
+void         vm_join_exit (vm_join_t *j);
+int          vm_join_first(vm_join_t *j, vm_global_t *g, GValue **values);
+int          vm_join_next (vm_join_t *j, vm_global_t *g, int idx,
+                           GValue **values);
 
 void vm_fact_print(FILE *fp, OhmFact *fact);
+void vm_fact_digest(vm_state_t *vm, OhmFact *fact, int removed);
+void vm_field_digest(vm_state_t *vm, OhmFact *fact, GQuark field);
+uint64_t vm_value_hash(GValue *value);
+uint64_t vm_hash_mix(uint64_t k);
+uint64_t vm_fact_hash (OhmFact *fact);
 
 
 /* vm-local.c */
-int vm_scope_push(vm_state_t *vm);
-int vm_scope_pop (vm_state_t *vm);
+int  vm_scope_push(vm_state_t *vm);
+int  vm_scope_pop (vm_state_t *vm);
+void vm_free_scopes(vm_state_t *vm);
 
 int vm_scope_set(vm_scope_t *scope, int id, int type, vm_value_t value);
 int vm_scope_get(vm_scope_t *scope, int id, vm_value_t *value);
@@ -819,7 +1104,8 @@ void vm_free_varnames(vm_state_t *vm);
 
 /* vm-debug.c */
 int vm_dump_chunk(vm_state_t *vm, char *buf, size_t size, int indent);
-int vm_dump_instr(uintptr_t **pc, char *buf, size_t size, int indent);
+int vm_dump_instr(vm_chunk_t *c, vm_instr_t **pc,
+                  char *buf, size_t size, int indent);
 
 /* vm-log.c */
 void vm_set_logger(void (*logger)(vm_log_level_t, const char *, va_list));
@@ -547,7 +547,7 @@ command_resolve(int id, char *input)
         console_printf(id, "\n");
     }
     
-    dres_update_goal(dres, goal, args);
+    update_goal(goal, args);
 }
 
 
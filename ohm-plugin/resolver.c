@@ -84,8 +84,16 @@ static int  rule_lookup(const char *name, int arity);
 
 static GHashTable *ruletbl;
 
+static int          goals_init(void);
+static void         goals_exit(void);
+static dres_goal_t *goal_lookup(char *goal, char **names, int *cached);
+static int          resolve_goal(char *goal, char **names,
+                                 dres_value_t *values);
 
-static int  resolver_init(const char *ruleset);
+static GHashTable *goaltbl;
+
+
+static int  resolver_init(const char *ruleset, int lazy);
 static void resolver_exit(void);
 
 static dres_handler_t unknown_handler;
@@ -154,6 +162,8 @@ plugin_init(OhmPlugin *plugin)
 {
     char *console = (char *)ohm_plugin_get_param(plugin, "console");
     char *ruleset = (char *)ohm_plugin_get_param(plugin, "ruleset");
+    char *cutoff  = (char *)ohm_plugin_get_param(plugin, "early_cutoff");
+    char *lazy    = (char *)ohm_plugin_get_param(plugin, "lazy_finalize");
 
     if (!OHM_DEBUG_INIT(resolver))
         OHM_WARNING("resolver plugin failed to initialize debugging");
@@ -164,11 +174,18 @@ plugin_init(OhmPlugin *plugin)
     if (ruleset == NULL)
         ruleset = DEFAULT_RULESET;
     
-    if (resolver_init(ruleset) != 0 || rules_init() != 0 ||
+    if (resolver_init(ruleset, lazy != NULL && !strcmp(lazy, "yes")) != 0 ||
+        rules_init() != 0 ||
+        goals_init() != 0 ||
         factstore_init() != 0 || console_init(console) != 0) {
         plugin_exit(plugin);
         exit(1);
     }
+
+    if (cutoff != NULL && !strcmp(cutoff, "yes")) {
+        OHM_INFO("resolver: early cutoff enabled");
+        dres_set_early_cutoff(dres, TRUE);
+    }
     
     OHM_DEBUG(DBG_RESOLVE, "resolver initialized");
     return;
@@ -184,6 +201,7 @@ plugin_exit(OhmPlugin *plugin)
     (void)plugin;
 
     factstore_exit();
+    goals_exit();
     resolver_exit();
     rules_exit();
     console_exit();
@@ -230,7 +248,7 @@ logger(dres_log_level_t level, const char *format, va_list ap)
  * resolver_init
  ********************/
 static int
-resolver_init(const char *ruleset)
+resolver_init(const char *ruleset, int lazy)
 {
     handler_t *h;
 
@@ -257,6 +275,10 @@ resolver_init(const char *ruleset)
     
     unknown_handler = dres_fallback_handler(dres, fallback_handler);
     
+    if (lazy) {
+        OHM_INFO("resolver: lazy finalization enabled");
+        dres_set_lazy_finalize(dres, TRUE);
+    }
 
     /* finalize/check resolver ruleset */
     OHM_DEBUG(DBG_RESOLVE, "Finalizing resolver ruleset...");
@@ -315,6 +337,31 @@ rules_exit(void)
 
 
 
+/********************
+ * goals_init
+ ********************/
+static int
+goals_init(void)
+{
+    goaltbl = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                    (GDestroyNotify)dres_free_prepared);
+    
+    return goaltbl == NULL ? ENOMEM : 0;
+}
+
+
+/********************
+ * goals_exit
+ ********************/
+static void
+goals_exit(void)
+{
+    if (goaltbl != NULL) {
+        g_hash_table_destroy(goaltbl);
+        goaltbl = NULL;
+    }
+}
+
 
 /*****************************************************************************
  *                           *** exported methods ***                        *
@@ -325,12 +372,52 @@ rules_exit(void)
  ********************/
 OHM_EXPORTABLE(int, update_goal, (char *goal, char **locals))
 {
-    int   status;
-    char *result;
+#define MAX_LOCALS 64
+    char         *names[MAX_LOCALS + 1], *result;
+    dres_value_t  values[MAX_LOCALS];
+    unsigned int  type;
+    int           status, i, n;
 
     OHM_DEBUG(DBG_RESOLVE, "resolving goal '%s'", goal);
 
-    status = dres_update_goal(dres, goal, locals);
+    /* decode the local (name, [type,] value) tuples for a prepared goal */
+    for (i = n = 0; locals != NULL && locals[i] != NULL; n++) {
+        if (n >= MAX_LOCALS)
+            break;
+        
+        names[n] = locals[i++];
+        type     = GPOINTER_TO_INT(locals[i++]);
+        
+        if (type < 0xff) {
+            switch (type) {
+            case 's':
+                values[n].type = DRES_TYPE_STRING;
+                values[n].v.s  = locals[i];
+                break;
+            case 'i':
+                values[n].type = DRES_TYPE_INTEGER;
+                values[n].v.i  = GPOINTER_TO_INT(locals[i]);
+                break;
+            case 'd':
+                values[n].type = DRES_TYPE_DOUBLE;
+                values[n].v.d  = *(double *)locals[i];
+                break;
+            default:
+                values[n].type = DRES_TYPE_UNKNOWN;
+            }
+            i++;
+        }
+        else {
+            values[n].type = DRES_TYPE_STRING;
+            values[n].v.s  = locals[i - 1];
+        }
+    }
+    names[n] = NULL;
+
+    if (locals == NULL || locals[i] == NULL)
+        status = resolve_goal(goal, names, values);
+    else
+        status = dres_update_goal(dres, goal, locals);
 
     if      (status >  0) result = "succeeded";
     else if (status == 0) result = "failed";
@@ -338,6 +425,32 @@ OHM_EXPORTABLE(int, update_goal, (char *goal, char **locals))
 
     OHM_DEBUG(DBG_RESOLVE, "resolving goal '%s' %s", goal, result);
     
+    return status;
+#undef MAX_LOCALS
+}
+
+
+/********************
+ * dres/resolve_goals
+ ********************/
+OHM_EXPORTABLE(int, update_goals, (char **goals, char **locals))
+{
+    int   status, ngoal;
+    char *result;
+
+    for (ngoal = 0; goals != NULL && goals[ngoal] != NULL; ngoal++)
+        ;
+
+    OHM_DEBUG(DBG_RESOLVE, "resolving %d goals in one batch", ngoal);
+
+    status = dres_update_goals(dres, goals, ngoal, locals);
+
+    if      (status >  0) result = "succeeded";
+    else if (status == 0) result = "failed";
+    else                  result = "failed with an exception";
+
+    OHM_DEBUG(DBG_RESOLVE, "resolving %d goals %s", ngoal, result);
+    
     return status;
 }
 
@@ -381,7 +494,6 @@ DRES_ACTION(rule_handler)
     vm_global_t   *g = NULL;
     int            i, status;
 
-    (void)data;
     (void)name;
     
     OHM_DEBUG(DBG_RESOLVE, "rule evaluation (prolog handler) entered...");
@@ -430,7 +542,7 @@ DRES_ACTION(rule_handler)
     if (OHM_LOGGED(INFO))
         rules_dump_result(retval);
 
-    if ((g = vm_global_alloc(MAX_FACTS)) == NULL)
+    if ((g = dres_global_alloc((dres_t *)data, MAX_FACTS)) == NULL)
         FAIL(-ENOMEM);
     
     if ((g->nfact = retval_to_facts(retval, g->facts, MAX_FACTS)) < 0)
@@ -472,7 +584,6 @@ DRES_ACTION(fallback_handler)
     vm_global_t   *g = NULL;
     int            i, status;
 
-    (void)data;
     
     OHM_DEBUG(DBG_RESOLVE, "Fallback handler called for '%s'...", name);
     
@@ -517,7 +628,7 @@ DRES_ACTION(fallback_handler)
     if (OHM_LOGGED(INFO))
         rules_dump_result(retval);
 
-    if ((g = vm_global_alloc(MAX_FACTS)) == NULL)
+    if ((g = dres_global_alloc((dres_t *)data, MAX_FACTS)) == NULL)
         FAIL(-ENOMEM);
     
     if ((g->nfact = retval_to_facts(retval, g->facts, MAX_FACTS)) < 0)
@@ -862,10 +973,11 @@ static void delayed_resolve(char *id, char *argt, void **argv)
 {
 #define MAX_ARG 64
 
-    int   argc;
-    char *target;
-    char *vars[MAX_ARG * 3];
-    int   i, j;
+    int           argc;
+    char         *target;
+    char         *names[MAX_ARG / 2 + 1];
+    dres_value_t  values[MAX_ARG / 2];
+    int           i, j;
     
 
     if (id && argt && argv) {
@@ -877,18 +989,34 @@ static void delayed_resolve(char *id, char *argt, void **argv)
             dump_delayed_execution_args("delayed_resolve", -1, id,
                                         "resolve", argt, argv);
 
-            for (i = 1, j = 0;   i < argc;   i += 2) {
+            for (i = 1, j = 0;   i < argc;   i += 2, j++) {
                 if (argt[i] != 's')
                     goto failed;
 
-                vars[j++] = (char *)argv[i];
-                vars[j++] = GINT_TO_POINTER(argt[i+1]);
-                vars[j++] = (char *)argv[i+1];
+                names[j] = (char *)argv[i];
+
+                switch (argt[i+1]) {
+                case 's':
+                    values[j].type = DRES_TYPE_STRING;
+                    values[j].v.s  = (char *)argv[i+1];
+                    break;
+                case 'i':
+                    values[j].type = DRES_TYPE_INTEGER;
+                    values[j].v.i  = *(int *)argv[i+1];
+                    break;
+                case 'f':
+                    values[j].type = DRES_TYPE_DOUBLE;
+                    values[j].v.d  = *(double *)argv[i+1];
+                    break;
+                default:
+                    goto failed;
+                }
             }
 
-            vars[j++] = NULL;
+            names[j] = NULL;
 
-            update_goal(target, vars);
+            OHM_DEBUG(DBG_RESOLVE, "resolving goal '%s'", target);
+            resolve_goal(target, names, values);
 
             return;
         }
@@ -982,6 +1110,77 @@ rule_lookup(const char *name, int arity)
 }
 
 
+/********************
+ * goal_lookup
+ ********************/
+static dres_goal_t *
+goal_lookup(char *goal, char **names, int *cached)
+{
+    char         key[256], *keyp, *p, *t;
+    dres_goal_t *prepared;
+    int          left, n, i;
+    
+    /*
+     * Notes: Goals are prepared once per goal and set of local variable
+     *     names and cached by those. If the key does not fit our buffer
+     *     we return a one-shot uncached prepared goal.
+     */
+    
+    p    = key;
+    left = sizeof(key);
+    n    = snprintf(p, left, "%s", goal ? goal : "");
+    
+    for (i = 0, t = "/"; names[i] != NULL && n < left; i++, t = ",") {
+        p    += n;
+        left -= n;
+        n     = snprintf(p, left, "%s%s", t, names[i]);
+    }
+    
+    if (n >= left) {
+        *cached = FALSE;
+        return dres_prepare_goal(dres, goal, names);
+    }
+
+    *cached = TRUE;
+
+    if ((prepared = g_hash_table_lookup(goaltbl, key)) != NULL)
+        return prepared;
+    
+    if ((prepared = dres_prepare_goal(dres, goal, names)) == NULL)
+        return NULL;
+    
+    if ((keyp = g_strdup(key)) == NULL) {
+        OHM_ERROR("failed to insert goal %s into goal hash table", key);
+        *cached = FALSE;
+        return prepared;
+    }
+    
+    g_hash_table_insert(goaltbl, keyp, prepared);
+    return prepared;
+}
+
+
+/********************
+ * resolve_goal
+ ********************/
+static int
+resolve_goal(char *goal, char **names, dres_value_t *values)
+{
+    dres_goal_t *prepared;
+    int          cached, status;
+
+    if ((prepared = goal_lookup(goal, names, &cached)) == NULL)
+        return -EINVAL;
+    
+    status = dres_update_prepared(prepared, values);
+    
+    if (!cached)
+        dres_free_prepared(prepared);
+    
+    return status;
+}
+
+
 
 #define MAX_ARGS  (32*2)
 
@@ -999,8 +1198,9 @@ OHM_PLUGIN_DESCRIPTION("dres",
                        plugin_exit,
                        NULL);
 
-OHM_PLUGIN_PROVIDES_METHODS(dres, 5,
+OHM_PLUGIN_PROVIDES_METHODS(dres, 6,
     OHM_EXPORT(update_goal      , "resolve"),
+    OHM_EXPORT(update_goals     , "resolve_goals"),
     OHM_EXPORT(add_command      , "add_command"),
     OHM_EXPORT(del_command      , "del_command"),
     OHM_EXPORT(register_method  , "register_method"),
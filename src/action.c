@@ -63,17 +63,27 @@ dres_free_locals(dres_local_t *locals)
 void
 dres_free_varref(dres_varref_t *vref)
 {
-    dres_select_t *p, *n;
-
     if (vref->variable == DRES_ID_NONE)
         return;
     
-    for (p = vref->selector; p != NULL; p = n) {
+    dres_free_selector(vref->selector);
+    FREE(vref->field);
+}
+
+
+/********************
+ * dres_free_selector
+ ********************/
+void
+dres_free_selector(dres_select_t *selector)
+{
+    dres_select_t *p, *n;
+
+    for (p = selector; p != NULL; p = n) {
         n = p->next;
         dres_free_field(&p->field);
         FREE(p);
     }
-    FREE(vref->field);
 }
 
 
@@ -108,6 +118,24 @@ dres_register_handler(dres_t *dres, char *name, dres_handler_t handler)
 }
 
 
+/********************
+ * dres_register_native
+ ********************/
+EXPORTED int
+dres_register_native(dres_t *dres, char *name, dres_native_t handler)
+{
+    int status;
+    
+    if (!DRES_TST_FLAG(dres, COMPILED))
+        return vm_method_add_native(&dres->vm, name, handler, dres);
+    else {
+        /* see the notes in dres_register_handler */
+        status = vm_method_set_native(&dres->vm, name, handler, dres);
+        return (status == 0 || status == ENOENT ? 0 : status);
+    }
+}
+
+
 /********************
  * dres_unregister_handler
  ********************/
@@ -134,20 +162,103 @@ dres_lookup_handler(dres_t *dres, char *name)
 }
 
 
+/********************
+ * dres_global_alloc
+ ********************/
+EXPORTED vm_global_t *
+dres_global_alloc(dres_t *dres, int nfact)
+{
+    /*
+     * Notes:
+     *   Handlers returning globals should allocate them with this instead
+     *   of vm_global_alloc, to have them recycled by the VM.
+     */
+    
+    return vm_global_pool_alloc(&dres->vm, nfact);
+}
+
+
 /********************
  * dres_run_actions
  ********************/
 int
 dres_run_actions(dres_t *dres, dres_target_t *target)
 {
-    int status;
+    vm_state_t *vm = &dres->vm;
+    uint64_t    digest;
+    int         flags, status;
 
     DEBUG(DBG_RESOLVE, "executing actions for %s", target->name);
 
+    DRES_CLR_FLAG(target, TARGET_UNCHANGED);
+
+    /*
+     * With lazy finalization we generate code when the target is first run.
+     * If that fails it would fail (and complain) the same way every time,
+     * so we remember it and fail without retrying. Running out of memory
+     * is the exception, that might be over by the next run.
+     */
+    if (target->code == NULL && target->statements != NULL &&
+        DRES_TST_FLAG(dres, LAZY_FINALIZE)) {
+        if (DRES_TST_FLAG(target, TARGET_BROKEN))
+            DRES_ACTION_ERROR(EINVAL);
+
+        DEBUG(DBG_RESOLVE, "compiling actions for target %s", target->name);
+        if ((status = dres_compile_target(dres, target)) != 0) {
+            vm_chunk_del(target->code);
+            target->code = NULL;
+            if (status != ENOMEM)
+                DRES_SET_FLAG(target, TARGET_BROKEN);
+            DRES_ACTION_ERROR(status);
+        }
+    }
+    
+    if (!DRES_TST_FLAG(dres, EARLY_CUTOFF)) {
+        if (target->code == NULL)
+            status = TRUE;
+        else
+            status = vm_exec(vm, target->code);
+        
+        return status;
+    }
+
+    /* save the digest of any target we are nested in (resolve builtin) */
+    digest = vm->digest;
+    flags  = vm->flags & (VM_FLAG_DIGEST|VM_FLAG_OPAQUE|VM_FLAG_WRITTEN);
+    
+    vm->digest = 0;
+    VM_SET_FLAG(vm, DIGEST);
+    VM_CLR_FLAG(vm, OPAQUE);
+    VM_CLR_FLAG(vm, WRITTEN);
+    
     if (target->code == NULL)
         status = TRUE;
     else
-        status = vm_exec(&dres->vm, target->code);
+        status = vm_exec(vm, target->code);
+    
+    /*
+     * Notes:
+     *   Only a run that wrote facts and nothing but facts can be found to
+     *   have the same output as the previous one. Targets without code or
+     *   without fact writes are always considered changed, otherwise they
+     *   would cut off their dependents forever after their first update.
+     */
+    
+    if (status > 0 && target->code != NULL &&
+        VM_TST_FLAG(vm, WRITTEN) && !VM_TST_FLAG(vm, OPAQUE)) {
+        if (DRES_TST_FLAG(target, TARGET_DIGEST) && target->digest == vm->digest)
+            DRES_SET_FLAG(target, TARGET_UNCHANGED);
+        else {
+            target->digest = vm->digest;
+            DRES_SET_FLAG(target, TARGET_DIGEST);
+        }
+    }
+    else
+        DRES_CLR_FLAG(target, TARGET_DIGEST);
+
+    vm->digest = digest;
+    vm->flags  = (vm->flags &
+                  ~(VM_FLAG_DIGEST|VM_FLAG_OPAQUE|VM_FLAG_WRITTEN)) | flags;
     
     return status;
 }
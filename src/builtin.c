@@ -35,8 +35,7 @@ USA.
 
 #define BUILTIN_HANDLER(b)                                              \
     static int dres_builtin_##b(void *data, char *name,                 \
-                                vm_stack_entry_t *args, int narg,       \
-                                vm_stack_entry_t *rv)
+                                vm_cell_t *args, int narg, vm_cell_t *rv)
 
 BUILTIN_HANDLER(dres);
 BUILTIN_HANDLER(resolve);
@@ -46,20 +45,22 @@ BUILTIN_HANDLER(shell);
 BUILTIN_HANDLER(regexp_read);
 BUILTIN_HANDLER(fail);
 
-#define BUILTIN(b) { .name = #b, .handler = dres_builtin_##b }
+#define BUILTIN(b)      { .name = #b, .handler = dres_builtin_##b }
+#define PURE_BUILTIN(b) { .name = #b, .handler = dres_builtin_##b, .pure = 1 }
 
 typedef struct dres_builtin_s {
-    char           *name;
-    dres_handler_t  handler;
+    char          *name;
+    dres_native_t  handler;
+    int            pure;                  /* no effects but return value */
 } dres_builtin_t;
 
 static dres_builtin_t builtins[] = {
     BUILTIN(dres),
     BUILTIN(resolve),
-    BUILTIN(echo),
-    BUILTIN(fact),
+    PURE_BUILTIN(echo),
+    PURE_BUILTIN(fact),
     BUILTIN(shell),
-    BUILTIN(regexp_read),
+    PURE_BUILTIN(regexp_read),
     BUILTIN(fail),
     { .name = NULL, .handler = NULL }
 };
@@ -114,9 +115,12 @@ dres_register_builtins(dres_t *dres)
     int             status;
     void           *data;
 
-    for (b = builtins; b->name; b++)
-        if ((status = dres_register_handler(dres, b->name, b->handler)) != 0)
+    for (b = builtins; b->name; b++) {
+        if ((status = dres_register_native(dres, b->name, b->handler)) != 0)
             return status;
+        if (b->pure)              /* ENOENT: not used by precompiled rules */
+            vm_method_pure(&dres->vm, b->name);
+    }
     
     data = dres;
     vm_method_default(&dres->vm, dres_fallback_call, &data);
@@ -133,7 +137,7 @@ BUILTIN_HANDLER(dres)
     dres_t       *dres = (dres_t *)data;
     char         *goal;
     vm_chunk_t   *chunk;
-    uintptr_t    *pc;
+    vm_instr_t   *pc;
     int           ninstr;
     int           nsize;
     int           status;
@@ -144,9 +148,9 @@ BUILTIN_HANDLER(dres)
     if (narg < 1)
         goal = NULL;
     else {
-        if (args[0].type != DRES_TYPE_STRING)
+        if (VM_CELL_TYPE(args[0]) != DRES_TYPE_STRING)
             DRES_ACTION_ERROR(EINVAL);
-        goal = args[0].v.s;
+        goal = VM_CELL_TO_STRING(args[0]);
     }
     
     /* save VM context */
@@ -172,8 +176,7 @@ BUILTIN_HANDLER(dres)
     dres->vm.nsize  = nsize;
     dres->vm.info   = info;
 
-    rv->type = DRES_TYPE_INTEGER;
-    rv->v.i  = status;
+    *rv = VM_CELL_INT(status);
 
     return status;
 }
@@ -237,23 +240,27 @@ BUILTIN_HANDLER(echo)
 
     t = "";
     for (i = 0; i < narg; i++) {
-        switch (args[i].type) {
+        switch (VM_CELL_TYPE(args[i])) {
         case DRES_TYPE_STRING:
-            if (args[i].v.s[0] == '>') {
-                fp = redirect(args[i].v.s, fp);
+            if (VM_CELL_TO_STRING(args[i])[0] == '>') {
+                fp = redirect(VM_CELL_TO_STRING(args[i]), fp);
                 t = "";
                 continue;
             }
             else
-                fprintf(fp, "%s%s", t, args[i].v.s);
+                fprintf(fp, "%s%s", t, VM_CELL_TO_STRING(args[i]));
             break;
             
         case DRES_TYPE_NIL:     fprintf(fp, "%s<nil>", t);           break;
-        case DRES_TYPE_INTEGER: fprintf(fp, "%s%d", t, args[i].v.i); break;
-        case DRES_TYPE_DOUBLE:  fprintf(fp, "%s%f", t, args[i].v.d); break;
+        case DRES_TYPE_INTEGER:
+            fprintf(fp, "%s%d", t, VM_CELL_TO_INT(args[i]));
+            break;
+        case DRES_TYPE_DOUBLE:
+            fprintf(fp, "%s%f", t, VM_CELL_TO_DOUBLE(args[i]));
+            break;
         case DRES_TYPE_FACTVAR:
             fprintf(fp, "%s", t);
-            vm_global_print(fp, args[i].v.g);
+            vm_global_print(fp, VM_CELL_TO_GLOBAL(args[i]));
             break;
         default:
             fprintf(fp, "<unknown>");
@@ -267,8 +274,7 @@ BUILTIN_HANDLER(echo)
     if (fp != stdout && fp != stderr)
         fclose(fp);
 
-    rv->type = DRES_TYPE_INTEGER;
-    rv->v.i  = 0;
+    *rv = VM_CELL_INT(0);
     DRES_ACTION_SUCCEED;
 }
 
@@ -284,7 +290,6 @@ BUILTIN_HANDLER(fact)
     char         *field, *factname;
     int           a, i, err;
 
-    (void)dres;
     (void)name;
 
     g = NULL;
@@ -294,16 +299,16 @@ BUILTIN_HANDLER(fact)
         DRES_ACTION_ERROR(EINVAL);
     }
 
-    if (args[0].type != DRES_TYPE_STRING) {
+    if (VM_CELL_TYPE(args[0]) != DRES_TYPE_STRING) {
         DRES_ERROR("builtin 'fact': invalid fact name (type 0x%x)",
-                   args[0].type);
+                   VM_CELL_TYPE(args[0]));
         err = EINVAL;
         goto fail;
     }
 
-    factname = args[0].v.s;
+    factname = VM_CELL_TO_STRING(args[0]);
     
-    if ((g = vm_global_alloc(narg - 1)) == NULL) {
+    if ((g = dres_global_alloc(dres, narg - 1)) == NULL) {
         DRES_ERROR("builtin 'fact': failed to allocate new global");
         DRES_ACTION_ERROR(ENOMEM);
     }
@@ -315,14 +320,14 @@ BUILTIN_HANDLER(fact)
         printf("* created fact %d...\n", a + 1);
         while (i < narg) {
             printf("* inner: i=%d, a=%d\n", i, a);
-            if (args[i].type != DRES_TYPE_STRING) {
+            if (VM_CELL_TYPE(args[i]) != DRES_TYPE_STRING) {
                 DRES_ERROR("builtin 'fact': invalid field name (type 0x%x)",
-                           args[i].type);
+                           VM_CELL_TYPE(args[i]));
                 err = EINVAL;
                 goto fail;
             }
 
-            field = args[i].v.s;
+            field = VM_CELL_TO_STRING(args[i]);
             if (!field[0]) {
                 i++;
                 break;
@@ -336,15 +341,15 @@ BUILTIN_HANDLER(fact)
 
             i++;
             
-            switch (args[i].type) {
+            switch (VM_CELL_TYPE(args[i])) {
             case DRES_TYPE_INTEGER:
-                value = ohm_value_from_int(args[i].v.i);
+                value = ohm_value_from_int(VM_CELL_TO_INT(args[i]));
                 break;
             case DRES_TYPE_STRING:
-                value = ohm_value_from_string(args[i].v.s);
+                value = ohm_value_from_string(VM_CELL_TO_STRING(args[i]));
                 break;
             case DRES_TYPE_DOUBLE:
-                value = ohm_value_from_double(args[i].v.d);
+                value = ohm_value_from_double(VM_CELL_TO_DOUBLE(args[i]));
                 break;
             default:
                 DRES_ERROR("builtin 'fact': invalid value for field %s", field);
@@ -358,8 +363,7 @@ BUILTIN_HANDLER(fact)
         }
     }
     
-    rv->type = DRES_TYPE_FACTVAR;
-    rv->v.g  = g;
+    *rv = VM_CELL_GLOBAL(g);
     DRES_ACTION_SUCCEED;
 
  fail:
@@ -385,13 +389,13 @@ BUILTIN_HANDLER(shell)
         DRES_ACTION_ERROR(EINVAL);
     }
 
-    if (args[0].type != DRES_TYPE_STRING) {
+    if (VM_CELL_TYPE(args[0]) != DRES_TYPE_STRING) {
         DRES_ERROR("builtin 'shell': argument must be of type string");
         DRES_ACTION_ERROR(EINVAL);
     }
 
     errno  = 0;
-    status = system(args[0].v.s);
+    status = system(VM_CELL_TO_STRING(args[0]));
     
     if (status < 0) {
         if (errno)
@@ -403,8 +407,7 @@ BUILTIN_HANDLER(shell)
     status = WEXITSTATUS(status);
 
     if (status == 0) {
-        rv->type = DRES_TYPE_INTEGER;
-        rv->v.i  = 0;
+        *rv = VM_CELL_INT(0);
         DRES_ACTION_SUCCEED;
     }
     else
@@ -446,7 +449,7 @@ BUILTIN_HANDLER(regexp_read)
 
     const char       *path, *expr, *type;
     int               nth;
-    vm_stack_entry_t *defval;
+    vm_cell_t        *defval;
     FILE             *fp;
     char              buf[1024], match[1024], *end;
     regex_t           rebuf, *re;
@@ -462,18 +465,18 @@ BUILTIN_HANDLER(regexp_read)
     max    = sizeof(rm) / sizeof(rm[0]);
 
     if (narg == 4 || narg == 5) {
-        if (args[0].type != DRES_TYPE_STRING  ||
-            args[1].type != DRES_TYPE_STRING  ||
-            args[2].type != DRES_TYPE_INTEGER ||
-            args[3].type != DRES_TYPE_STRING) {
+        if (VM_CELL_TYPE(args[0]) != DRES_TYPE_STRING  ||
+            VM_CELL_TYPE(args[1]) != DRES_TYPE_STRING  ||
+            VM_CELL_TYPE(args[2]) != DRES_TYPE_INTEGER ||
+            VM_CELL_TYPE(args[3]) != DRES_TYPE_STRING) {
             DRES_ERROR("args of incorrect type to builtin 'regexp_read'");
             DRES_ACTION_ERROR(EINVAL);
         }
         
-        path   = args[0].v.s;
-        expr   = args[1].v.s;
-        nth    = args[2].v.i;
-        type   = args[3].v.s;
+        path   = VM_CELL_TO_STRING(args[0]);
+        expr   = VM_CELL_TO_STRING(args[1]);
+        nth    = VM_CELL_TO_INT(args[2]);
+        type   = VM_CELL_TO_STRING(args[3]);
         defval = (narg == 5 ? args + 4 : NULL);
     }
     else {
@@ -495,9 +498,9 @@ BUILTIN_HANDLER(regexp_read)
     }
 
     if (defval != NULL) {
-        if ((type[0] == 'i' && defval->type != DRES_TYPE_INTEGER) ||
-            (type[0] == 'd' && defval->type != DRES_TYPE_DOUBLE ) ||
-            (type[0] == 's' && defval->type != DRES_TYPE_STRING )) {
+        if ((type[0] == 'i' && VM_CELL_TYPE(*defval) != DRES_TYPE_INTEGER) ||
+            (type[0] == 'd' && VM_CELL_TYPE(*defval) != DRES_TYPE_DOUBLE ) ||
+            (type[0] == 's' && VM_CELL_TYPE(*defval) != DRES_TYPE_STRING )) {
             DRES_WARNING("default inconsistent with type string in "
                          "builtin 'regexp_read'");
             defval = NULL;
@@ -533,8 +536,7 @@ BUILTIN_HANDLER(regexp_read)
         
         switch (type[0]) {
         case 'i':
-            rv->type = DRES_TYPE_INTEGER;
-            rv->v.i  = (int)strtol(match, &end, 10);
+            *rv = VM_CELL_INT((int)strtol(match, &end, 10));
             if (end && *end) {
                 DRES_WARNING("match '%s' in builtin 'regex_read' is not "
                              "a valid integer", match);
@@ -545,8 +547,7 @@ BUILTIN_HANDLER(regexp_read)
             break;
             
         case 'd':
-            rv->type = DRES_TYPE_DOUBLE;
-            rv->v.d  = strtod(match, &end);
+            *rv = VM_CELL_DOUBLE(strtod(match, &end));
             if (end && *end) {
                 DRES_WARNING("match '%s' in builtin 'regex_read' is not "
                              "a valid double", match);
@@ -588,8 +589,7 @@ BUILTIN_HANDLER(regexp_read)
      */
     
     if (defval != NULL) {
-        rv->type = defval->type;
-        rv->v    = defval->v;
+        *rv = *defval;
         DRES_ACTION_SUCCEED;
     }
     else
@@ -607,12 +607,12 @@ BUILTIN_HANDLER(fail)
     (void)data;
     (void)name;
     
-    if (narg > 0 && args[0].type == DRES_TYPE_INTEGER)
-        err = args[0].v.i;
+    if (narg > 0 && VM_CELL_TYPE(args[0]) == DRES_TYPE_INTEGER)
+        err = VM_CELL_TO_INT(args[0]);
     else
         err = EINVAL;
     
-    rv->type = DRES_TYPE_UNKNOWN;
+    *rv = VM_CELL_UNKNOWN;
     DRES_ACTION_ERROR(err);
 }
 
@@ -65,6 +65,9 @@ static int save_initializers(dres_t *dres, dres_buf_t *buf);
 static int load_initializers(dres_t *dres, dres_buf_t *buf);
 static int save_methods     (dres_t *dres, dres_buf_t *buf);
 static int load_methods     (dres_t *dres, dres_buf_t *buf);
+static int finalize_lazy    (dres_t *dres);
+static int fold_statements  (dres_t *dres, dres_stmt_t **stmtp);
+static int expr_size        (dres_expr_t *expr);
 
 extern int initialize_variables(dres_t *dres); /* XXX TODO: kludge */
 extern int finalize_variables  (dres_t *dres); /* XXX TODO: kludge */
@@ -81,11 +84,15 @@ dres_compile_target(dres_t *dres, dres_target_t *target)
     dres_action_t *a;
 #endif
     dres_stmt_t   *stmt;
-    int            err;
+    int            n, err;
 
     if (target->statements == NULL)
         return 0;
 
+    if ((n = fold_statements(dres, &target->statements)) > 0)
+        DRES_INFO("constant folding eliminated %d instructions of target %s",
+                  n, target->name);
+    
     if (target->code == NULL)
         if ((target->code = vm_chunk_new(16)) == NULL)
             return ENOMEM;
@@ -100,6 +107,20 @@ dres_compile_target(dres_t *dres, dres_target_t *target)
 
     VM_INSTR_HALT(target->code, fail, err);
 
+    if ((err = vm_chunk_optimize(target->code)) != 0)
+        DRES_WARNING("failed to optimize code for target %s (%d: %s)",
+                     target->name, err, strerror(err));
+
+    switch ((err = vm_chunk_verify(target->code))) {
+    case 0:
+    case EOPNOTSUPP:                           /* runs with runtime checks */
+        break;
+    default:
+        DRES_ERROR("failed to verify code for target %s (%d: %s)",
+                   target->name, err, strerror(err));
+        return err;
+    }
+    
     return 0;
 
  fail:
@@ -198,7 +219,7 @@ compile_stmt_lvalue(dres_t *dres, dres_varref_t *lval, int op, vm_chunk_t *code)
             selop = (int)sel->op;
             VM_INSTR_PUSH_INT(code, fail, err, selop);
             PUSH_VALUE(code, fail, err, &sel->field.value);
-            VM_INSTR_PUSH_STRING(code, fail, err, sel->field.name);
+            VM_INSTR_PUSH_FIELD(code, fail, err, sel->field.name);
             nfield++;
         }
     }
@@ -218,7 +239,7 @@ compile_stmt_lvalue(dres_t *dres, dres_varref_t *lval, int op, vm_chunk_t *code)
         for (nfield = 0, sel = lval->selector; sel != NULL; sel = sel->next) {
             if (sel->field.value.type != DRES_TYPE_UNKNOWN) /* a filter */
                 continue;
-            VM_INSTR_PUSH_STRING(code, fail, err, sel->field.name);
+            VM_INSTR_PUSH_FIELD(code, fail, err, sel->field.name);
             nfield++;
         }
 
@@ -229,7 +250,7 @@ compile_stmt_lvalue(dres_t *dres, dres_varref_t *lval, int op, vm_chunk_t *code)
     }
     else {
         if (lval->field != NULL) {
-            VM_INSTR_PUSH_STRING(code, fail, err, lval->field);
+            VM_INSTR_PUSH_FIELD(code, fail, err, lval->field);
             VM_INSTR_SET_FIELD(code, fail, err);
         }
         else {
@@ -464,7 +485,7 @@ compile_expr_varref(dres_t *dres, dres_expr_varref_t *expr, vm_chunk_t *code)
             op = (int)sel->op;
             VM_INSTR_PUSH_INT(code, fail, err, op);
             PUSH_VALUE(code, fail, err, &sel->field.value);
-            VM_INSTR_PUSH_STRING(code, fail, err, sel->field.name);
+            VM_INSTR_PUSH_FIELD(code, fail, err, sel->field.name);
             
             nfield++;
         }
@@ -472,7 +493,7 @@ compile_expr_varref(dres_t *dres, dres_expr_varref_t *expr, vm_chunk_t *code)
             VM_INSTR_FILTER(code, fail, err, nfield);
 
         if (vref->field != NULL) {
-            VM_INSTR_PUSH_STRING(code, fail, err, vref->field);
+            VM_INSTR_PUSH_FIELD(code, fail, err, vref->field);
             VM_INSTR_GET_FIELD(code, fail, err);
         }
     }
@@ -608,11 +629,409 @@ compile_expr_call(dres_t *dres, dres_expr_call_t *expr, vm_chunk_t *code)
 }
 
 
+/*****************************************************************************
+ *                  *** constant folding, dead branches ***                  *
+ *****************************************************************************/
+
+/********************
+ * const_true
+ ********************/
+static int
+const_true(dres_expr_const_t *c)
+{
+    /* the truth value of a constant as tested by BRANCH */
+    switch (c->vtype) {
+    case DRES_TYPE_INTEGER: return c->v.i != 0;
+    case DRES_TYPE_DOUBLE:  return c->v.d != 0.0;
+    case DRES_TYPE_STRING:  return c->v.s != NULL && *c->v.s;
+    default:                return -1;
+    }
+}
+
+
+/********************
+ * const_cmp
+ ********************/
+static int
+const_cmp(dres_relop_t op, dres_expr_const_t *c1, dres_expr_const_t *c2)
+{
+    int cmp;
+
+    /* the result of comparing constants as evaluated by CMP */
+    if (c1->vtype != c2->vtype)
+        return FALSE;
+
+    switch (c1->vtype) {
+    case DRES_TYPE_INTEGER:
+        cmp = c1->v.i < c2->v.i ? -1 : (c1->v.i > c2->v.i ? 1 : 0);
+        break;
+    case DRES_TYPE_DOUBLE:
+        cmp = c1->v.d < c2->v.d ? -1 : (c1->v.d > c2->v.d ? 1 : 0);
+        if (cmp == 0 && c1->v.d != c2->v.d)          /* NaN */
+            return op == DRES_RELOP_NE;
+        break;
+    case DRES_TYPE_STRING:
+        cmp = strcmp(c1->v.s, c2->v.s);
+        break;
+    default:
+        return -1;
+    }
+
+    switch (op) {
+    case DRES_RELOP_EQ: return cmp == 0;
+    case DRES_RELOP_NE: return cmp != 0;
+    case DRES_RELOP_LT: return cmp <  0;
+    case DRES_RELOP_LE: return cmp <= 0;
+    case DRES_RELOP_GT: return cmp >  0;
+    case DRES_RELOP_GE: return cmp >= 0;
+    default:            return -1;
+    }
+}
+
+
+/********************
+ * fold_relop
+ ********************/
+static int
+fold_relop(dres_expr_relop_t *expr)
+{
+    dres_expr_const_t *c1, *c2;
+    int                t;
+
+    c1 = expr->arg1 && expr->arg1->type == DRES_EXPR_CONST ?
+        &expr->arg1->constant : NULL;
+    c2 = expr->arg2 && expr->arg2->type == DRES_EXPR_CONST ?
+        &expr->arg2->constant : NULL;
+
+    /*
+     * Return the value of the expression if it can be determined at
+     * compile time, -1 otherwise. Only leading constants of || and && are
+     * folded as the other argument might have side-effects (a call).
+     */
+    
+    switch (expr->op) {
+    case DRES_RELOP_OR:
+    case DRES_RELOP_AND:
+        if (c1 == NULL || (t = const_true(c1)) < 0)
+            return -1;
+        if (t == (expr->op == DRES_RELOP_OR))
+            return t;
+        return c2 != NULL ? const_true(c2) : -1;
+        
+    case DRES_RELOP_NOT:
+        if (c1 == NULL)
+            return -1;
+        switch (c1->vtype) {
+        case DRES_TYPE_INTEGER: return c1->v.i == 0;
+        case DRES_TYPE_DOUBLE:  return c1->v.d == 0.0;
+        case DRES_TYPE_STRING:  return c1->v.s == NULL;
+        default:                return -1;
+        }
+
+    default:
+        if (c1 == NULL || c2 == NULL)
+            return -1;
+        return const_cmp(expr->op, c1, c2);
+    }
+}
+
+
+/********************
+ * varref_size
+ ********************/
+static int
+varref_size(dres_varref_t *vref)
+{
+    dres_select_t *sel;
+    int            n, nfield;
+
+    /* cf. compile_expr_varref */
+    if (DRES_ID_TYPE(vref->variable) == DRES_TYPE_DRESVAR)
+        return 1;
+
+    for (n = 1, nfield = 0, sel = vref->selector; sel; sel = sel->next) {
+        n += 3;
+        nfield++;
+    }
+    if (nfield)
+        n++;
+    if (vref->field != NULL)
+        n += 2;
+
+    return n;
+}
+
+
+/********************
+ * lvalue_size
+ ********************/
+static int
+lvalue_size(dres_varref_t *lval)
+{
+    dres_select_t *sel;
+    int            n, nfield, update;
+
+    /* cf. compile_stmt_lvalue */
+    update = FALSE;
+    for (n = 1, nfield = 0, sel = lval->selector; sel; sel = sel->next) {
+        if (sel->field.value.type == DRES_TYPE_UNKNOWN) {
+            update = TRUE;
+            n++;                                  /* PUSH FIELD */
+        }
+        else {
+            n += 3;
+            nfield++;
+        }
+    }
+    if (nfield)
+        n++;
+
+    if (update)
+        return n + 1;                             /* REPLACE or UPDATE */
+    else
+        return n + (lval->field != NULL ? 2 : 1);
+}
+
+
+/********************
+ * call_size
+ ********************/
+static int
+call_size(dres_expr_t *args, dres_local_t *locals)
+{
+    dres_expr_t  *arg;
+    dres_local_t *local;
+    int           n, nlocal;
+
+    /* cf. compile_call */
+    for (n = 2, arg = args; arg != NULL; arg = arg->any.next)
+        n += expr_size(arg);
+
+    for (nlocal = 0, local = locals; local != NULL; local = local->next)
+        nlocal++;
+    if (nlocal > 0)
+        n += 2 * nlocal + 2;
+
+    return n;
+}
+
+
+/********************
+ * expr_size
+ ********************/
+static int
+expr_size(dres_expr_t *expr)
+{
+    dres_expr_relop_t *relop;
+
+    /* the number of instructions compile_expr generates for expr */
+    switch (expr->type) {
+    case DRES_EXPR_CONST:
+        return 1;
+    case DRES_EXPR_VARREF:
+        return varref_size(&expr->varref.ref);
+    case DRES_EXPR_CALL:
+        return call_size(expr->call.args, expr->call.locals);
+    case DRES_EXPR_RELOP:
+        relop = &expr->relop;
+        if (relop->op == DRES_RELOP_OR || relop->op == DRES_RELOP_AND)
+            return expr_size(relop->arg1) + expr_size(relop->arg2) + 5;
+        else
+            return expr_size(relop->arg1) + 1 +
+                (relop->arg2 != NULL ? expr_size(relop->arg2) : 0);
+    default:
+        return 0;
+    }
+}
+
+
+/********************
+ * stmt_size
+ ********************/
+static int
+stmt_size(dres_stmt_t *stmt)
+{
+    dres_stmt_if_t *ifs;
+    int             n;
+
+    /* the number of instructions compile_statement generates for stmts */
+    for (n = 0; stmt != NULL; stmt = stmt->any.next) {
+        switch (stmt->type) {
+        case DRES_STMT_FULL_ASSIGN:
+        case DRES_STMT_PARTIAL_ASSIGN:
+        case DRES_STMT_REPLACE_ASSIGN:
+            n += expr_size(stmt->assign.rvalue);
+            n += lvalue_size(&stmt->assign.lvalue->ref);
+            break;
+        case DRES_STMT_CALL:
+            n += call_size(stmt->call.args, stmt->call.locals) + 1;
+            break;
+        case DRES_STMT_IFTHEN:
+            ifs = &stmt->ifthen;
+            n  += expr_size(ifs->condition) + 1 + stmt_size(ifs->if_branch);
+            if (ifs->else_branch != NULL)
+                n += 1 + stmt_size(ifs->else_branch);
+            break;
+        default:
+            break;
+        }
+    }
+
+    return n;
+}
+
+
+/********************
+ * fold_expr
+ ********************/
+static int
+fold_expr(dres_t *dres, dres_expr_t **exprp)
+{
+    dres_expr_t       *expr = *exprp, **argp;
+    dres_expr_const_t *c;
+    int                value, n;
+
+    n = 0;
+    
+    switch (expr->type) {
+    case DRES_EXPR_CALL:
+        for (argp = &expr->call.args; *argp; argp = &(*argp)->any.next)
+            n += fold_expr(dres, argp);
+        return n;
+
+    case DRES_EXPR_RELOP:
+        n += fold_expr(dres, &expr->relop.arg1);
+        if (expr->relop.arg2 != NULL)
+            n += fold_expr(dres, &expr->relop.arg2);
+
+        if ((value = fold_relop(&expr->relop)) < 0)
+            return n;
+        
+        if ((c = ALLOC(dres_expr_const_t)) == NULL)
+            return n;
+
+        n += expr_size(expr) - 1;
+        
+        c->type  = DRES_EXPR_CONST;
+        c->vtype = DRES_TYPE_INTEGER;
+        c->v.i   = value;
+        c->next  = expr->any.next;
+
+        expr->any.next = NULL;
+        dres_free_expr(expr);
+        *exprp = (dres_expr_t *)c;
+        
+        return n;
+
+    default:
+        return 0;
+    }
+}
+
+
+/********************
+ * fold_statements
+ ********************/
+static int
+fold_statements(dres_t *dres, dres_stmt_t **stmtp)
+{
+    dres_stmt_t    *stmt, *keep, *drop, *tail;
+    dres_stmt_if_t *ifs;
+    dres_expr_t   **argp;
+    int             n, t;
+
+    n = 0;
+    while ((stmt = *stmtp) != NULL) {
+        switch (stmt->type) {
+        case DRES_STMT_FULL_ASSIGN:
+        case DRES_STMT_PARTIAL_ASSIGN:
+        case DRES_STMT_REPLACE_ASSIGN:
+            n += fold_expr(dres, &stmt->assign.rvalue);
+            break;
+            
+        case DRES_STMT_CALL:
+            for (argp = &stmt->call.args; *argp; argp = &(*argp)->any.next)
+                n += fold_expr(dres, argp);
+            break;
+            
+        case DRES_STMT_IFTHEN:
+            ifs = &stmt->ifthen;
+            n  += fold_expr(dres, &ifs->condition);
+            n  += fold_statements(dres, &ifs->if_branch);
+            n  += fold_statements(dres, &ifs->else_branch);
+
+            if (ifs->condition->type != DRES_EXPR_CONST ||
+                (t = const_true(&ifs->condition->constant)) < 0)
+                break;
+            
+            keep = t ? ifs->if_branch   : ifs->else_branch;
+            drop = t ? ifs->else_branch : ifs->if_branch;
+            
+            /* the condition, the branch(es) and the dead code */
+            n += 2 + (ifs->else_branch != NULL ? 1 : 0);
+            n += stmt_size(drop);
+            
+            ifs->if_branch = ifs->else_branch = NULL;
+            dres_free_statement(drop);
+
+            if (keep != NULL) {
+                for (tail = keep; tail->any.next; tail = tail->any.next)
+                    ;
+                tail->any.next = stmt->any.next;
+                *stmtp         = keep;
+            }
+            else
+                *stmtp = stmt->any.next;
+
+            stmt->any.next = NULL;
+            dres_free_statement(stmt);
+
+            if (keep != NULL)
+                stmtp = &tail->any.next;
+            continue;
+
+        default:
+            break;
+        }
+
+        stmtp = &stmt->any.next;
+    }
+    
+    return n;
+}
+
+
 /*****************************************************************************
  *                   *** precompiled/binary rule support ***                 *
  *****************************************************************************/
 
 
+/********************
+ * finalize_lazy
+ ********************/
+static int
+finalize_lazy(dres_t *dres)
+{
+    dres_target_t *t;
+    int            i, status;
+
+    /* finish any finalization left for later (cf. dres_set_lazy_finalize) */
+    
+    if (!DRES_TST_FLAG(dres, LAZY_FINALIZE))
+        return 0;
+
+    for (i = 0, t = dres->targets; i < dres->ntarget; i++, t++)
+        if (t->code == NULL && t->statements != NULL)
+            if ((status = dres_compile_target(dres, t)) != 0)
+                return status;
+
+    if (dres->dependencies == NULL)
+        return dres_sort_targets(dres);
+    else
+        return 0;
+}
+
+
 /********************
  * dres_save
  ********************/
@@ -630,6 +1049,9 @@ dres_save(dres_t *dres, char *path)
     buf  = NULL;
     fp   = NULL;
 
+    if ((status = finalize_lazy(dres)) != 0)
+        goto fail;
+    
  retry:
     if ((buf = dres_buf_create(size, size)) == NULL) {
         status = ENOMEM;
@@ -656,6 +1078,7 @@ dres_save(dres_t *dres, char *path)
 
 #define HTONL(_f) buf->header._f = htonl(buf->header._f)
     buf->header.magic   = htonl(DRES_MAGIC);
+    buf->header.version = htonl(DRES_VERSION);
     buf->header.ssize   = htonl(buf->sused);
     HTONL(ntarget);
     HTONL(nprereq);
@@ -666,6 +1089,8 @@ dres_save(dres_t *dres, char *path)
     HTONL(ninit);
     HTONL(nfield);
     HTONL(nmethod);
+    HTONL(nselect);
+    HTONL(nreduced);
     
     if (fwrite(&buf->header, sizeof(buf->header), 1, fp) != 1)
         goto fail;
@@ -681,6 +1106,7 @@ dres_save(dres_t *dres, char *path)
     }
     
     fclose(fp);
+    dres_buf_destroy(buf);
     
     return 0;
         
@@ -795,6 +1221,7 @@ dres_load(char *path)
     
 #define NTOHL(_f) hdr->_f = ntohl(hdr->_f)
     NTOHL(magic);
+    NTOHL(version);
     NTOHL(ssize);
     NTOHL(ntarget);
     NTOHL(nprereq);
@@ -805,23 +1232,41 @@ dres_load(char *path)
     NTOHL(ninit);
     NTOHL(nfield);
     NTOHL(nmethod);
+    NTOHL(nselect);
+    NTOHL(nreduced);
 
-    if (hdr->magic != DRES_MAGIC) {
+    if (hdr->magic != DRES_MAGIC) {             /* probed by dres_open */
+        errno = EINVAL;
+        goto fail;
+    }
+
+    /*
+     * Notes:
+     *   Files written before the format was versioned have the string
+     *   table size where the version is now, so they are rejected here
+     *   as well. They need to be recompiled from the sources.
+     */
+    if (hdr->version != DRES_VERSION) {
+        DRES_ERROR("%s: precompiled ruleset format version %u, expected %u, "
+                   "please recompile it", path, hdr->version, DRES_VERSION);
         errno = EINVAL;
         goto fail;
     }
 
 #define SIZE(type, _f) (sizeof(type) * hdr->_f)
+#define ALIGNED(size)  DRES_ALIGN_TO(size, DRES_ALIGNMENT)
     
     size  = SIZE(dres_target_t     , ntarget);
     size += SIZE(dres_prereq_t     , nprereq);
     size += SIZE(vm_chunk_t        , ncode);
     size += SIZE(char              , sinstr);
-    size += SIZE(int               , ndependency);
+    size += ALIGNED(SIZE(int      , ndependency));
     size += SIZE(dres_variable_t   , nvariable);
     size += SIZE(dres_initializer_t, ninit);
     size += SIZE(dres_init_t       , nfield);
     size += SIZE(vm_method_t       , nmethod);
+    size += SIZE(dres_select_t     , nselect);
+    size += ALIGNED(SIZE(int      , nreduced));
 
     buf.dsize = size;
     buf.dused = 0;
@@ -835,6 +1280,8 @@ dres_load(char *path)
     if (vm_init(&dres->vm, 0) != 0)
         goto fail;
 
+    VM_SET_FLAG(&dres->vm, COMPILED);         /* methods live in the image */
+
     buf.strings = ((char *)dres) + sizeof(*dres);
     buf.data    = buf.strings + hdr->ssize;
      
@@ -867,9 +1314,17 @@ dres_load(char *path)
     DRES_SET_FLAG(dres, COMPILED);
     DRES_SET_FLAG(dres, ACTIONS_FINALIZED);
     DRES_SET_FLAG(dres, TARGETS_FINALIZED);
-
-    VM_SET_FLAG(&dres->vm, COMPILED);
     
+    if ((status = dres_build_index(dres)) != 0) {
+        errno = status;
+        goto fail;
+    }
+
+    if ((status = dres_rank_targets(dres)) != 0) {
+        errno = status;
+        goto fail;
+    }
+
     if (initialize_variables(dres) != 0 || finalize_variables(dres) != 0) {
         errno = EINVAL;
         goto fail;
@@ -885,8 +1340,12 @@ dres_load(char *path)
  fail:
     if (buf.fd >= 0)
         close(buf.fd);
-    if (dres)
+    if (dres) {
+        dres_free_index(dres);
+        dres_unload_targets(dres);
+        vm_exit(&dres->vm);
         FREE(dres);
+    }
     
     return NULL;
 }
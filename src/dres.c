@@ -64,8 +64,15 @@ static int  finalize_actions    (dres_t *dres);
 static int  check_undefined     (dres_t *dres);
 
 static int  push_locals(dres_t *dres, char **locals);
+static int  push_values(dres_t *dres, dres_goal_t *goal, dres_value_t *values);
 static int  pop_locals (dres_t *dres);
 
+static int  finalize_ruleset(dres_t *dres);
+static int  update_targets(dres_t *dres, dres_target_t **targets, int ntarget,
+                           char **locals, dres_goal_t *goal,
+                           dres_value_t *values);
+static int  update_dirty(dres_t *dres, dres_target_t **targets, int ntarget);
+
 
 
 /********************
@@ -193,9 +200,13 @@ dres_exit(dres_t *dres)
         return;
     
     dres_store_free(dres);
+    dres_free_index(dres);
 
-    if (DRES_TST_FLAG(dres, COMPILED))
+    if (DRES_TST_FLAG(dres, COMPILED)) {
+        dres_unload_targets(dres);
+        vm_exit(&dres->vm);
         free(dres);
+    }
     else {
         dres_free_targets(dres);
         dres_free_factvars(dres);
@@ -420,6 +431,11 @@ finalize_actions(dres_t *dres)
 
     if (DRES_TST_FLAG(dres, ACTIONS_FINALIZED))
         return 0;
+
+    if (DRES_TST_FLAG(dres, LAZY_FINALIZE)) {    /* cf. dres_run_actions */
+        DRES_SET_FLAG(dres, ACTIONS_FINALIZED);
+        return 0;
+    }
     
     status = 0;
     for (i = 0, target = dres->targets; i < dres->ntarget; i++, target++) {
@@ -440,31 +456,34 @@ static int
 finalize_targets(dres_t *dres)
 {
     dres_target_t *target;
-    dres_graph_t  *graph;
-    char           goal[64];
-    int            i;
+    int            i, status;
 
     if (DRES_TST_FLAG(dres, TARGETS_FINALIZED))
         return 0;
 
     for (i = 0, target = dres->targets; i < dres->ntarget; i++, target++) {
-        DRES_INFO("Compiling dependency graph for target %s...", target->name);
-
-        dres_name(dres, target->id, goal, sizeof(goal));
-
-        if ((graph = dres_build_graph(dres, target)) == NULL)
+        if (!DRES_IS_DEFINED(target->id)) {
+            DRES_ERROR("undefined target %s", target->name);
             return EINVAL;
-        
-        target->dependencies = dres_sort_graph(dres, graph);
-        dres_free_graph(graph);
+        }
+    }
 
-        if (target->dependencies == NULL)
-            return EINVAL;
+    DRES_INFO("Compiling dependency graph for %d targets...", dres->ntarget);
+    
+    if ((status = dres_build_index(dres)) != 0)
+        return status;
 
-        DEBUG(DBG_GRAPH, "topological sort for goal %s:\n", goal);
-        dres_dump_sort(dres, target->dependencies);
-    }
+    if (DRES_TST_FLAG(dres, LAZY_FINALIZE))
+        status = dres_rank_targets(dres);
+    else
+        status = dres_sort_targets(dres);
+    
+    if (status != 0)
+        return status;
 
+    if ((status = dres_reduce_prereqs(dres)) != 0)
+        return status;
+    
     DRES_SET_FLAG(dres, TARGETS_FINALIZED);
     return 0;
 }
@@ -485,6 +504,63 @@ dres_finalize(dres_t *dres)
 }
 
 
+/********************
+ * dres_set_early_cutoff
+ ********************/
+EXPORTED int
+dres_set_early_cutoff(dres_t *dres, int enable)
+{
+    int old = DRES_TST_FLAG(dres, EARLY_CUTOFF) ? TRUE : FALSE;
+
+    /*
+     * Notes:
+     *
+     *   With early cutoff enabled we hash the facts a target writes when
+     *   its actions are run and only advance the stamp of the target if
+     *   the hash differs from that of the previous run. Hence targets that
+     *   rewrite identical facts do not cause their dependents to be rerun.
+     *   Targets calling methods only for their side-effects can't be hashed
+     *   and are always treated as changed.
+     */
+
+    if (enable)
+        DRES_SET_FLAG(dres, EARLY_CUTOFF);
+    else
+        DRES_CLR_FLAG(dres, EARLY_CUTOFF);
+
+    return old;
+}
+
+
+/********************
+ * dres_set_lazy_finalize
+ ********************/
+EXPORTED int
+dres_set_lazy_finalize(dres_t *dres, int enable)
+{
+    int old = DRES_TST_FLAG(dres, LAZY_FINALIZE) ? TRUE : FALSE;
+
+    /*
+     * Notes:
+     *
+     *   With lazy finalization dres_finalize only builds the dependency
+     *   index and ranks the targets. Code for the actions of a target is
+     *   generated when the target is first run and its check order is
+     *   collected when it is first updated as a goal. This cuts down the
+     *   startup time for large rulesets, most targets of which are never
+     *   resolved. It needs to be set before the ruleset is finalized and
+     *   has no effect on precompiled rulesets.
+     */
+
+    if (enable)
+        DRES_SET_FLAG(dres, LAZY_FINALIZE);
+    else
+        DRES_CLR_FLAG(dres, LAZY_FINALIZE);
+
+    return old;
+}
+
+
 /********************
  * dres_update_goal
  ********************/
@@ -492,32 +568,200 @@ EXPORTED int
 dres_update_goal(dres_t *dres, char *goal, char **locals)
 {
     dres_target_t *target;
-    int            id, i, status, own_tx;
+    int            status;
 
+    if ((status = finalize_ruleset(dres)) != 0)
+        DRES_ACTION_ERROR(status);
     
-    status = 0;
+    if (goal != NULL) {
+        if ((target = dres_lookup_target(dres, goal)) == NULL)
+            DRES_ACTION_ERROR(EINVAL);
+    }
+    else
+        target = dres->targets;
+    
+    if (!DRES_IS_DEFINED(target->id))
+        DRES_ACTION_ERROR(EINVAL);
 
-    if (!DRES_TST_FLAG(dres, ACTIONS_FINALIZED))
-        if ((status = finalize_actions(dres)) != 0)
-            if (dres->fallback == NULL)
-                DRES_ACTION_ERROR(status);
+    return update_targets(dres, &target, 1, locals, NULL, NULL);
+}
+
+
+/********************
+ * dres_update_goals
+ ********************/
+EXPORTED int
+dres_update_goals(dres_t *dres, char **goals, int ngoal, char **locals)
+{
+    dres_target_t **targets;
+    int             status, i;
+
+    /*
+     * Notes:
+     *
+     *   All the goals are updated within a single transaction, after a
+     *   single check of the fact store. Their dirty dependencies are
+     *   checked in a single pass (cf. update_dirty), so targets shared by
+     *   several of the goals are checked (and updated) only once. If any
+     *   of the goals fails the whole batch is rolled back.
+     */
+
+    if (goals == NULL || ngoal <= 0)
+        DRES_ACTION_ERROR(EINVAL);
     
-    if (!DRES_TST_FLAG(dres, TARGETS_FINALIZED))
-        if ((status = finalize_targets(dres)) != 0)
-            DRES_ACTION_ERROR(status);
+    if ((status = finalize_ruleset(dres)) != 0)
+        DRES_ACTION_ERROR(status);
+
+    if ((targets = ALLOC_ARR(dres_target_t *, ngoal)) == NULL)
+        DRES_ACTION_ERROR(ENOMEM);
     
-    if (goal != NULL) {
-        if ((target = dres_lookup_target(dres, goal)) == NULL)
+    for (i = 0; i < ngoal; i++) {
+        if (goals[i] != NULL)
+            targets[i] = dres_lookup_target(dres, goals[i]);
+        else
+            targets[i] = dres->targets;
+        
+        if (targets[i] == NULL || !DRES_IS_DEFINED(targets[i]->id)) {
+            FREE(targets);
             DRES_ACTION_ERROR(EINVAL);
+        }
     }
-    else {
+    
+    status = update_targets(dres, targets, ngoal, locals, NULL, NULL);
+    
+    FREE(targets);
+    
+    return status;
+}
+
+
+/********************
+ * dres_prepare_goal
+ ********************/
+EXPORTED dres_goal_t *
+dres_prepare_goal(dres_t *dres, char *goal, char **locals)
+{
+    dres_target_t *target;
+    dres_goal_t   *prepared;
+    int            status, nlocal, i;
+
+    /*
+     * Notes:
+     *
+     *   A prepared goal has its target and the IDs of the given local
+     *   variables (a NULL-terminated array of names) resolved once, so
+     *   that repeated updates with dres_update_prepared can skip all the
+     *   name lookups dres_update_goal has to do.
+     */
+
+    if ((status = finalize_ruleset(dres)) != 0) {
+        errno = status;
+        return NULL;
+    }
+
+    if (goal != NULL)
+        target = dres_lookup_target(dres, goal);
+    else
         target = dres->targets;
-        goal   = target->name;
+
+    if (target == NULL || !DRES_IS_DEFINED(target->id)) {
+        errno = EINVAL;
+        return NULL;
     }
+
+    for (nlocal = 0; locals != NULL && locals[nlocal] != NULL; nlocal++)
+        ;
+
+    if ((prepared = ALLOC(dres_goal_t)) == NULL)
+        return NULL;
     
-    if (!DRES_IS_DEFINED(target->id))
+    if (nlocal > 0 && (prepared->locals = ALLOC_ARR(int, nlocal)) == NULL) {
+        FREE(prepared);
+        return NULL;
+    }
+    
+    prepared->dres   = dres;
+    prepared->target = target;
+    prepared->nlocal = nlocal;
+    
+    for (i = 0; i < nlocal; i++) {
+        if ((prepared->locals[i] = dres_dresvar_id(dres, locals[i])) ==
+            DRES_ID_NONE) {
+            DRES_ERROR("cannot set undeclared variable &%s", locals[i]);
+            dres_free_prepared(prepared);
+            errno = ENOENT;
+            return NULL;
+        }
+    }
+    
+    return prepared;
+}
+
+
+/********************
+ * dres_update_prepared
+ ********************/
+EXPORTED int
+dres_update_prepared(dres_goal_t *goal, dres_value_t *values)
+{
+    if (goal == NULL || (goal->nlocal > 0 && values == NULL))
         DRES_ACTION_ERROR(EINVAL);
 
+    return update_targets(goal->dres, &goal->target, 1, NULL, goal, values);
+}
+
+
+/********************
+ * dres_free_prepared
+ ********************/
+EXPORTED void
+dres_free_prepared(dres_goal_t *goal)
+{
+    if (goal != NULL) {
+        FREE(goal->locals);
+        FREE(goal);
+    }
+}
+
+
+/********************
+ * finalize_ruleset
+ ********************/
+static int
+finalize_ruleset(dres_t *dres)
+{
+    int status;
+
+    if (!DRES_TST_FLAG(dres, ACTIONS_FINALIZED))
+        if ((status = finalize_actions(dres)) != 0)
+            if (dres->fallback == NULL)
+                return status;
+    
+    if (!DRES_TST_FLAG(dres, TARGETS_FINALIZED))
+        if ((status = finalize_targets(dres)) != 0)
+            return status;
+
+    return 0;
+}
+
+
+/********************
+ * update_targets
+ ********************/
+static int
+update_targets(dres_t *dres, dres_target_t **targets, int ntarget,
+               char **locals, dres_goal_t *goal, dres_value_t *values)
+{
+    int i, status, own_tx, scope;
+
+    /* collect the check orders of goals not updated before (lazy) */
+    for (i = 0; i < ntarget; i++)
+        if (targets[i]->prereqs != NULL)
+            if ((status = dres_sort_target(dres, targets[i])) != 0)
+                DRES_ACTION_ERROR(status);
+
+    status = 0;
+
     if (!DRES_TST_FLAG(dres, TRANSACTION_ACTIVE)) {
         if (!dres_store_tx_new(dres))
             DRES_ACTION_ERROR(EINVAL);
@@ -531,30 +775,36 @@ dres_update_goal(dres_t *dres, char *goal, char **locals)
     dres->stamp++;
     dres_store_check(dres);
     
-    if (locals != NULL && (status = push_locals(dres, locals)) != 0)
-        goto rollback;
-    
-    if (target->prereqs == NULL) {
-        DEBUG(DBG_RESOLVE, "%s has no prereqs => updating", target->name);
-        status = dres_run_actions(dres, target);
+    if (goal != NULL) {
+        scope = goal->nlocal > 0;
+        if (scope && (status = push_values(dres, goal, values)) != 0)
+            goto rollback;
     }
     else {
-        for (i = 0; target->dependencies[i] != DRES_ID_NONE; i++) {
-            id = target->dependencies[i];
-        
-            if (DRES_ID_TYPE(id) != DRES_TYPE_TARGET)
-                continue;
-        
-            if ((status = dres_check_target(dres, id)) <= 0)
-                break;
-        }
+        scope = locals != NULL;
+        if (scope && (status = push_locals(dres, locals)) != 0)
+            goto rollback;
     }
+
+    if (ntarget == 1 && targets[0]->prereqs == NULL) {
+        DEBUG(DBG_RESOLVE, "%s has no prereqs => updating", targets[0]->name);
+        status = dres_check_target(dres, targets[0]->id);
+    }
+    else
+        status = update_dirty(dres, targets, ntarget);
     
-    if (locals != NULL)
+    if (scope)
         pop_locals(dres);
     
     if (status > 0) {
-        dres_update_target_stamp(dres, target);
+        /*
+         * Goals without prerequisites got stamped when they were run, with
+         * early cutoff dres_check_target has taken care of the rest, too.
+         */
+        if (!DRES_TST_FLAG(dres, EARLY_CUTOFF))
+            for (i = 0; i < ntarget; i++)
+                if (targets[i]->prereqs != NULL)
+                    dres_update_target_stamp(dres, targets[i]);
         if (own_tx)
             dres_store_tx_commit(dres);
     }
@@ -564,9 +814,66 @@ dres_update_goal(dres_t *dres, char *goal, char **locals)
             dres_store_tx_rollback(dres);
     }
     
-    DEBUG(DBG_RESOLVE, "updated of goal %s done with status %d (%s)",
-          goal, status, status < 0 ? "error" : (status ? "success" : "failed"));
+    for (i = 0; i < ntarget; i++)
+        DEBUG(DBG_RESOLVE, "updated of goal %s done with status %d (%s)",
+              targets[i]->name, status,
+              status < 0 ? "error" : (status ? "success" : "failed"));
+
+    return status;
+}
+
+
+/********************
+ * update_dirty
+ ********************/
+static int
+update_dirty(dres_t *dres, dres_target_t **targets, int ntarget)
+{
+    dres_target_t *t;
+    int            rank, status, i;
+
+    /*
+     * Notes:
+     *
+     *   Instead of walking the whole check order of the goals we only
+     *   visit the dirty targets, in rank (ie. topological) order, and
+     *   update the ones any of the goals depends on. Targets we update
+     *   mark their dependents dirty, and since those all rank higher we
+     *   get to them later during the same pass. The check orders are
+     *   sorted by rank, so testing whether a goal depends on a target
+     *   takes a bisection. Dirty targets none of the goals depend on are
+     *   left in the dirty set for later.
+     *
+     *   Targets without prerequisites are not kept in the dirty set, the
+     *   ones the goals depend on are added for this pass only. If the
+     *   pass fails we take out the ones we did not get to.
+     */
+
+    for (i = 0; i < ntarget; i++)
+        dres_seed_dirty(dres, targets[i], TRUE);
+    
+    status = TRUE;
+    
+    for (rank = dres_next_dirty(dres, 0);
+         rank >= 0;
+         rank = dres_next_dirty(dres, rank + 1)) {
+        t = dres->targets + dres->order[rank];
+        
+        for (i = 0; i < ntarget; i++)
+            if (dres_in_closure(dres, targets[i], rank))
+                break;
+        
+        if (i == ntarget)
+            continue;
+        
+        if ((status = dres_check_target(dres, t->id)) <= 0)
+            break;
+    }
 
+    if (status <= 0)
+        for (i = 0; i < ntarget; i++)
+            dres_seed_dirty(dres, targets[i], FALSE);
+    
     return status;
 }
 
@@ -606,7 +913,7 @@ push_locals(dres_t *dres, char **locals)
         return 0;
     
     if ((err = vm_scope_push(&dres->vm)) != 0)
-        return err;
+        return -err;
     
     i = 0;
     while (locals[i] != NULL) {
@@ -642,11 +949,46 @@ push_locals(dres_t *dres, char **locals)
 
  fail:
     vm_scope_pop(&dres->vm);
-    return err;
+    return -err;
 #undef FAIL
 }
 
 
+/********************
+ * push_values
+ ********************/
+static int
+push_values(dres_t *dres, dres_goal_t *goal, dres_value_t *values)
+{
+    vm_value_t v;
+    int        err, i;
+    
+    if ((err = vm_scope_push(&dres->vm)) != 0)
+        return -err;
+    
+    for (i = 0; i < goal->nlocal; i++) {
+        switch (values[i].type) {
+        case DRES_TYPE_STRING:  v.s = values[i].v.s; break;
+        case DRES_TYPE_INTEGER: v.i = values[i].v.i; break;
+        case DRES_TYPE_DOUBLE:  v.d = values[i].v.d; break;
+        case DRES_TYPE_NIL:                          continue;
+        default:
+            DRES_ERROR("local value of invalid type 0x%x", values[i].type);
+            vm_scope_pop(&dres->vm);
+            return -EINVAL;
+        }
+        
+        if ((err = vm_scope_set(dres->vm.scope, goal->locals[i],
+                                values[i].type, v)) != 0) {
+            vm_scope_pop(&dres->vm);
+            return -err;
+        }
+    }
+    
+    return 0;
+}
+
+
 /********************
  * pop_locals
  ********************/
@@ -663,11 +1005,15 @@ pop_locals(dres_t *dres)
 void
 dres_update_var_stamp(dres_t *dres, dres_variable_t *var)
 {
+    int *stamp = &DRES_STAMP(dres, var->id);
+    
     if (var->txid != dres->txid) {
         var->txid    = dres->txid;
-        var->txstamp = var->stamp;
+        var->txstamp = *stamp;
     }
-    var->stamp = dres->stamp;
+    *stamp = dres->stamp;
+
+    dres_mark_dependents(dres, var->id);
 }
 
 
@@ -677,11 +1023,23 @@ dres_update_var_stamp(dres_t *dres, dres_variable_t *var)
 void
 dres_update_target_stamp(dres_t *dres, dres_target_t *target)
 {
+    int *stamp;
+
+    if (DRES_TST_FLAG(target, TARGET_UNCHANGED)) {
+        DRES_CLR_FLAG(target, TARGET_UNCHANGED);
+        DEBUG(DBG_RESOLVE, "output of %s unchanged, stamp kept", target->name);
+        return;
+    }
+
+    stamp = &DRES_STAMP(dres, target->id);
+    
     if (target->txid != dres->txid) {
         target->txid    = dres->txid;
-        target->txstamp = target->stamp;
+        target->txstamp = *stamp;
     }
-    target->stamp = dres->stamp;
+    *stamp = dres->stamp;
+
+    dres_mark_dependents(dres, target->id);
 }
 
 
@@ -700,6 +1058,8 @@ dres_name(dres_t *dres, int id, char *buf, size_t bufsize)
 {
     dres_target_t   *target;
     dres_variable_t *variable;
+    char             selector[128];
+    int              select;
 
     switch (DRES_ID_TYPE(id)) {
     case DRES_TYPE_TARGET:
@@ -708,7 +1068,16 @@ dres_name(dres_t *dres, int id, char *buf, size_t bufsize)
         break;
     case DRES_TYPE_FACTVAR:
         variable = dres->factvars + DRES_INDEX(id);
-        snprintf(buf, bufsize, "$%s", variable->name);
+        select   = DRES_TST_FLAG(variable, VAR_SELECT);
+        if (select)
+            dres_print_selector(dres, variable->selector,
+                                selector, sizeof(selector));
+        else
+            selector[0] = '\0';
+        snprintf(buf, bufsize, "$%s%s%s%s%s%s", variable->name,
+                 select ? "[" : "", selector, select ? "]" : "",
+                 variable->field ? ":" : "",
+                 variable->field ? variable->field : "");
         break;
     case DRES_TYPE_DRESVAR:
         variable = dres->dresvars + DRES_INDEX(id);
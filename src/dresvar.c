@@ -121,16 +121,15 @@ dres_free_dresvars(dres_t *dres)
 int
 dres_check_dresvar(dres_t *dres, int id, int refstamp)
 {
-    dres_variable_t *var = dres->dresvars + DRES_INDEX(id);
-    char             name[64];
-    int              touched;
+    char name[64];
+    int  touched;
     
-    touched = var->stamp > refstamp;
+    touched = DRES_STAMP(dres, id) > refstamp;
 
     DEBUG(DBG_RESOLVE, "%s: %s (%d > %d)",
           dres_name(dres, id, name, sizeof(name)),
           touched ? "outdated" : "up-to-date",
-          var->stamp, refstamp);
+          DRES_STAMP(dres, id), refstamp);
 
     return touched;
 }
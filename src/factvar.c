@@ -29,6 +29,8 @@ USA.
 #include <dres/dres.h>
 #include "dres-debug.h"
 
+static int select_equal(dres_select_t *a, dres_select_t *b);
+
 /*****************************************************************************
  *                          *** variable handling ***                        *
  *****************************************************************************/
@@ -70,7 +72,7 @@ dres_factvar_id(dres_t *dres, char *name)
 
     if (name != NULL)
         for (i = 0, var = dres->factvars; i < dres->nfactvar; i++, var++) {
-            if (!strcmp(name, var->name))
+            if (!DRES_TST_FLAG(var, VAR_QUALIFIED) && !strcmp(name, var->name))
                 return var->id;
         }
     
@@ -78,6 +80,116 @@ dres_factvar_id(dres_t *dres, char *name)
 }
 
 
+/********************
+ * dres_factvar_field_id
+ ********************/
+int
+dres_factvar_field_id(dres_t *dres, char *name, char *field)
+{
+    if (field == NULL)
+        return DRES_ID_NONE;
+    
+    return dres_factvar_select_id(dres, name, NULL, field);
+}
+
+
+/********************
+ * dres_factvar_select_id
+ ********************/
+int
+dres_factvar_select_id(dres_t *dres, char *name, dres_select_t *selector,
+                       char *field)
+{
+    dres_variable_t *var;
+    int              id, i;
+
+    /*
+     * Notes:
+     *
+     *   Qualified prerequisites ($name:field, $name[selector] and
+     *   $name[selector]:field) are separate fact variables sharing the
+     *   name of the fact they are qualifying. They only get their stamp
+     *   updated if the selected facts or the given field of them changes
+     *   (cf. dres_store_check). The variable takes over the ownership of
+     *   selector.
+     */
+
+    if (name == NULL || (selector == NULL && field == NULL))
+        return DRES_ID_NONE;
+
+    for (i = 0, var = dres->factvars; i < dres->nfactvar; i++, var++) {
+        if (!DRES_TST_FLAG(var, VAR_QUALIFIED) || strcmp(name, var->name))
+            continue;
+        
+        if ((field == NULL) != (var->field == NULL) ||
+            (field != NULL && strcmp(field, var->field)))
+            continue;
+
+        if (select_equal(selector, var->selector)) {
+            dres_free_selector(selector);
+            return var->id;
+        }
+    }
+    
+    if ((id = dres_add_factvar(dres, name)) == DRES_ID_NONE) {
+        dres_free_selector(selector);
+        return DRES_ID_NONE;
+    }
+    
+    var = dres->factvars + DRES_INDEX(id);
+
+    if (field != NULL) {
+        if ((var->field = STRDUP(field)) == NULL) {
+            dres_free_selector(selector);
+            return DRES_ID_NONE;
+        }
+        DRES_SET_FLAG(var, VAR_FIELD);
+    }
+
+    if (selector != NULL) {
+        var->selector = selector;
+        DRES_SET_FLAG(var, VAR_SELECT);
+    }
+    
+    return var->id;
+}
+
+
+/********************
+ * select_equal
+ ********************/
+static int
+select_equal(dres_select_t *a, dres_select_t *b)
+{
+    for (; a != NULL && b != NULL; a = a->next, b = b->next) {
+        if (a->op != b->op || strcmp(a->field.name, b->field.name))
+            return FALSE;
+
+        if (a->field.value.type != b->field.value.type)
+            return FALSE;
+        
+        switch (a->field.value.type) {
+        case DRES_TYPE_INTEGER:
+            if (a->field.value.v.i != b->field.value.v.i)
+                return FALSE;
+            break;
+        case DRES_TYPE_DOUBLE:
+            if (a->field.value.v.d != b->field.value.v.d)
+                return FALSE;
+            break;
+        case DRES_TYPE_STRING:
+            if (strcmp(a->field.value.v.s, b->field.value.v.s))
+                return FALSE;
+            break;
+        default:
+            break;
+        }
+    }
+
+    return a == NULL && b == NULL;
+}
+
+
 /********************
  * dres_factvar_name
  ********************/
@@ -103,8 +215,11 @@ dres_free_factvars(dres_t *dres)
     int              i;
     dres_variable_t *var;
 
-    for (i = 0, var = dres->factvars; i < dres->nfactvar; i++, var++)
+    for (i = 0, var = dres->factvars; i < dres->nfactvar; i++, var++) {
         FREE(var->name);
+        FREE(var->field);
+        dres_free_selector(var->selector);
+    }
     
     FREE(dres->factvars);
 
@@ -120,16 +235,15 @@ dres_free_factvars(dres_t *dres)
 int
 dres_check_factvar(dres_t *dres, int id, int refstamp)
 {
-    dres_variable_t *var = dres->factvars + DRES_INDEX(id);
-    char             name[64];
-    int              touched;
+    char name[64];
+    int  touched;
 
-    touched = var->stamp > refstamp;
+    touched = DRES_STAMP(dres, id) > refstamp;
     
     DEBUG(DBG_RESOLVE, "%s: %s (%d > %d)",
           dres_name(dres, id, name, sizeof(name)),
           touched ? "outdated" : "up-to-date",
-          var->stamp, refstamp);
+          DRES_STAMP(dres, id), refstamp);
     
     return touched;
 }
@@ -170,7 +284,8 @@ int
 dres_save_factvars(dres_t *dres, dres_buf_t *buf)
 {
     dres_variable_t *v;
-    int              i;
+    dres_select_t   *s;
+    int              i, nselect;
 
     dres_buf_ws32(buf, dres->nfactvar);
     buf->header.nvariable += dres->nfactvar;
@@ -179,6 +294,35 @@ dres_save_factvars(dres_t *dres, dres_buf_t *buf)
         dres_buf_ws32(buf, v->id);
         dres_buf_wstr(buf, v->name);
         dres_buf_wu32(buf, v->flags);
+        if (DRES_TST_FLAG(v, VAR_FIELD))
+            dres_buf_wstr(buf, v->field);
+        if (!DRES_TST_FLAG(v, VAR_SELECT))
+            continue;
+
+        nselect = 0;
+        for (s = v->selector; s != NULL; s = s->next)
+            nselect++;
+        
+        dres_buf_ws32(buf, nselect);
+        for (s = v->selector; s != NULL; s = s->next) {
+            dres_buf_wstr(buf, s->field.name);
+            dres_buf_ws32(buf, s->op);
+            dres_buf_ws32(buf, s->field.value.type);
+
+            switch (s->field.value.type) {
+            case DRES_TYPE_INTEGER:
+                dres_buf_ws32(buf, s->field.value.v.i);
+                break;
+            case DRES_TYPE_STRING:
+                dres_buf_wstr(buf, s->field.value.v.s);
+                break;
+            case DRES_TYPE_DOUBLE:
+                dres_buf_wdbl(buf, s->field.value.v.d);
+                break;
+            }
+        }
+
+        buf->header.nselect += nselect;
     }
     
     return 0;
@@ -192,7 +336,8 @@ int
 dres_load_factvars(dres_t *dres, dres_buf_t *buf)
 {
     dres_variable_t *v;
-    int              i;
+    dres_select_t   *s, *prev;
+    int              i, j, nselect;
 
     dres->nfactvar = dres_buf_rs32(buf);
     dres->factvars = dres_buf_alloc(buf,dres->nfactvar*sizeof(*dres->factvars));
@@ -204,6 +349,38 @@ dres_load_factvars(dres_t *dres, dres_buf_t *buf)
         v->id    = dres_buf_rs32(buf);
         v->name  = dres_buf_rstr(buf);
         v->flags = dres_buf_ru32(buf);
+        if (DRES_TST_FLAG(v, VAR_FIELD))
+            v->field = dres_buf_rstr(buf);
+        if (!DRES_TST_FLAG(v, VAR_SELECT))
+            continue;
+
+        nselect = dres_buf_rs32(buf);
+
+        for (j = 0, prev = NULL; j < nselect; j++, prev = s) {
+            if ((s = dres_buf_alloc(buf, sizeof(*s))) == NULL)
+                return ENOMEM;
+
+            if (prev == NULL)
+                v->selector = s;
+            else
+                prev->next = s;
+
+            s->field.name       = dres_buf_rstr(buf);
+            s->op               = dres_buf_rs32(buf);
+            s->field.value.type = dres_buf_rs32(buf);
+
+            switch (s->field.value.type) {
+            case DRES_TYPE_INTEGER:
+                s->field.value.v.i = dres_buf_rs32(buf);
+                break;
+            case DRES_TYPE_STRING:
+                s->field.value.v.s = dres_buf_rstr(buf);
+                break;
+            case DRES_TYPE_DOUBLE:
+                s->field.value.v.d = dres_buf_rdbl(buf);
+                break;
+            }
+        }
     }
     
     return buf->error;
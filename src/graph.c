@@ -33,6 +33,12 @@ static int graph_build_prereq(dres_t *dres, dres_graph_t *graph,
 static int graph_has_prereq(dres_graph_t *graph, int tid, int prid);
 static int graph_add_prereq(dres_t *dres, dres_graph_t *graph,int tid,int prid);
 static int graph_add_leafs(dres_t *dres, dres_graph_t *graph);
+static int graph_index(dres_graph_t *graph, int id);
+static int graph_cmp_rank(const void *a, const void *b);
+static int graph_rank(dres_t *dres, int *order, int *rank, int *indeg);
+static int graph_closure(dres_t *dres, int idx, int *rank, int *mark,
+                         int *stack);
+static int graph_set_ranks(dres_t *dres, int *order, int *rank);
 
 
 
@@ -106,13 +112,15 @@ dres_free_graph(dres_graph_t *graph)
     dres_prereq_t *prq;
     int            i, n;
     
-    if (graph == NULL || graph->depends == NULL)
+    if (graph == NULL)
         return;
     
-    n = graph->ntarget + graph->nfactvar + graph->ndresvar;
-    for (i = 0; i < n; i++) {
-        prq = graph->depends + i;
-        FREE(prq->ids);
+    if (graph->depends != NULL) {
+        n = graph->ntarget + graph->nfactvar + graph->ndresvar;
+        for (i = 0; i < n; i++) {
+            prq = graph->depends + i;
+            FREE(prq->ids);
+        }
     }
     
     FREE(graph->depends);
@@ -172,10 +180,24 @@ graph_add_prereq(dres_t *dres, dres_graph_t *graph, int tid, int prid)
 
     idx = DRES_INDEX(prid);
 
+    /* prereqs of precompiled rulesets have not been checked yet */
     switch (DRES_ID_TYPE(prid)) {
-    case DRES_TYPE_DRESVAR: idx += graph->nfactvar; /* fall through */
-    case DRES_TYPE_FACTVAR: idx += graph->ntarget;  /* fall through */
-    case DRES_TYPE_TARGET:  break;
+    case DRES_TYPE_DRESVAR:
+        if (idx >= graph->ndresvar)
+            return EINVAL;
+        idx += graph->nfactvar + graph->ntarget;
+        break;
+    case DRES_TYPE_FACTVAR:
+        if (idx >= graph->nfactvar)
+            return EINVAL;
+        idx += graph->ntarget;
+        break;
+    case DRES_TYPE_TARGET:
+        if (idx >= graph->ntarget)
+            return EINVAL;
+        break;
+    default:
+        return EINVAL;
     }
 
     depends = graph->depends + idx;
@@ -539,9 +561,757 @@ dres_sort_graph(dres_t *dres, dres_graph_t *graph)
 
 
 
+/*****************************************************************************
+ *                    *** persistent reverse dependencies ***                *
+ *****************************************************************************/
+
+/*
+ * Notes:
+ *
+ *   Besides the dirty flag of each target we keep a bitmap of the dirty
+ *   targets indexed by their topological rank. Updating a goal walks the
+ *   bitmap in rank order and only checks the dirty targets the goal
+ *   (transitively) depends on, instead of walking its whole check order.
+ *   Dependents always rank higher than the targets they depend on, so
+ *   the ones marked dirty while we are walking are still ahead of us.
+ *   Targets without prerequisites are always updated. Keeping them in the
+ *   bitmap would make every pass visit all of them, so they are only put
+ *   there for the duration of a pass, and only the ones in the check order
+ *   of one of the goals (cf. dres_seed_dirty).
+ */
+
+#define DIRTY_BITS      ((int)(8 * sizeof(unsigned long)))
+#define DIRTY_WORDS(n)  (((n) + DIRTY_BITS - 1) / DIRTY_BITS)
+
+
+
+/********************
+ * dres_build_index
+ ********************/
+int
+dres_build_index(dres_t *dres)
+{
+    dres_graph_t  *graph;
+    dres_target_t *t;
+    int            prid, i, j, k, n, ncheck, status;
+
+    /*
+     * Notes:
+     *
+     *   Unlike the per-goal graphs built by dres_build_graph this one
+     *   covers the whole ruleset and only contains direct edges. It is
+     *   kept around for the lifetime of dres and used to propagate the
+     *   dirty state of targets from changed variables and updated
+     *   targets to their immediate dependents.
+     *
+     *   Along with it we set up the dense stamp array and for each target
+     *   the vector of stamp indices of its (unique) prerequisites, so that
+     *   checking a target boils down to a gather-and-compare loop.
+     */
+
+    dres_free_index(dres);
+
+    n = dres->ntarget + dres->nfactvar + dres->ndresvar;
+
+    for (i = ncheck = 0, t = dres->targets; i < dres->ntarget; i++, t++)
+        if (t->prereqs != NULL)
+            ncheck += t->prereqs->nid;
+    
+    if (ALLOC_OBJ(graph) == NULL)
+        return ENOMEM;
+    
+    graph->ntarget  = dres->ntarget;
+    graph->nfactvar = dres->nfactvar;
+    graph->ndresvar = dres->ndresvar;
+    graph->depends  = ALLOC_ARR(typeof(*graph->depends), n);
+    
+    dres->graph  = graph;
+    dres->stamps = ALLOC_ARR(int, n);
+    dres->checks = ALLOC_ARR(int, ncheck ? ncheck : 1);
+    dres->ncheck = 0;
+    
+    if (graph->depends == NULL || dres->stamps == NULL || dres->checks == NULL)
+        goto nomem;
+
+    for (i = 0, t = dres->targets; i < dres->ntarget; i++, t++) {
+        DRES_SET_FLAG(t, TARGET_DIRTY);           /* check everything once */
+
+        t->checks = dres->checks + dres->ncheck;
+        t->ncheck = 0;
+        
+        if (!DRES_IS_DEFINED(t->id) || t->prereqs == NULL)
+            continue;
+
+        for (j = 0; j < t->prereqs->nid; j++) {
+            prid = t->prereqs->ids[j];
+            
+            for (k = 0; k < j; k++)                 /* skip duplicates */
+                if (t->prereqs->ids[k] == prid)
+                    break;
+            if (k < j)
+                continue;
+            
+            if ((status = graph_add_prereq(dres, graph, t->id, prid)) != 0) {
+                dres_free_index(dres);
+                return status;
+            }
+
+            t->checks[t->ncheck++] = DRES_STAMP_INDEX(dres, prid);
+        }
+
+        dres->ncheck += t->ncheck;
+    }
+
+    return 0;
+
+ nomem:
+    dres_free_index(dres);
+    return ENOMEM;
+}
+
+
+/********************
+ * dres_free_index
+ ********************/
+void
+dres_free_index(dres_t *dres)
+{
+    dres_free_graph(dres->graph);
+    FREE(dres->stamps);
+    FREE(dres->checks);
+
+    dres->graph  = NULL;
+    dres->stamps = NULL;
+    dres->checks = NULL;
+    dres->ncheck = 0;
+}
+
+
+/********************
+ * dres_mark_dependents
+ ********************/
+void
+dres_mark_dependents(dres_t *dres, int id)
+{
+    dres_prereq_t *depends;
+    dres_target_t *t;
+    int            i;
+    char           buf[32], buf1[32];
+    
+    if (dres->graph == NULL)
+        return;
+
+    depends = dres->graph->depends + graph_index(dres->graph, id);
+
+    for (i = 0; i < depends->nid; i++) {
+        t = dres->targets + DRES_INDEX(depends->ids[i]);
+
+        if (DRES_TST_FLAG(t, TARGET_DIRTY))
+            continue;
+
+        DEBUG(DBG_RESOLVE, "%s changed, marking %s dirty",
+              dres_name(dres, id, buf, sizeof(buf)),
+              dres_name(dres, t->id, buf1, sizeof(buf1)));
+
+        dres_set_dirty(dres, t);
+    }
+}
+
+
+/********************
+ * dres_set_dirty
+ ********************/
+void
+dres_set_dirty(dres_t *dres, dres_target_t *target)
+{
+    int rank;
+    
+    DRES_SET_FLAG(target, TARGET_DIRTY);
+
+    if (dres->dirty != NULL) {
+        rank = dres->ranks[DRES_INDEX(target->id)];
+        dres->dirty[rank / DIRTY_BITS] |= 1UL << (rank % DIRTY_BITS);
+    }
+}
+
+
+/********************
+ * dres_clear_dirty
+ ********************/
+void
+dres_clear_dirty(dres_t *dres, dres_target_t *target)
+{
+    int rank;
+    
+    DRES_CLR_FLAG(target, TARGET_DIRTY);
+
+    if (dres->dirty != NULL) {
+        rank = dres->ranks[DRES_INDEX(target->id)];
+        dres->dirty[rank / DIRTY_BITS] &= ~(1UL << (rank % DIRTY_BITS));
+    }
+}
+
+
+/********************
+ * dres_seed_dirty
+ ********************/
+void
+dres_seed_dirty(dres_t *dres, dres_target_t *goal, int seed)
+{
+    dres_target_t *t;
+    int           *deps, i;
+
+    /* add or remove the targets without prereqs the goal depends on */
+
+    if (dres->dirty == NULL)
+        return;
+    
+    if ((deps = goal->dependencies) == NULL) {
+        if (goal->prereqs == NULL) {
+            if (seed)
+                dres_set_dirty(dres, goal);
+            else
+                dres_clear_dirty(dres, goal);
+        }
+        return;
+    }
+    
+    for (i = 0; i < goal->ndependency; i++) {
+        t = dres->targets + DRES_INDEX(deps[i]);
+        if (t->prereqs == NULL) {
+            if (seed)
+                dres_set_dirty(dres, t);
+            else
+                dres_clear_dirty(dres, t);
+        }
+    }
+}
+
+
+/********************
+ * dres_next_dirty
+ ********************/
+int
+dres_next_dirty(dres_t *dres, int rank)
+{
+    unsigned long bits;
+    int           w, nword;
+
+    if (rank >= dres->ntarget)
+        return -1;
+
+    nword = DIRTY_WORDS(dres->ntarget);
+    w     = rank / DIRTY_BITS;
+    bits  = dres->dirty[w] & (~0UL << (rank % DIRTY_BITS));
+
+    while (bits == 0) {
+        if (++w >= nword)
+            return -1;
+        bits = dres->dirty[w];
+    }
+    
+    return w * DIRTY_BITS + __builtin_ctzl(bits);
+}
+
+
+/********************
+ * dres_in_closure
+ ********************/
+int
+dres_in_closure(dres_t *dres, dres_target_t *goal, int rank)
+{
+    int *deps, lo, hi, mid, r;
+
+    /* check orders are sorted by rank, so we can bisect them */
+    
+    if ((deps = goal->dependencies) == NULL)
+        return dres->ranks[DRES_INDEX(goal->id)] == rank;
+
+    lo = 0;
+    hi = goal->ndependency - 1;
+    
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        r   = dres->ranks[DRES_INDEX(deps[mid])];
+        
+        if (r == rank)
+            return TRUE;
+        if (r < rank)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return FALSE;
+}
+
+
+/*****************************************************************************
+ *                      *** global dependency ordering ***                   *
+ *****************************************************************************/
+
+/********************
+ * dres_sort_targets
+ ********************/
+int
+dres_sort_targets(dres_t *dres)
+{
+#define FAIL(ec) do { status = (ec); goto out; } while (0)
+    dres_target_t *t;
+    int           *order, *rank, *first, *mark, *stack, *deps;
+    int            ntarget, cnt, ndep, size;
+    int            i, j, k, status;
+    char           name[64];
+
+    /*
+     * Notes:
+     *
+     *   We sort all targets topologically once, using the reverse
+     *   dependency index (cf. dres_build_index). The check order of each
+     *   target is then the set of targets it (transitively) depends on,
+     *   itself included, sorted by this global order. The check orders
+     *   of all targets are stored back-to-back, each terminated by
+     *   DRES_ID_NONE, in a single shared array with the dependencies of
+     *   each target pointing to its own slice of it.
+     */
+
+    if (dres->graph == NULL)
+        return EINVAL;
+
+    ntarget = dres->ntarget;
+    deps    = NULL;
+    ndep    = size = 0;
+    status  = 0;
+    
+    order = ALLOC_ARR(int, ntarget);
+    rank  = ALLOC_ARR(int, ntarget);
+    first = ALLOC_ARR(int, ntarget);
+    mark  = ALLOC_ARR(int, ntarget);
+    stack = ALLOC_ARR(int, ntarget);
+
+    if (!order || !rank || !first || !mark || !stack)
+        FAIL(ENOMEM);
+
+    if ((status = graph_rank(dres, order, rank, first)) != 0)
+        goto out;
+    
+    /*
+     * collect and sort the transitive prerequisites of each target, reusing
+     * first for the offsets of the slices
+     */
+    for (i = 0; i < ntarget; i++) {
+        cnt = graph_closure(dres, i, rank, mark, stack);
+        
+        if (ndep + cnt + 1 > size) {
+            k = size ? 2 * size : ntarget + 1;
+            while (k < ndep + cnt + 1)
+                k *= 2;
+            if (!REALLOC_ARR(deps, size, k))
+                FAIL(ENOMEM);
+            size = k;
+        }
+
+        first[i] = ndep;
+        for (j = 0; j < cnt; j++)
+            deps[ndep++] = dres->targets[order[stack[j]]].id;
+        deps[ndep++] = DRES_ID_NONE;
+    }
+
+    /* drop any check orders we have sorted on demand so far */
+    if (dres->dependencies == NULL)
+        for (i = 0, t = dres->targets; i < ntarget; i++, t++)
+            FREE(t->dependencies);
+    
+    FREE(dres->dependencies);
+    dres->dependencies = deps;
+    dres->ndependency  = ndep;
+    deps = NULL;
+    
+    for (i = 0, t = dres->targets; i < ntarget; i++, t++) {
+        t->dependencies = dres->dependencies + first[i];
+        t->ndependency  = (i < ntarget-1 ? first[i+1] : ndep) - first[i] - 1;
+        
+        DEBUG(DBG_GRAPH, "topological sort for goal %s:\n",
+              dres_name(dres, t->id, name, sizeof(name)));
+        dres_dump_sort(dres, t->dependencies);
+    }
+
+    if ((status = graph_set_ranks(dres, order, rank)) == 0)
+        order = rank = NULL;
+    
+ out:
+    FREE(order);
+    FREE(rank);
+    FREE(first);
+    FREE(mark);
+    FREE(stack);
+    FREE(deps);
+    
+    return status;
+#undef FAIL
+}
+
+
+/********************
+ * dres_rank_targets
+ ********************/
+int
+dres_rank_targets(dres_t *dres)
+{
+    dres_target_t *t;
+    int           *order, *rank, *indeg, *deps, status, nstamp, i, n;
+
+    /*
+     * Notes:
+     *
+     *   With lazy finalization we only rank the targets up front and
+     *   leave it to dres_sort_target to collect the check order of a
+     *   target the first time it is updated as a goal. Each such check
+     *   order is allocated separately, as opposed to dres_sort_targets.
+     */
+
+    if (dres->graph == NULL)
+        return EINVAL;
+
+    order = ALLOC_ARR(int, dres->ntarget);
+    rank  = ALLOC_ARR(int, dres->ntarget);
+    indeg = ALLOC_ARR(int, dres->ntarget);
+
+    if (order == NULL || rank == NULL || indeg == NULL)
+        status = ENOMEM;
+    else
+        status = graph_rank(dres, order, rank, indeg);
+
+    FREE(indeg);
+
+    /*
+     * measure and check any check orders and reduced checks we have
+     * (loaded precompiled, cf. dres_load_targets for the ranges of the
+     * targets in the check orders)
+     */
+    nstamp = dres->ntarget + dres->nfactvar + dres->ndresvar;
+    
+    for (i = 0, t = dres->targets; status == 0 && i < dres->ntarget; i++, t++) {
+        if ((deps = t->dependencies) != NULL) {
+            for (n = 0; deps[n] != DRES_ID_NONE; n++) {
+                if (n > 0 && rank[DRES_INDEX(deps[n - 1])] >=
+                             rank[DRES_INDEX(deps[n])]) {
+                    DRES_ERROR("check order of target %s is not sorted",
+                               t->name);
+                    status = EINVAL;
+                    break;
+                }
+            }
+        
+            t->ndependency = n;
+        }
+        
+        for (n = 0; status == 0 && t->reduced && n < t->nreduced; n++) {
+            if (t->reduced[n] < 0 || t->reduced[n] >= nstamp) {
+                DRES_ERROR("invalid reduced check %d for target %s",
+                           t->reduced[n], t->name);
+                status = EINVAL;
+            }
+        }
+    }
+
+    if (status == 0)
+        status = graph_set_ranks(dres, order, rank);
+
+    if (status != 0) {
+        FREE(order);
+        FREE(rank);
+        return status;
+    }
+
+    return 0;
+}
+
+
+/********************
+ * dres_sort_target
+ ********************/
+int
+dres_sort_target(dres_t *dres, dres_target_t *target)
+{
+    int  *mark, *stack, *deps;
+    int   cnt, i;
+    char  name[64];
+
+    if (target->dependencies != NULL)
+        return 0;
 
+    if (dres->ranks == NULL || dres->order == NULL)
+        return EINVAL;
 
+    mark  = ALLOC_ARR(int, dres->ntarget);
+    stack = ALLOC_ARR(int, dres->ntarget);
+    deps  = NULL;
 
+    if (mark != NULL && stack != NULL) {
+        cnt = graph_closure(dres, DRES_INDEX(target->id), dres->ranks,
+                            mark, stack);
+        
+        if ((deps = ALLOC_ARR(int, cnt + 1)) != NULL) {
+            for (i = 0; i < cnt; i++)
+                deps[i] = dres->targets[dres->order[stack[i]]].id;
+            deps[cnt] = DRES_ID_NONE;
+        }
+    }
+    
+    FREE(mark);
+    FREE(stack);
+
+    if (deps == NULL)
+        return ENOMEM;
+    
+    target->dependencies = deps;
+    target->ndependency  = cnt;
+    
+    DEBUG(DBG_GRAPH, "topological sort for goal %s:\n",
+          dres_name(dres, target->id, name, sizeof(name)));
+    dres_dump_sort(dres, target->dependencies);
+    
+    return 0;
+}
+
+
+/********************
+ * graph_rank
+ ********************/
+static int
+graph_rank(dres_t *dres, int *order, int *rank, int *indeg)
+{
+    dres_graph_t  *graph = dres->graph;
+    dres_prereq_t *depends;
+    int            ntarget, head, tail, i, j, x, y;
+
+    ntarget = dres->ntarget;
+    
+    /* count incoming edges */
+    memset(indeg, 0, ntarget * sizeof(indeg[0]));
+    for (i = 0; i < ntarget; i++) {
+        depends = graph->depends + i;
+        for (j = 0; j < depends->nid; j++)
+            indeg[DRES_INDEX(depends->ids[j])]++;
+    }
+
+    /* Kahn's algorithm, using the order itself as the queue */
+    for (i = tail = 0; i < ntarget; i++)
+        if (indeg[i] == 0)
+            order[tail++] = i;
+
+    for (head = 0; head < tail; head++) {
+        x       = order[head];
+        depends = graph->depends + x;
+        rank[x] = head;
+        
+        for (j = 0; j < depends->nid; j++) {
+            y = DRES_INDEX(depends->ids[j]);
+            if (--indeg[y] == 0)
+                order[tail++] = y;
+        }
+    }
+
+    if (tail < ntarget) {
+        DRES_ERROR("cyclic dependency graph, cannot sort targets");
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+
+/********************
+ * graph_set_ranks
+ ********************/
+static int
+graph_set_ranks(dres_t *dres, int *order, int *rank)
+{
+    dres_target_t *t;
+    unsigned long *dirty;
+    int            i;
+
+    /* take over the ranking and rebuild the dirty bitmap for it */
+    
+    dirty = ALLOC_ARR(unsigned long, DIRTY_WORDS(dres->ntarget) + 1);
+
+    if (dirty == NULL)
+        return ENOMEM;
+    
+    FREE(dres->order);
+    FREE(dres->ranks);
+    FREE(dres->dirty);
+    dres->order = order;
+    dres->ranks = rank;
+    dres->dirty = dirty;
+
+    for (i = 0, t = dres->targets; i < dres->ntarget; i++, t++)
+        if (DRES_TST_FLAG(t, TARGET_DIRTY) && t->prereqs != NULL)
+            dres_set_dirty(dres, t);
+
+    return 0;
+}
+
+
+/********************
+ * graph_closure
+ ********************/
+static int
+graph_closure(dres_t *dres, int idx, int *rank, int *mark, int *stack)
+{
+    dres_prereq_t *prq;
+    int            sp, cnt, j, x, y;
+
+    /*
+     * Collect the ranks of all targets idx (transitively) depends on into
+     * the bottom of stack, sorted. The stack grows from the top down while
+     * the collected ranks fill it from the bottom up, so they never meet.
+     */
+
+    mark[idx]              = idx + 1;
+    stack[dres->ntarget-1] = idx;
+    sp                     = dres->ntarget - 1;
+    cnt                    = 0;
+    
+    while (sp < dres->ntarget) {
+        x = stack[sp++];
+        stack[cnt++] = rank[x];
+        
+        if ((prq = dres->targets[x].prereqs) == NULL)
+            continue;
+        
+        for (j = 0; j < prq->nid; j++) {
+            if (DRES_ID_TYPE(prq->ids[j]) != DRES_TYPE_TARGET)
+                continue;
+            y = DRES_INDEX(prq->ids[j]);
+            if (mark[y] != idx + 1) {
+                mark[y]     = idx + 1;
+                stack[--sp] = y;
+            }
+        }
+    }
+
+    qsort(stack, cnt, sizeof(stack[0]), graph_cmp_rank);
+
+    return cnt;
+}
+
+
+/********************
+ * dres_reduce_prereqs
+ ********************/
+int
+dres_reduce_prereqs(dres_t *dres)
+{
+    dres_target_t *t;
+    dres_prereq_t *prq;
+    int           *mark, *stack, *reduced;
+    int            n, sp, nreduced, i, j, x, y;
+
+    /*
+     * Notes:
+     *
+     *   A prerequisite of a target is redundant for checking if it is
+     *   also a (transitive) prerequisite of another target prerequisite.
+     *   That other target is checked first and, whenever the redundant
+     *   prerequisite is newer, gets updated itself and becomes newer than
+     *   our target, too. Hence comparing against it alone is sufficient.
+     *
+     *   This does not hold with early cutoff, when a target can keep its
+     *   old stamp after an update. So we keep both the full and the
+     *   reduced set of checks and use the latter only without cutoff.
+     */
+
+    n = dres->ntarget + dres->nfactvar + dres->ndresvar;
+
+    mark    = ALLOC_ARR(int, n);
+    stack   = ALLOC_ARR(int, 2 * n);
+    reduced = ALLOC_ARR(int, dres->ncheck ? dres->ncheck : 1);
+    
+    if (mark == NULL || stack == NULL || reduced == NULL) {
+        FREE(mark);
+        FREE(stack);
+        FREE(reduced);
+        return ENOMEM;
+    }
+    
+    nreduced = 0;
+    for (i = 0, t = dres->targets; i < dres->ntarget; i++, t++) {
+        t->reduced  = reduced + nreduced;
+        t->nreduced = 0;
+
+        /* mark everything reachable through the target prerequisites */
+        for (j = sp = 0; j < t->ncheck; j++) {
+            if ((x = t->checks[j]) >= dres->ntarget)
+                continue;
+            stack[sp++] = x;
+        }
+
+        while (sp > 0) {
+            x = stack[--sp];
+
+            if ((prq = dres->targets[x].prereqs) == NULL)
+                continue;
+
+            for (j = 0; j < prq->nid; j++) {
+                y = DRES_STAMP_INDEX(dres, prq->ids[j]);
+                if (mark[y] != i + 1) {
+                    mark[y] = i + 1;
+                    if (y < dres->ntarget)
+                        stack[sp++] = y;
+                }
+            }
+        }
+        
+        for (j = 0; j < t->ncheck; j++)
+            if (mark[t->checks[j]] != i + 1)
+                t->reduced[t->nreduced++] = t->checks[j];
+
+        if (t->nreduced < t->ncheck)
+            DEBUG(DBG_GRAPH, "%s: %d of %d prerequisites need checking",
+                  t->name, t->nreduced, t->ncheck);
+        
+        nreduced += t->nreduced;
+    }
+
+    FREE(mark);
+    FREE(stack);
+    FREE(dres->reduced);
+    
+    dres->reduced  = reduced;
+    dres->nreduced = nreduced;
+    
+    return 0;
+}
+
+
+/********************
+ * graph_cmp_rank
+ ********************/
+static int
+graph_cmp_rank(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+
+/********************
+ * graph_index
+ ********************/
+static int
+graph_index(dres_graph_t *graph, int id)
+{
+    int idx = DRES_INDEX(id);
+
+    switch (DRES_ID_TYPE(id)) {
+    case DRES_TYPE_DRESVAR: idx += graph->nfactvar; /* fall through */
+    case DRES_TYPE_FACTVAR: idx += graph->ntarget;  /* fall through */
+    case DRES_TYPE_TARGET:  break;
+    }
+
+    return idx;
+}
 
 
 /* 
@@ -54,6 +54,8 @@ char *factname  (char *);
 
 static char *current_prefix;
 
+static int prereq_selector(dres_select_t *selector);
+
 
 
 %}
@@ -544,6 +546,42 @@ prereq:   TOKEN_IDENT            { $$ = dres_target_id(dres, $1.value); }
             if ((v = dres_lookup_variable(dres, $$)) != NULL)
                 v->flags |= DRES_VAR_PREREQ;
         }
+	| TOKEN_FACTVAR ":" TOKEN_IDENT {
+            dres_variable_t *v;
+            /* the fact itself needs to be tracked for field changes */
+            $$ = dres_factvar_id(dres, FQFN($1.value));
+            if ((v = dres_lookup_variable(dres, $$)) != NULL)
+                v->flags |= DRES_VAR_PREREQ;
+            $$ = dres_factvar_field_id(dres, FQFN($1.value), $3.value);
+            if ((v = dres_lookup_variable(dres, $$)) != NULL)
+                v->flags |= DRES_VAR_PREREQ;
+        }
+	| TOKEN_FACTVAR "[" sfields "]" {
+            dres_variable_t *v;
+            if (!prereq_selector($3)) {
+                dres_free_selector($3);
+                YYABORT;
+            }
+            $$ = dres_factvar_id(dres, FQFN($1.value));
+            if ((v = dres_lookup_variable(dres, $$)) != NULL)
+                v->flags |= DRES_VAR_PREREQ;
+            $$ = dres_factvar_select_id(dres, FQFN($1.value), $3, NULL);
+            if ((v = dres_lookup_variable(dres, $$)) != NULL)
+                v->flags |= DRES_VAR_PREREQ;
+        }
+	| TOKEN_FACTVAR "[" sfields "]" ":" TOKEN_IDENT {
+            dres_variable_t *v;
+            if (!prereq_selector($3)) {
+                dres_free_selector($3);
+                YYABORT;
+            }
+            $$ = dres_factvar_id(dres, FQFN($1.value));
+            if ((v = dres_lookup_variable(dres, $$)) != NULL)
+                v->flags |= DRES_VAR_PREREQ;
+            $$ = dres_factvar_select_id(dres, FQFN($1.value), $3, $6.value);
+            if ((v = dres_lookup_variable(dres, $$)) != NULL)
+                v->flags |= DRES_VAR_PREREQ;
+        }
 	;
 
 varref: TOKEN_FACTVAR {
@@ -1166,6 +1204,32 @@ expr_call: TOKEN_IDENT "(" args_by_value "," locals ")" {
 %%
 
 
+/********************
+ * prereq_selector
+ ********************/
+static int
+prereq_selector(dres_select_t *selector)
+{
+    dres_select_t *s;
+
+    /*
+     * Notes:
+     *     Prerequisites are checked outside of any action, so there
+     *     are no local variables a selector could refer to.
+     */
+
+    for (s = selector; s != NULL; s = s->next) {
+        if (s->field.value.type == DRES_TYPE_DRESVAR) {
+            DRES_ERROR("local variable in prerequisite selector %s on "
+                       "line %d", s->field.name, lexer_line());
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
 /********************
  * set_prefix
  ********************/
@@ -30,6 +30,9 @@ USA.
 #include <dres/compiler.h>
 #include "dres-debug.h"
 
+/* size of an integer array padded for the allocation following it */
+#define INT_ARR_SIZE(n) DRES_ALIGN_TO((n) * sizeof(int), DRES_ALIGNMENT)
+
 
 /*****************************************************************************
  *                            *** target handling ***                        *
@@ -113,16 +116,59 @@ dres_free_targets(dres_t *dres)
         FREE(target->name);
         dres_free_prereq(target->prereqs);
         dres_free_statement(target->statements);
-        FREE(target->dependencies);
         vm_chunk_del(target->code);
+
+        if (dres->dependencies == NULL)         /* sorted on demand */
+            FREE(target->dependencies);
     }
 
+    FREE(dres->dependencies);
+    dres->dependencies = NULL;
+    dres->ndependency  = 0;
+
+    FREE(dres->ranks);
+    FREE(dres->order);
+    FREE(dres->dirty);
+    dres->ranks = NULL;
+    dres->order = NULL;
+    dres->dirty = NULL;
+    
+    FREE(dres->reduced);
+    dres->reduced  = NULL;
+    dres->nreduced = 0;
+    
     FREE(dres->targets);
     dres->targets = NULL;
     dres->ntarget = 0;
 }
 
 
+/********************
+ * dres_unload_targets
+ ********************/
+void
+dres_unload_targets(dres_t *dres)
+{
+    dres_target_t *target;
+    int            i;
+
+    if (dres->targets == NULL)
+        return;
+
+    /* all but the resolved field names and the ranking live in the image */
+    for (i = 0, target = dres->targets; i < dres->ntarget; i++, target++)
+        if (target->code != NULL)
+            FREE(target->code->quarks);
+
+    FREE(dres->ranks);
+    FREE(dres->order);
+    FREE(dres->dirty);
+    dres->ranks = NULL;
+    dres->order = NULL;
+    dres->dirty = NULL;
+}
+
+
 /********************
  * dres_dump_targets
  ********************/
@@ -201,38 +247,65 @@ dres_check_target(dres_t *dres, int tid)
 {
     dres_target_t *target, *t;
     dres_prereq_t *prq;
-    int            i, id, update, status;
+    int            i, n, id, update, status, stamp, *stamps, *checks;
     char           buf[32];
 
+    target = dres->targets + DRES_INDEX(tid);
+
+    /*
+     * Targets only become dirty when one of their prerequisites has been
+     * updated (cf. dres_mark_dependents). Clean ones are up-to-date without
+     * having to compare the stamps of all their prerequisites.
+     */
+    
+    if (target->prereqs != NULL && !DRES_TST_FLAG(target, TARGET_DIRTY))
+        return TRUE;
+
     DEBUG(DBG_RESOLVE, "checking target %s",
           dres_name(dres, tid, buf, sizeof(buf)));
 
-    target = dres->targets + DRES_INDEX(tid);
+    stamps = dres->stamps;
+    stamp  = stamps[DRES_INDEX(tid)];
     
     if ((prq = target->prereqs) == NULL) {
         DEBUG(DBG_RESOLVE, "no prereqs (always update)");
         update = TRUE;
     }
+    else if (!DEBUG_ON(DBG_RESOLVE)) {
+        /* gather and compare the stamps of all (non-redundant) prereqs */
+        if (DRES_TST_FLAG(dres, EARLY_CUTOFF) || target->reduced == NULL) {
+            checks = target->checks;
+            n      = target->ncheck;
+        }
+        else {
+            checks = target->reduced;
+            n      = target->nreduced;
+        }
+        
+        update = FALSE;
+        for (i = 0; i < n; i++)
+            update |= stamps[checks[i]] > stamp;
+    }
     else {
         update = FALSE;
         for (i = 0; i < prq->nid; i++) {
             id = prq->ids[i];
             switch (DRES_ID_TYPE(id)) {
             case DRES_TYPE_FACTVAR:
-                if (dres_check_factvar(dres, id, target->stamp))
+                if (dres_check_factvar(dres, id, stamp))
                     update = TRUE;
                 break;
             case DRES_TYPE_DRESVAR:
-                if (dres_check_dresvar(dres, id, target->stamp))
+                if (dres_check_dresvar(dres, id, stamp))
                     update = TRUE;
                 break;
             case DRES_TYPE_TARGET:
                 t = dres->targets + DRES_INDEX(id);
                 DEBUG(DBG_RESOLVE, "%s: %s (%d > %d)",
                       t->name,
-                      t->stamp > target->stamp ? "outdated" : "up-to-date",
-                      t->stamp, target->stamp);
-                if (t->stamp > target->stamp)
+                      stamps[DRES_INDEX(id)] > stamp ? "outdated":"up-to-date",
+                      stamps[DRES_INDEX(id)], stamp);
+                if (stamps[DRES_INDEX(id)] > stamp)
                     update = TRUE;
                 break;
             default:
@@ -251,6 +324,9 @@ dres_check_target(dres_t *dres, int tid)
         DEBUG(DBG_RESOLVE, "=> %s already up-to-date", target->name);
         status = TRUE;
     }
+
+    if (status > 0)
+        dres_clear_dirty(dres, target);
     
     return status;
 }
@@ -263,11 +339,24 @@ int
 dres_save_targets(dres_t *dres, dres_buf_t *buf)
 {
     dres_target_t *t;
-    int            i, j;
+    char          *pad;
+    int            i, j, nword, nconst;
 
     dres_buf_ws32(buf, dres->ntarget);
     buf->header.ntarget = dres->ntarget;
 
+    /* the check orders of all targets, back-to-back */
+    dres_buf_ws32(buf, dres->ndependency);
+    for (i = 0; i < dres->ndependency; i++)
+        dres_buf_ws32(buf, dres->dependencies[i]);
+    buf->header.ndependency = dres->ndependency;
+
+    /* the reduced prerequisite checks of all targets, back-to-back */
+    dres_buf_ws32(buf, dres->nreduced);
+    for (i = 0; i < dres->nreduced; i++)
+        dres_buf_ws32(buf, dres->reduced[i]);
+    buf->header.nreduced = dres->nreduced;
+
     for (i = 0, t = dres->targets; i < dres->ntarget; i++, t++) {
         dres_buf_ws32(buf, t->id);
         dres_buf_wstr(buf, t->name);
@@ -288,31 +377,36 @@ dres_save_targets(dres_t *dres, dres_buf_t *buf)
             dres_buf_ws32(buf, 0);
         }
         else {
+            nword  = t->code->nsize / sizeof(vm_instr_t);
+            nconst = DRES_ALIGN_TO(t->code->nconst, DRES_ALIGNMENT);
+            
             dres_buf_ws32(buf, t->code->ninstr);
             dres_buf_ws32(buf, t->code->nsize);
-            
-#if 1
-            dres_buf_wbuf(buf, (char *)t->code->instrs, t->code->nsize);
-#else /* XXX TODO: this is completely broken now wrt. endianness */
-            for (j = 0; j < t->code->ninstr; j++)
+            for (j = 0; j < nword; j++)
                 dres_buf_wu32(buf, t->code->instrs[j]);
-#endif
+
+            /* the constant pool is in network byte order, dump it as is */
+            dres_buf_ws32(buf, nconst);
+            if (t->code->nconst > 0)
+                dres_buf_wbuf(buf, t->code->consts, t->code->nconst);
+            if ((pad = dres_buf_alloc(buf, nconst - t->code->nconst)) != NULL)
+                memset(pad, 0, nconst - t->code->nconst);
 
             buf->header.ncode++;
-            buf->header.sinstr += t->code->nsize;
+            buf->header.sinstr += DRES_ALIGN_TO(t->code->nsize, DRES_ALIGNMENT);
+            buf->header.sinstr += nconst;
         }
         
         if (t->dependencies == NULL)
-            dres_buf_ws32(buf, 0);
-        else {
-            for (j = 0; t->dependencies[j] != DRES_ID_NONE; j++)
-                ;
-            dres_buf_ws32(buf, j + 1);
-
-            for (j = 0; t->dependencies[j] != DRES_ID_NONE; j++)
-                dres_buf_ws32(buf, t->dependencies[j]);
+            dres_buf_ws32(buf, -1);
+        else
+            dres_buf_ws32(buf, t->dependencies - dres->dependencies);
 
-            buf->header.ndependency += j + 1;
+        if (t->reduced == NULL)
+            dres_buf_ws32(buf, -1);
+        else {
+            dres_buf_ws32(buf, t->reduced - dres->reduced);
+            dres_buf_ws32(buf, t->nreduced);
         }
     }
 
@@ -327,7 +421,7 @@ int
 dres_load_targets(dres_t *dres, dres_buf_t *buf)
 {
     dres_target_t *t;
-    int            i, j, n;
+    int            i, j, n, id, nword, status;
 
     dres->ntarget = dres_buf_rs32(buf);
     dres->targets = dres_buf_alloc(buf, dres->ntarget * sizeof(*dres->targets));
@@ -335,6 +429,50 @@ dres_load_targets(dres_t *dres, dres_buf_t *buf)
     if (dres->targets == NULL)
         return ENOMEM;
 
+    /*
+     * Notes:
+     *   The integer arrays are padded to keep the chunks and prereqs
+     *   allocated after them from the same buffer aligned.
+     */
+    
+    dres->ndependency  = n = dres_buf_rs32(buf);
+    dres->dependencies = dres_buf_alloc(buf, INT_ARR_SIZE(n));
+    
+    if (dres->dependencies == NULL && n > 0)
+        return ENOMEM;
+
+    for (i = 0; i < n; i++)
+        dres->dependencies[i] = dres_buf_rs32(buf);
+
+    if (buf->error)
+        return buf->error;
+
+    /* every check order is terminated, so none can run past the end */
+    if (n > 0 && dres->dependencies[n - 1] != DRES_ID_NONE) {
+        DRES_ERROR("%s: unterminated check orders.", __FUNCTION__);
+        return EINVAL;
+    }
+
+    /* check orders consist of targets only */
+    for (i = 0; i < n; i++) {
+        id = dres->dependencies[i];
+        if (id != DRES_ID_NONE && (DRES_ID_TYPE(id) != DRES_TYPE_TARGET ||
+                                   DRES_INDEX(id) >= dres->ntarget)) {
+            DRES_ERROR("%s: invalid target 0x%x in check orders.",
+                       __FUNCTION__, id);
+            return EINVAL;
+        }
+    }
+
+    dres->nreduced = n = dres_buf_rs32(buf);
+    dres->reduced  = dres_buf_alloc(buf, INT_ARR_SIZE(n));
+    
+    if (dres->reduced == NULL && n > 0)
+        return ENOMEM;
+
+    for (i = 0; i < n; i++)
+        dres->reduced[i] = dres_buf_rs32(buf);
+
     for (i = 0, t = dres->targets; i < dres->ntarget; i++, t++) {
         t->id   = dres_buf_rs32(buf);
         t->name = dres_buf_rstr(buf);
@@ -349,7 +487,7 @@ dres_load_targets(dres_t *dres, dres_buf_t *buf)
                 return ENOMEM;
             
             t->prereqs->nid = n;
-            t->prereqs->ids = dres_buf_alloc(buf, n * sizeof(*t->prereqs->ids));
+            t->prereqs->ids = dres_buf_alloc(buf, INT_ARR_SIZE(n));
 
             if (t->prereqs->ids == NULL)
                 return ENOMEM;
@@ -378,34 +516,75 @@ dres_load_targets(dres_t *dres, dres_buf_t *buf)
 
             t->code->ninstr = n;
             t->code->nsize  = dres_buf_rs32(buf);
-            
-#if 1 /* XXX TODO: this is broken wrt. endianness */
-            t->code->instrs = (uintptr_t *)dres_buf_rbuf(buf,t->code->nsize);
-#else /* XXX TODO: this is also broken wrt. endianness */
+            t->code->nleft  = 0;
+            t->code->cleft  = 0;
+
+            if (t->code->nsize < 0 || t->code->nsize % sizeof(vm_instr_t))
+                return EINVAL;
+
+            nword = t->code->nsize / sizeof(vm_instr_t);
             t->code->instrs =
-                dres_buf_alloc(buf, t->code->ninstr * sizeof(*t->code->instrs));
+                dres_buf_alloc(buf, DRES_ALIGN_TO(t->code->nsize,
+                                                  DRES_ALIGNMENT));
             
             if (t->code->instrs == NULL)
                 return ENOMEM;
             
-            for (j = 0; j < t->code->ninstr; j++)
+            for (j = 0; j < nword; j++)
                 t->code->instrs[j] = dres_buf_ru32(buf);
-#endif
+
+            if ((t->code->nconst = dres_buf_rs32(buf)) < 0)
+                return EINVAL;
+
+            t->code->consts = dres_buf_rbuf(buf, t->code->nconst);
+
+            if (buf->error)
+                return buf->error;
+
+            switch ((status = vm_chunk_verify(t->code))) {
+            case 0:
+            case EOPNOTSUPP:                   /* runs with runtime checks */
+                break;
+            default:
+                DRES_ERROR("%s: invalid VM code for target '%s'.",
+                           __FUNCTION__, t->name);
+                return status;
+            }
+
+            /* resolve field names, freed by dres_unload_targets */
+            t->code->quarks = NULL;
+            t->code->nquark = 0;
+            if ((status = vm_chunk_resolve(t->code)) != 0)
+                return status;
         }
         
         n = dres_buf_rs32(buf);
 
-        if (n <= 0)
+        if (n < 0)
             t->dependencies = NULL;
         else {
-            t->dependencies = dres_buf_alloc(buf, n * sizeof(*t->dependencies));
-            
-            if (t->dependencies == NULL)
-                return ENOMEM;
-                                             
-            for (j = 0; j < n - 1; j++)
-                t->dependencies[j] = dres_buf_rs32(buf);
-            t->dependencies[j] = DRES_ID_NONE;
+            if (n >= dres->ndependency) {
+                DRES_ERROR("%s: invalid check order for target '%s'.",
+                           __FUNCTION__, t->name);
+                return EINVAL;
+            }
+            t->dependencies = dres->dependencies + n;
+        }
+
+        n = dres_buf_rs32(buf);
+
+        if (n < 0)
+            t->reduced = NULL;
+        else {
+            t->reduced  = dres->reduced + n;
+            t->nreduced = dres_buf_rs32(buf);
+
+            if (n > dres->nreduced || t->nreduced < 0 ||
+                t->nreduced > dres->nreduced - n) {
+                DRES_ERROR("%s: invalid reduced checks for target '%s'.",
+                           __FUNCTION__, t->name);
+                return EINVAL;
+            }
         }
     }
 
@@ -34,6 +34,10 @@ USA.
 #include <dres/compiler.h>
 #include "dres-debug.h"
 
+static uint64_t qualified_digest(dres_t *dres, dres_variable_t *var);
+static int      check_qualified(dres_t *dres);
+static int      select_matches(OhmFact *fact, dres_select_t *selector);
+
 
 /********************
  * dres_store_init
@@ -123,6 +127,11 @@ dres_store_track(dres_t *dres)
 
         if (!DRES_TST_FLAG(var, VAR_PREREQ))
             continue;
+
+        if (DRES_TST_FLAG(var, VAR_QUALIFIED)) {
+            var->digest = qualified_digest(dres, var);
+            continue;
+        }
         
         if ((pattern = ohm_pattern_new(name)) == NULL)
             return ENOMEM;
@@ -189,18 +198,162 @@ dres_store_check(dres_t *dres)
             }
             
             var = dres->factvars + idx;
-            dres_update_var_stamp(dres, var);
+            DRES_SET_FLAG(var, VAR_CHANGED);
             
             updated = TRUE;
         }
 
         ohm_view_reset_changes(store->view);
+
+        check_qualified(dres);
+
+        for (idx = 0, var = dres->factvars; idx < dres->nfactvar; idx++, var++) {
+            if (DRES_TST_FLAG(var, VAR_CHANGED)) {
+                DRES_CLR_FLAG(var, VAR_CHANGED);
+                dres_update_var_stamp(dres, var);
+            }
+        }
     }
     
     return updated;
 }
 
 
+/********************
+ * check_qualified
+ ********************/
+static int
+check_qualified(dres_t *dres)
+{
+    dres_variable_t *var, *base;
+    uint64_t         digest;
+    int              i, id, nchanged;
+    char             name[128];
+
+    /*
+     * Notes:
+     *
+     *   The view only tells us which facts have changed, not which of
+     *   them or which of their fields. So for every qualified variable
+     *   of a changed fact we compare a digest of the selected facts (or
+     *   of the qualifying field of them) with the one we took the last
+     *   time around.
+     */
+    
+    nchanged = 0;
+    for (i = 0, var = dres->factvars; i < dres->nfactvar; i++, var++) {
+        if (!DRES_TST_FLAG(var, VAR_QUALIFIED))
+            continue;
+        
+        id = GPOINTER_TO_INT(g_hash_table_lookup(dres->store.ht, var->name));
+
+        if (!id)
+            continue;
+
+        base = dres->factvars + DRES_INDEX(id);
+        
+        if (!DRES_TST_FLAG(base, VAR_CHANGED))
+            continue;
+
+        digest = qualified_digest(dres, var);
+
+        DEBUG(DBG_VAR, "%s %s",  dres_name(dres, var->id, name, sizeof(name)),
+              digest != var->digest ? "changed" : "unchanged");
+        
+        if (digest != var->digest) {
+            var->digest = digest;
+            DRES_SET_FLAG(var, VAR_CHANGED);
+            nchanged++;
+        }
+    }
+    
+    return nchanged;
+}
+
+
+/********************
+ * qualified_digest
+ ********************/
+static uint64_t
+qualified_digest(dres_t *dres, dres_variable_t *var)
+{
+    OhmFact  *fact;
+    GSList   *l;
+    GValue   *value;
+    uint64_t  digest;
+
+    /*
+     * Notes:
+     *   The hashes of the selected facts (or fields) are summed, so the
+     *   digest does not depend on the order the store lists them in. Each
+     *   hash is mixed with the identity of its fact first, or swapping
+     *   values between two facts would leave the sum unchanged.
+     */
+    
+    digest = 0;
+    for (l = ohm_fact_store_get_facts_by_name(dres->store.fs, var->name);
+         l != NULL;
+         l = g_slist_next(l)) {
+        fact = (OhmFact *)l->data;
+
+        if (!select_matches(fact, var->selector))
+            continue;
+
+        if (var->field != NULL) {
+            value   = ohm_fact_get(fact, var->field);
+            digest += vm_hash_mix((uint64_t)(uintptr_t)fact ^
+                                  vm_value_hash(value));
+        }
+        else
+            digest += vm_hash_mix((uint64_t)(uintptr_t)fact ^
+                                  vm_fact_hash(fact));
+    }
+    
+    return digest;
+}
+
+
+/********************
+ * select_matches
+ ********************/
+static int
+select_matches(OhmFact *fact, dres_select_t *selector)
+{
+    dres_select_t *s;
+    GValue        *value;
+    vm_value_t     v;
+    int            typed, match;
+
+    for (s = selector; s != NULL; s = s->next) {
+        if ((value = ohm_fact_get(fact, s->field.name)) == NULL)
+            match = FALSE;
+        else {
+            typed = TRUE;
+            switch (s->field.value.type) {
+            case DRES_TYPE_INTEGER: v.i = s->field.value.v.i; break;
+            case DRES_TYPE_DOUBLE:  v.d = s->field.value.v.d; break;
+            case DRES_TYPE_STRING:  v.s = s->field.value.v.s; break;
+            default:                typed = FALSE;  /* $name[field]: present */
+            }
+
+            /* compare like the VM does, values of other types never match */
+            if (typed)
+                match = vm_value_match(value, s->field.value.type, &v) > 0;
+            else
+                match = TRUE;
+        }
+
+        if (s->op == DRES_OP_NEQ)
+            match = !match;
+
+        if (!match)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
 int
 dres_store_tx_new(dres_t *dres)
 {
@@ -241,12 +394,15 @@ dres_store_tx_rollback(dres_t *dres)
     DRES_CLR_FLAG(dres, TRANSACTION_ACTIVE);
 
     for (i = 0, t = dres->targets; i < dres->ntarget; i++, t++)
-        if (t->txid == dres->txid)
-            t->stamp = t->txstamp;
+        if (t->txid == dres->txid) {
+            DRES_STAMP(dres, t->id) = t->txstamp;
+            dres_set_dirty(dres, t);
+            DRES_CLR_FLAG(t, TARGET_DIGEST);
+        }
 
     for (i = 0, var = dres->dresvars; i < dres->ndresvar; i++, var++)
         if (var->txid == dres->txid)
-            var->stamp = var->txstamp;
+            DRES_STAMP(dres, var->id) = var->txstamp;
 
     DEBUG(DBG_VAR, "rolled back transaction");
     
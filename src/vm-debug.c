@@ -38,20 +38,36 @@ USA.
     } while (0)
 
 
-int vm_dump_push   (uintptr_t **pc, char *buf, size_t size, int indent);
-int vm_dump_pop    (uintptr_t **pc, char *buf, size_t size, int indent);
-int vm_dump_filter (uintptr_t **pc, char *buf, size_t size, int indent);
-int vm_dump_update (uintptr_t **pc, char *buf, size_t size, int indent);
-int vm_dump_set    (uintptr_t **pc, char *buf, size_t size, int indent);
-int vm_dump_get    (uintptr_t **pc, char *buf, size_t size, int indent);
-int vm_dump_create (uintptr_t **pc, char *buf, size_t size, int indent);
-int vm_dump_call   (uintptr_t **pc, char *buf, size_t size, int indent);
-int vm_dump_cmp    (uintptr_t **pc, char *buf, size_t size, int indent);
-int vm_dump_branch (uintptr_t **pc, char *buf, size_t size, int indent);
-int vm_dump_debug  (uintptr_t **pc, char *buf, size_t size, int indent);
-int vm_dump_halt   (uintptr_t **pc, char *buf, size_t size, int indent);
-int vm_dump_invalid(uintptr_t **pc, char *buf, size_t size, int indent);
-int vm_dump_replace(uintptr_t **pc, char *buf, size_t size, int indent);
+int vm_dump_push   (vm_chunk_t *c, vm_instr_t **pc,
+                    char *buf, size_t size, int indent);
+int vm_dump_pop    (vm_chunk_t *c, vm_instr_t **pc,
+                    char *buf, size_t size, int indent);
+int vm_dump_filter (vm_chunk_t *c, vm_instr_t **pc,
+                    char *buf, size_t size, int indent);
+int vm_dump_update (vm_chunk_t *c, vm_instr_t **pc,
+                    char *buf, size_t size, int indent);
+int vm_dump_set    (vm_chunk_t *c, vm_instr_t **pc,
+                    char *buf, size_t size, int indent);
+int vm_dump_get    (vm_chunk_t *c, vm_instr_t **pc,
+                    char *buf, size_t size, int indent);
+int vm_dump_create (vm_chunk_t *c, vm_instr_t **pc,
+                    char *buf, size_t size, int indent);
+int vm_dump_call   (vm_chunk_t *c, vm_instr_t **pc,
+                    char *buf, size_t size, int indent);
+int vm_dump_cmp    (vm_chunk_t *c, vm_instr_t **pc,
+                    char *buf, size_t size, int indent);
+int vm_dump_branch (vm_chunk_t *c, vm_instr_t **pc,
+                    char *buf, size_t size, int indent);
+int vm_dump_debug  (vm_chunk_t *c, vm_instr_t **pc,
+                    char *buf, size_t size, int indent);
+int vm_dump_halt   (vm_chunk_t *c, vm_instr_t **pc,
+                    char *buf, size_t size, int indent);
+int vm_dump_invalid(vm_chunk_t *c, vm_instr_t **pc,
+                    char *buf, size_t size, int indent);
+int vm_dump_replace(vm_chunk_t *c, vm_instr_t **pc,
+                    char *buf, size_t size, int indent);
+int vm_dump_select (vm_chunk_t *c, vm_instr_t **pc,
+                    char *buf, size_t size, int indent);
 
 /********************
  * vm_dump_chunk
@@ -59,7 +75,7 @@ int vm_dump_replace(uintptr_t **pc, char *buf, size_t size, int indent);
 int
 vm_dump_chunk(vm_state_t *vm, char *buf, size_t size, int indent)
 {
-    uintptr_t    *pc;
+    vm_instr_t   *pc;
     int           total, n;
 
     if (vm->ninstr <= 0)
@@ -68,7 +84,7 @@ vm_dump_chunk(vm_state_t *vm, char *buf, size_t size, int indent)
     total = n = 0;
     pc    = vm->pc;
     while (pc) {
-        n = vm_dump_instr(&pc, buf, size, indent);
+        n = vm_dump_instr(vm->chunk, &pc, buf, size, indent);
 
         if (n > 0) {
             total += n;
@@ -90,25 +106,27 @@ vm_dump_chunk(vm_state_t *vm, char *buf, size_t size, int indent)
  * vm_dump_instr
  ********************/
 int
-vm_dump_instr(uintptr_t **pc, char *buf, size_t size, int indent)
+vm_dump_instr(vm_chunk_t *c, vm_instr_t **pc,
+              char *buf, size_t size, int indent)
 {
     int n;
     
     switch ((vm_opcode_t)VM_OP_CODE(**pc)) {
-    case VM_OP_PUSH:    n = vm_dump_push(pc, buf, size, indent);    break;
-    case VM_OP_POP:     n = vm_dump_pop(pc, buf, size, indent);     break;
-    case VM_OP_FILTER:  n = vm_dump_filter(pc, buf, size, indent);  break;
-    case VM_OP_UPDATE:  n = vm_dump_update(pc, buf, size, indent);  break;
-    case VM_OP_SET:     n = vm_dump_set(pc, buf, size, indent);     break;
-    case VM_OP_GET:     n = vm_dump_get(pc, buf, size, indent);     break;
-    case VM_OP_CREATE:  n = vm_dump_create(pc, buf, size, indent);  break;
-    case VM_OP_CALL:    n = vm_dump_call(pc, buf, size, indent);    break;
-    case VM_OP_CMP:     n = vm_dump_cmp(pc, buf, size, indent);     break;
-    case VM_OP_BRANCH:  n = vm_dump_branch(pc, buf, size, indent);  break;
-    case VM_OP_DEBUG:   n = vm_dump_debug(pc, buf, size, indent);   break;
-    case VM_OP_HALT:    n = vm_dump_halt(pc, buf, size, indent);    break;
-    case VM_OP_REPLACE: n = vm_dump_replace(pc, buf, size, indent);  break;
-    default:            n = vm_dump_invalid(pc, buf, size, indent); *pc = 0x0;
+    case VM_OP_PUSH:    n = vm_dump_push(c, pc, buf, size, indent);    break;
+    case VM_OP_POP:     n = vm_dump_pop(c, pc, buf, size, indent);     break;
+    case VM_OP_FILTER:  n = vm_dump_filter(c, pc, buf, size, indent);  break;
+    case VM_OP_UPDATE:  n = vm_dump_update(c, pc, buf, size, indent);  break;
+    case VM_OP_SET:     n = vm_dump_set(c, pc, buf, size, indent);     break;
+    case VM_OP_GET:     n = vm_dump_get(c, pc, buf, size, indent);     break;
+    case VM_OP_CREATE:  n = vm_dump_create(c, pc, buf, size, indent);  break;
+    case VM_OP_CALL:    n = vm_dump_call(c, pc, buf, size, indent);    break;
+    case VM_OP_CMP:     n = vm_dump_cmp(c, pc, buf, size, indent);     break;
+    case VM_OP_BRANCH:  n = vm_dump_branch(c, pc, buf, size, indent);  break;
+    case VM_OP_DEBUG:   n = vm_dump_debug(c, pc, buf, size, indent);   break;
+    case VM_OP_HALT:    n = vm_dump_halt(c, pc, buf, size, indent);    break;
+    case VM_OP_REPLACE: n = vm_dump_replace(c, pc, buf, size, indent);  break;
+    case VM_OP_SELECT:  n = vm_dump_select(c, pc, buf, size, indent);  break;
+    default:            n = vm_dump_invalid(c, pc, buf, size, indent); *pc = 0x0;
     }
         
     return n;
@@ -119,47 +137,47 @@ vm_dump_instr(uintptr_t **pc, char *buf, size_t size, int indent)
  * vm_dump_push
  ********************/
 int
-vm_dump_push(uintptr_t **pc, char *buf, size_t size, int indent)
+vm_dump_push(vm_chunk_t *c, vm_instr_t **pc,
+             char *buf, size_t size, int indent)
 {
     uintptr_t     type = VM_PUSH_TYPE(**pc);
     uintptr_t     data = VM_PUSH_DATA(**pc);
-    int           n, nsize;
+    int           n;
 
     INDENT(indent);
     
     switch (type) {
     case VM_TYPE_INTEGER:
-        n += snprintf(buf, size, "push %lld\n",
-                     data ? data - 1 : (long long int)*(*pc + 1));
-        nsize = data ? 1 : 2;
+        n += snprintf(buf, size, "push %d\n",
+                      VM_PUSH_IS_CONST(**pc) ?
+                      vm_const_int(c, data) : (int)data - 1);
         break;
 
     case VM_TYPE_DOUBLE:
-        n += snprintf(buf, size, "push %f\n", *(double *)(*pc + 1));
-        nsize = 1 + VM_ALIGN_TO_INSTR(sizeof(double));
+        n += snprintf(buf, size, "push %f\n", vm_const_double(c, data));
         break;
 
     case VM_TYPE_STRING:
-        n += snprintf(buf, size, "push '%s'\n", (const char *)(*pc + 1));
-        nsize = 1 + VM_ALIGN_TO_INSTR(data);
+        n += snprintf(buf, size, "push '%s'\n", VM_CONST_STRING(c, data));
         break;
 
     case VM_TYPE_GLOBAL:
-        n += snprintf(buf, size, "push global %s\n", (char *)(*pc + 1));
-        nsize = 1 + VM_ALIGN_TO_INSTR(data);
+        n += snprintf(buf, size, "push global %s\n", VM_CONST_STRING(c, data));
+        break;
+
+    case VM_TYPE_FIELD:
+        n += snprintf(buf, size, "push field %s\n", VM_CONST_STRING(c, data));
         break;
 
     case VM_TYPE_LOCAL:
         n += snprintf(buf, size, "push locals %lld\n", (long long int)data);
-        nsize = 1;
         break;
         
     default:
         n += snprintf(buf, size, "<invalid push instruction 0x%" PRIxPTR ">\n", type);
-        nsize = 1;
     }
 
-    *pc += nsize;
+    (*pc)++;
     
     return n;
 }
@@ -169,11 +187,14 @@ vm_dump_push(uintptr_t **pc, char *buf, size_t size, int indent)
  * vm_dump_pop
  ********************/
 int
-vm_dump_pop(uintptr_t **pc, char *buf, size_t size, int indent)
+vm_dump_pop(vm_chunk_t *c, vm_instr_t **pc,
+            char *buf, size_t size, int indent)
 {
     uintptr_t type = VM_OP_ARGS(**pc);
     int n;
 
+    (void)c;
+
     INDENT(indent);
         
     switch (type) {
@@ -199,11 +220,14 @@ vm_dump_pop(uintptr_t **pc, char *buf, size_t size, int indent)
  * vm_dump_filter
  ********************/
 int
-vm_dump_filter(uintptr_t **pc, char *buf, size_t size, int indent)
+vm_dump_filter(vm_chunk_t *c, vm_instr_t **pc,
+               char *buf, size_t size, int indent)
 {
     uintptr_t nfield = VM_FILTER_NFIELD(**pc);
     int n;
 
+    (void)c;
+
     INDENT(indent);
 
     n += snprintf(buf, size, "filter %llu\n", (long long unsigned int)nfield);
@@ -218,11 +242,14 @@ vm_dump_filter(uintptr_t **pc, char *buf, size_t size, int indent)
  * vm_dump_update
  ********************/
 int
-vm_dump_update(uintptr_t **pc, char *buf, size_t size, int indent)
+vm_dump_update(vm_chunk_t *c, vm_instr_t **pc,
+               char *buf, size_t size, int indent)
 {
     uintptr_t nfield = VM_UPDATE_NFIELD(**pc);
     int n;
 
+    (void)c;
+
     INDENT(indent);
 
     n += snprintf(buf, size, "update %llu\n", (long long unsigned int)nfield);
@@ -237,11 +264,14 @@ vm_dump_update(uintptr_t **pc, char *buf, size_t size, int indent)
  * vm_dump_replace
  ********************/
 int
-vm_dump_replace(uintptr_t **pc, char *buf, size_t size, int indent)
+vm_dump_replace(vm_chunk_t *c, vm_instr_t **pc,
+                char *buf, size_t size, int indent)
 {
     uintptr_t nfield = VM_REPLACE_NFIELD(**pc);
     int n;
 
+    (void)c;
+
     INDENT(indent);
 
     n += snprintf(buf, size, "replace %llu\n", (long long unsigned int)nfield);
@@ -252,14 +282,49 @@ vm_dump_replace(uintptr_t **pc, char *buf, size_t size, int indent)
 }
 
 
+/********************
+ * vm_dump_select
+ ********************/
+int
+vm_dump_select(vm_chunk_t *c, vm_instr_t **pc,
+               char *buf, size_t size, int indent)
+{
+    uintptr_t nfield = VM_SELECT_NFIELD(**pc);
+    int       n, len, total, i;
+
+    INDENT(indent);
+    len    = snprintf(buf, size, "select %llu\n", (long long unsigned int)nfield);
+    total  = n + len;
+    buf   += len;
+    size  -= len;
+    
+    (*pc)++;
+
+    /* dump the inlined operands indented */
+    for (i = 0; i < 1 + 3 * (int)nfield; i++) {
+        if ((n = vm_dump_instr(c, pc, buf, size, indent + 4)) <= 0)
+            return n;
+        
+        total += n;
+        buf   += n;
+        size  -= n;
+    }
+    
+    return total;
+}
+
+
 /********************
  * vm_dump_set
  ********************/
 int
-vm_dump_set(uintptr_t **pc, char *buf, size_t size, int indent)
+vm_dump_set(vm_chunk_t *c, vm_instr_t **pc,
+            char *buf, size_t size, int indent)
 {
     int n;
 
+    (void)c;
+
     INDENT(indent);
 
     if (VM_OP_ARGS(**pc) == VM_SET_FIELD)
@@ -277,11 +342,14 @@ vm_dump_set(uintptr_t **pc, char *buf, size_t size, int indent)
  * vm_dump_get
  ********************/
 int
-vm_dump_get(uintptr_t **pc, char *buf, size_t size, int indent)
+vm_dump_get(vm_chunk_t *c, vm_instr_t **pc,
+            char *buf, size_t size, int indent)
 {
     uintptr_t type = VM_OP_ARGS(**pc);
     int       n;
 
+    (void)c;
+
     INDENT(indent);
     
     if (type & VM_GET_FIELD)
@@ -301,11 +369,14 @@ vm_dump_get(uintptr_t **pc, char *buf, size_t size, int indent)
  * vm_dump_create
  ********************/
 int
-vm_dump_create(uintptr_t **pc, char *buf, size_t size, int indent)
+vm_dump_create(vm_chunk_t *c, vm_instr_t **pc,
+               char *buf, size_t size, int indent)
 {
     uintptr_t nfield = VM_FILTER_NFIELD(**pc);
     int n;
 
+    (void)c;
+
     INDENT(indent);
     n += snprintf(buf, size, "create %llu\n", (long long unsigned int)nfield);
 
@@ -319,13 +390,24 @@ vm_dump_create(uintptr_t **pc, char *buf, size_t size, int indent)
  * vm_dump_call
  ********************/
 int
-vm_dump_call(uintptr_t **pc, char *buf, size_t size, int indent)
+vm_dump_call(vm_chunk_t *c, vm_instr_t **pc,
+             char *buf, size_t size, int indent)
 {
-    uintptr_t narg = VM_OP_ARGS(**pc);
+    uintptr_t narg  = VM_CALL_NARG(**pc);
+    uintptr_t flags = VM_CALL_FLAGS(**pc);
     int n;
 
+    (void)c;
+
     INDENT(indent);
-    n += snprintf(buf, size, "call %llu\n", (long long unsigned int)narg);
+    if (flags & VM_CALL_METHOD)
+        n += snprintf(buf, size, "call #%llu %llu%s\n",
+                      (long long unsigned int)VM_CALL_ID(**pc),
+                      (long long unsigned int)narg,
+                      flags & VM_CALL_DISCARD ? ", discard" : "");
+    else
+        n += snprintf(buf, size, "call %llu%s\n", (long long unsigned int)narg,
+                      flags & VM_CALL_DISCARD ? ", discard" : "");
     
     (*pc)++;
     
@@ -337,12 +419,15 @@ vm_dump_call(uintptr_t **pc, char *buf, size_t size, int indent)
  * vm_dump_cmp
  ********************/
 int
-vm_dump_cmp(uintptr_t **pc, char *buf, size_t size, int indent)
+vm_dump_cmp(vm_chunk_t *c, vm_instr_t **pc,
+            char *buf, size_t size, int indent)
 {
     vm_relop_t  op = VM_OP_ARGS(**pc);
     char       *opstr;
     int         n;
 
+    (void)c;
+
     switch (op) {
     case VM_RELOP_EQ:  opstr = "=="; break;
     case VM_RELOP_NE:  opstr = "!="; break;
@@ -367,12 +452,15 @@ vm_dump_cmp(uintptr_t **pc, char *buf, size_t size, int indent)
  * vm_dump_branch
  ********************/
 int
-vm_dump_branch(uintptr_t **pc, char *buf, size_t size, int indent)
+vm_dump_branch(vm_chunk_t *c, vm_instr_t **pc,
+               char *buf, size_t size, int indent)
 {
     uintptr_t brtype, brdiff;
     int       n;
     char     *type;
     
+    (void)c;
+
     brtype = VM_BRANCH_TYPE(**pc);
     brdiff = VM_BRANCH_DIFF(**pc);
 
@@ -396,17 +484,16 @@ vm_dump_branch(uintptr_t **pc, char *buf, size_t size, int indent)
  * vm_dump_debug
  ********************/
 int
-vm_dump_debug(uintptr_t **pc, char *buf, size_t size, int indent)
+vm_dump_debug(vm_chunk_t *c, vm_instr_t **pc,
+              char *buf, size_t size, int indent)
 {
-    const char *info  = (const char *)(*pc + 1);
-    int         len   = VM_DEBUG_LEN(**pc);
-    int         nsize = 1 + VM_ALIGN_TO_INSTR(len);
+    const char *info = VM_CONST_STRING(c, VM_DEBUG_IDX(**pc));
     int         n;
 
     INDENT(indent);
     n += snprintf(buf, size, "debug info \"%s\"\n", info);
     
-    *pc += nsize;
+    (*pc)++;
     
     return n;
 }
@@ -416,10 +503,13 @@ vm_dump_debug(uintptr_t **pc, char *buf, size_t size, int indent)
  * vm_dump_halt
  ********************/
 int
-vm_dump_halt(uintptr_t **pc, char *buf, size_t size, int indent)
+vm_dump_halt(vm_chunk_t *c, vm_instr_t **pc,
+             char *buf, size_t size, int indent)
 {
     int n;
     
+    (void)c;
+
     INDENT(indent);
     n += snprintf(buf, size, "halt\n");
     
@@ -433,12 +523,15 @@ vm_dump_halt(uintptr_t **pc, char *buf, size_t size, int indent)
  * vm_dump_invalid
  ********************/
 int
-vm_dump_invalid(uintptr_t **pc, char *buf, size_t size, int indent)
+vm_dump_invalid(vm_chunk_t *c, vm_instr_t **pc,
+                char *buf, size_t size, int indent)
 {
     int n;
     
+    (void)c;
+
     INDENT(indent);
-    n += snprintf(buf, size, "invalid instruction 0x%" PRIxPTR "", **pc);
+    n += snprintf(buf, size, "invalid instruction 0x%" PRIx32 "", **pc);
 
     return n;
 }
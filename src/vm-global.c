@@ -29,20 +29,176 @@ USA.
 #include <dres/mm.h>
 #include <dres/vm.h>
 
-static inline int vm_field_matches(OhmFact *f, char *field, GValue *value);
+typedef struct global_hdr_s global_hdr_t;
+
+struct global_hdr_s {
+    vm_gpool_t   *pool;                       /* owner pool, if any */
+    global_hdr_t *next;                       /* next in free list */
+    int           class;                      /* size class */
+};
+
+#define GLOBAL_HDR(g) (((global_hdr_t *)(g)) - 1)
+#define GLOBAL_SIZE(nslot)                                              \
+    (sizeof(global_hdr_t) + sizeof(vm_global_t) + (nslot) * sizeof(OhmFact *))
+
+static vm_global_t *global_alloc(vm_state_t *vm, int nslot);
+
+
+typedef struct gindex_s gindex_t;
+
+struct gindex_s {
+    gindex_t      *next;                      /* next index of the entry */
+    GQuark         field;                     /* indexed field */
+    int            type;                      /* type of all values */
+    GHashTable    *heads;                     /* value -> first fact + 1 */
+    int           *chain;                     /* next fact + 1, by fact */
+};
+
+typedef struct gcolumn_s gcolumn_t;
+
+struct gcolumn_s {
+    gcolumn_t     *next;                      /* next column of the entry */
+    GQuark         field;                     /* mirrored field */
+    int            type;                      /* type of all values */
+    int            nuse;                      /* filters on the field */
+    int            built;                     /* whether values are set up */
+    union {
+        int       *i;                         /* VM_TYPE_INTEGER values */
+        double    *d;                         /* VM_TYPE_DOUBLE values */
+        int       *s;                         /* VM_TYPE_STRING value ids */
+    } values;
+    unsigned char *present;                   /* whether facts have field */
+    GHashTable    *strings;                   /* string -> id of values */
+    unsigned char *mask;                      /* last filter result */
+};
+
+typedef struct {
+    char          *name;                      /* fact name */
+    unsigned int   stamp;                     /* valid if vm->gstamp */
+    OhmFact      **facts;                     /* cached facts, referenced */
+    int            nfact;                     /* number of facts */
+    int            nalloc;                    /* size of facts */
+    gindex_t      *indexes;                   /* field indexes, if any */
+    gcolumn_t     *columns;                   /* field columns, if any */
+} gcache_entry_t;
+
+#define FACT_INSERTED "inserted"
+#define FACT_REMOVED  "removed"
+#define FACT_UPDATED  "updated"
+
+#define INDEX_MIN 8                           /* min. facts to index */
+#define JOIN_MIN  8                           /* min. facts to hash */
+
+#define COLUMN_MIN  8                         /* min. facts to mirror */
+#define COLUMN_USES 2                         /* filters before mirroring */
+
+#define BATCH_MIN   16                        /* initial size of batches */
+
+static gcache_entry_t *cache_lookup (vm_state_t *vm, char *name);
+static void            cache_release(gcache_entry_t *e);
+static void            cache_changed(gpointer store, gpointer fact,
+                                     gpointer data);
+static void            cache_updated(gpointer store, gpointer fact,
+                                     gpointer field, gpointer value,
+                                     gpointer data);
+static void            index_free   (gcache_entry_t *e);
+static void            column_free  (gcache_entry_t *e);
+static void            batch_sync   (vm_state_t *vm, const char *name);
+
+static inline int vm_field_matches(OhmFact *f, GQuark field, GValue *value);
 
 
 
+/*****************************************************************************
+ *                            *** global handling ***                        *
+ *****************************************************************************/
+
+/********************
+ * global_alloc
+ ********************/
+static vm_global_t *
+global_alloc(vm_state_t *vm, int nslot)
+{
+    vm_gpool_t   *pool = vm ? &vm->gpool : NULL;
+    global_hdr_t *h;
+    int           class;
+
+    /*
+     * Notes:
+     *   Every global is prefixed with a header telling vm_global_free
+     *   where (if anywhere) to recycle it. Globals from the pool of a
+     *   VM must not outlive the VM itself.
+     */
+
+    for (class = 0; class < VM_GPOOL_NCLASS && (1 << class) < nslot; class++)
+        ;
+    
+    if (pool == NULL || class >= VM_GPOOL_NCLASS) {
+        if ((h = (global_hdr_t *)ALLOC_ARR(char, GLOBAL_SIZE(nslot))) == NULL)
+            return NULL;
+        h->pool  = NULL;
+        h->class = -1;
+    }
+    else if ((h = pool->free[class]) != NULL) {
+        pool->free[class] = h->next;
+        pool->nfree[class]--;
+        memset(h + 1, 0, GLOBAL_SIZE(1 << class) - sizeof(*h));
+    }
+    else {
+        h = (global_hdr_t *)ALLOC_ARR(char, GLOBAL_SIZE(1 << class));
+        if (h == NULL)
+            return NULL;
+        h->pool  = pool;
+        h->class = class;
+    }
+    
+    h->next = NULL;
+    
+    return (vm_global_t *)(h + 1);
+}
+
+
 /********************
  * vm_global_lookup
  ********************/
 int
-vm_global_lookup(char *name, vm_global_t **gp)
+vm_global_lookup(vm_state_t *vm, char *name, vm_global_t **gp)
 {
-    vm_global_t  *g     = NULL;
-    OhmFactStore *store = ohm_fact_store_get_fact_store();
-    GSList       *l;
-    int           i, n;
+    vm_global_t    *g     = NULL;
+    OhmFactStore   *store = ohm_fact_store_get_fact_store();
+    gcache_entry_t *e;
+    GSList         *l;
+    int             i, n;
+    
+    /*
+     * Notes:
+     *   With a VM at hand the facts are looked up from the fact cache of
+     *   the VM. The global gets its own references to the facts, as the
+     *   instructions consuming it take over (and drop) those.
+     */
+
+    if (vm != NULL && (e = cache_lookup(vm, name)) != NULL) {
+        if (e->nfact == 0) {
+            *gp = NULL;
+            return ENOENT;
+        }
+        
+        if ((g = global_alloc(vm, e->nfact)) == NULL) {
+            *gp = NULL;
+            return ENOMEM;
+        }
+
+        memcpy(g->facts, e->facts, e->nfact * sizeof(e->facts[0]));
+        for (i = 0; i < e->nfact; i++)
+            g_object_ref(g->facts[i]);
+        g->nfact = e->nfact;
+        
+        *gp = g;
+        return 0;
+    }
+
+    if (vm != NULL)
+        batch_sync(vm, name);
     
     if ((l = ohm_fact_store_get_facts_by_name(store, name)) == NULL ||
         (n = g_slist_length(l)) == 0) {
@@ -50,7 +206,7 @@ vm_global_lookup(char *name, vm_global_t **gp)
         return ENOENT;
     }
     
-    if (ALLOC_VAROBJ(g, n, facts) == NULL) {
+    if ((g = global_alloc(vm, n)) == NULL) {
         *gp = NULL;
         return ENOMEM;
     }
@@ -71,16 +227,17 @@ vm_global_lookup(char *name, vm_global_t **gp)
  * vm_global_name
  ********************/
 vm_global_t *
-vm_global_name(char *name)
+vm_global_name(vm_state_t *vm, char *name)
 {
     vm_global_t *g;
-    int          size = sizeof(*g) + strlen(name) + 1;
+    int          len   = strlen(name) + 1;
+    int          nslot = (len + sizeof(OhmFact *) - 1) / sizeof(OhmFact *);
 
-    if ((g = (vm_global_t *)ALLOC_ARR(char, size)) == NULL)
+    if ((g = global_alloc(vm, nslot)) == NULL)
         return NULL;
     
     g->name = (char *)g->facts;
-    strcpy(g->name, name);
+    memcpy(g->name, name, len);
     
     return g;
 }
@@ -92,9 +249,19 @@ vm_global_name(char *name)
 EXPORTED vm_global_t *
 vm_global_alloc(int nfact)
 {
-    vm_global_t *g = NULL;
+    return vm_global_pool_alloc(NULL, nfact);
+}
+
+
+/********************
+ * vm_global_pool_alloc
+ ********************/
+EXPORTED vm_global_t *
+vm_global_pool_alloc(vm_state_t *vm, int nfact)
+{
+    vm_global_t *g;
     
-    if (ALLOC_VAROBJ(g, nfact, facts) == NULL)
+    if ((g = global_alloc(vm, nfact)) == NULL)
         return NULL;
     
     g->nfact = nfact;
@@ -102,13 +269,37 @@ vm_global_alloc(int nfact)
 }
 
 
+/********************
+ * vm_global_pool_reset
+ ********************/
+void
+vm_global_pool_reset(vm_state_t *vm, int keep)
+{
+    vm_gpool_t   *pool = &vm->gpool;
+    global_hdr_t *h;
+    int           i;
+
+    /* trim the free lists to at most keep globals per class */
+    for (i = 0; i < VM_GPOOL_NCLASS; i++) {
+        while (pool->nfree[i] > keep) {
+            h             = pool->free[i];
+            pool->free[i] = h->next;
+            pool->nfree[i]--;
+            FREE(h);
+        }
+    }
+}
+
+
 /********************
  * vm_global_free
  ********************/
 EXPORTED void
 vm_global_free(vm_global_t *g)
 {
-    int i, n;
+    global_hdr_t *h;
+    vm_gpool_t   *pool;
+    int           i, n;
     
     if (g == NULL)
         return;
@@ -120,7 +311,15 @@ vm_global_free(vm_global_t *g)
         }
     }
     
-    FREE(g);
+    h = GLOBAL_HDR(g);
+    
+    if ((pool = h->pool) != NULL) {
+        h->next = pool->free[h->class];
+        pool->free[h->class] = h;
+        pool->nfree[h->class]++;
+    }
+    else
+        FREE(h);
 }
 
 
@@ -150,319 +349,1165 @@ vm_global_print(FILE *fp, vm_global_t *g)
 
 
 /*****************************************************************************
- *                            *** fact handling ***                          *
+ *                              *** fact cache ***                           *
  *****************************************************************************/
 
-/********************
- * vm_fact_lookup
- ********************/
-GSList *
-vm_fact_lookup(char *name)
-{
-    return ohm_fact_store_get_facts_by_name(ohm_get_fact_store(), name);
-}
+/*
+ * Notes:
+ *
+ *   PUSH GLOBAL looks up all facts by the given name. To avoid asking
+ *   the fact store (and walking its lists) over and over again the VM
+ *   keeps a cache of the facts by name. A cached entry is invalidated
+ *   when
+ *
+ *     - the fact store signals the insertion or removal of a fact of the
+ *       same name,
+ *     - the VM itself inserts or removes such a fact (the store might
+ *       defer its signals until the end of a transaction),
+ *     - the VM calls a method (which can change the store in arbitrary
+ *       ways, again possibly within a transaction).
+ *
+ *   Finally all of the cache is released once the outermost vm_exec is
+ *   done, so we never hold on to facts (or trust the cache) between two
+ *   resolver runs.
+ */
 
 
 /********************
- * vm_fact_reset
+ * cache_lookup
  ********************/
-void
-vm_fact_reset(OhmFact *fact)
+static gcache_entry_t *
+cache_lookup(vm_state_t *vm, char *name)
 {
-    GSList     *l, *next;
-    const char *field;
+    OhmFactStore   *store;
+    gcache_entry_t *e;
+    GSList         *l;
+    int             n, i;
 
-    for (l = ohm_fact_get_fields(fact); l != NULL; l = next) {
-        next  = l->next;
-        field = g_quark_to_string(GPOINTER_TO_INT(l->data));
-        if (field != NULL)
-            ohm_fact_set(fact, field, NULL);             /* invalidates l */
-        else
-            fprintf(stderr, "*** NULL field name in fact\n");
+    batch_sync(vm, name);
+    
+    if (vm->gcache == NULL) {
+        vm->gcache = g_hash_table_new(g_str_hash, g_str_equal);
+        if (vm->gcache == NULL)
+            return NULL;
+        
+        store = ohm_fact_store_get_fact_store();
+        g_signal_connect(G_OBJECT(store), FACT_INSERTED,
+                         G_CALLBACK(cache_changed), vm);
+        g_signal_connect(G_OBJECT(store), FACT_REMOVED,
+                         G_CALLBACK(cache_changed), vm);
+        g_signal_connect(G_OBJECT(store), FACT_UPDATED,
+                         G_CALLBACK(cache_updated), vm);
+
+        vm->gstamp = 1;
+    }
+    
+    if ((e = g_hash_table_lookup(vm->gcache, name)) == NULL) {
+        if ((e = ALLOC(gcache_entry_t)) == NULL)
+            return NULL;
+        if ((e->name = STRDUP(name)) == NULL) {
+            FREE(e);
+            return NULL;
+        }
+        g_hash_table_insert(vm->gcache, e->name, e);
     }
-}
-
-
-/********************
- * vm_fact_dup
- ********************/
-OhmFact *
-vm_fact_dup(OhmFact *src, char *name)
-{
-    OhmFact *dst = ohm_fact_new(name);
-    GSList  *l   = (GSList *)ohm_fact_get_fields(src);
-    char    *field;
-    GValue  *value;
-    GQuark   q;
 
+    if (e->stamp == vm->gstamp)
+        return e;
     
-    if (dst == NULL)
-        return NULL;
+    cache_release(e);
     
-    for ( ; l != NULL; l = g_slist_next(l)){
-        q     = GPOINTER_TO_INT(l->data);
-        field = (char *)g_quark_to_string(q);
-        value = ohm_copy_value(ohm_fact_get(src, field));
-        ohm_fact_set(dst, field, value);
+    l = vm_fact_lookup(name);
+    n = g_slist_length(l);
+    
+    if (n > e->nalloc) {
+        if (REALLOC_ARR(e->facts, e->nalloc, n) == NULL)
+            return NULL;
+        e->nalloc = n;
+    }
+    
+    for (i = 0; i < n; i++, l = g_slist_next(l)) {
+        e->facts[i] = (OhmFact *)l->data;
+        g_object_ref(e->facts[i]);
     }
+    
+    e->nfact = n;
+    e->stamp = vm->gstamp;
 
-    return dst;
+    return e;
 }
 
 
 /********************
- * vm_fact_copy
+ * cache_release
  ********************/
-OhmFact *
-vm_fact_copy(OhmFact *dst, OhmFact *src)
+static void
+cache_release(gcache_entry_t *e)
 {
-    GSList *p, *n;
-    GQuark  q;
+    int i;
     
-    if (dst != src)
-        vm_fact_reset(dst);
-
-    p = (GSList *)ohm_fact_get_fields(src);
-    while (p != NULL) {
-        char   *field;
-        GValue *value;
-        
-        n = p->next;
-        
-        q     = GPOINTER_TO_INT(p->data);
-        field = (char *)g_quark_to_string(q);
-        value = ohm_copy_value(ohm_fact_get(src, field));
-        
-        if (value == NULL)
-            return NULL;
-        
-        ohm_fact_set(dst, field, value);
-        
-        p = n;
-    }
+    index_free(e);
+    column_free(e);
     
-    return dst;
+    for (i = 0; i < e->nfact; i++)
+        g_object_unref(e->facts[i]);
+    
+    e->nfact = 0;
+    e->stamp = 0;
 }
 
 
 /********************
- * vm_fact_update
+ * cache_changed
  ********************/
-OhmFact *
-vm_fact_update(OhmFact *dst, OhmFact *src)
+static void
+cache_changed(gpointer store, gpointer fact, gpointer data)
 {
-    GSList *l = (GSList *)ohm_fact_get_fields(src);
-    GQuark  q;
+    vm_state_t *vm = (vm_state_t *)data;
+    const char *name;
     
-    for ( ; l != NULL; l = g_slist_next(l)) {
-        char   *field;
-        GValue *value;
-        
-        q     = GPOINTER_TO_INT(l->data);
-        field = (char *)g_quark_to_string(q);
-        value = ohm_fact_get(src, field);
-
-        if (vm_field_matches(dst, field, value))
-            continue;
-        
-        if ((value = ohm_copy_value(value)) == NULL)
-            return NULL;
-        
-        ohm_fact_set(dst, field, value);
-    }
+    name = ohm_structure_get_name(OHM_STRUCTURE(fact));
+    vm_global_cache_invalidate(vm, name);
 
-    return dst;
+    (void)store;
 }
 
 
 /********************
- * vm_fact_remove
+ * cache_updated
  ********************/
-void
-vm_fact_remove(char *name)
+static void
+cache_updated(gpointer store, gpointer fact, gpointer field, gpointer value,
+              gpointer data)
 {
-    OhmFactStore *store = ohm_fact_store_get_fact_store();
-    OhmFact      *fact;
-    GSList       *l;
+    vm_state_t *vm = (vm_state_t *)data;
+    const char *name;
+    
+    name = ohm_structure_get_name(OHM_STRUCTURE(fact));
+    vm_global_index_invalidate(vm, name);
 
-    for (l = vm_fact_lookup(name); l != NULL; l = g_slist_next(l)) {
-        fact = (OhmFact *)l->data;
-        ohm_fact_store_remove(store, fact);
-        g_object_unref(fact);
-    }
+    (void)store;
+    (void)field;
+    (void)value;
 }
 
 
 /********************
- * vm_fact_remove_instance
+ * reset_entry
  ********************/
-void
-vm_fact_remove_instance(OhmFact *fact)
+static void
+reset_entry(gpointer key, gpointer value, gpointer data)
 {
-    OhmFactStore *store = ohm_fact_store_get_fact_store();
-    
-    ohm_fact_store_remove(store, fact);
-    g_object_unref(fact);
+    cache_release((gcache_entry_t *)value);
+
+    (void)key;
+    (void)data;
 }
 
 
 /********************
- * vm_fact_insert
+ * free_entry
  ********************/
-void
-vm_fact_insert(OhmFact *fact)
+static void
+free_entry(gpointer key, gpointer value, gpointer data)
 {
-    OhmFactStore *store = ohm_fact_store_get_fact_store();
+    gcache_entry_t *e = (gcache_entry_t *)value;
     
-    ohm_fact_store_insert(store, fact);
+    cache_release(e);
+    FREE(e->facts);
+    FREE(e->name);
+    FREE(e);
+    
+    (void)key;
+    (void)data;
 }
 
 
 /********************
- * vm_fact_set_field
+ * vm_global_cache_invalidate
  ********************/
-int
-vm_fact_set_field(vm_state_t *vm, OhmFact *fact, char *field,
-                  int type, vm_value_t *value)
+void
+vm_global_cache_invalidate(vm_state_t *vm, const char *name)
 {
-    GValue *gval;
+    gcache_entry_t *e;
     
-    switch (type) {
-    case VM_TYPE_INTEGER: gval = ohm_value_from_int(value->i);    break;
-    case VM_TYPE_DOUBLE:  gval = ohm_value_from_double(value->d); break;
-    case VM_TYPE_STRING:  gval = ohm_value_from_string(value->s); break;
-    default: VM_RAISE(vm, EINVAL,
-                      "invalid type 0x%x for field %s", type, field);
+    if (vm->gcache == NULL)
+        return;
+    
+    if (name == NULL) {                         /* invalidate everything */
+        if (++vm->gstamp == 0)
+            vm->gstamp = 1;
     }
-
-    if (vm_field_matches(fact, field, gval)) {
-        g_value_unset(gval);
-        g_free(gval);
-        return 1;
+    else {
+        if ((e = g_hash_table_lookup(vm->gcache, name)) != NULL)
+            cache_release(e);
     }
+}
 
-    ohm_fact_set(fact, field, gval);
-    return 1;
 
-    (void)vm;
+/********************
+ * vm_global_cache_reset
+ ********************/
+void
+vm_global_cache_reset(vm_state_t *vm)
+{
+    if (vm->gcache != NULL)
+        g_hash_table_foreach(vm->gcache, reset_entry, NULL);
 }
 
 
 /********************
- * vm_fact_match_field
+ * vm_global_cache_free
  ********************/
-int
-vm_fact_match_field(vm_state_t *vm, OhmFact *fact, char *field,
-                    GValue *gval, int type, vm_value_t *value)
+void
+vm_global_cache_free(vm_state_t *vm)
 {
-    int         i;
-    double      d;
-    const char *s;
-
-    switch (type) {
-    case VM_TYPE_INTEGER:
-        switch (G_VALUE_TYPE(gval)) {
-        case G_TYPE_INT:   i = g_value_get_int(gval);   break;
-        case G_TYPE_UINT:  i = g_value_get_uint(gval);  break;
-        case G_TYPE_LONG:  i = g_value_get_long(gval);  break;
-        case G_TYPE_ULONG: i = g_value_get_ulong(gval); break;
-        default: VM_RAISE(vm, EINVAL,
-                          "integer type expected for field %s", field);
-        }
-        return i == value->i;
+    OhmFactStore *store;
+    
+    if (vm->gcache == NULL)
+        return;
 
-    case VM_TYPE_DOUBLE:
-        switch (G_VALUE_TYPE(gval)) {
-        case G_TYPE_DOUBLE: d = g_value_get_double(gval);    break;
-        case G_TYPE_FLOAT:  d = 1.0*g_value_get_float(gval); break;
-        default: VM_RAISE(vm, EINVAL,
-                          "double type expected for field %s", field);
-        }
-        return d == value->d;
+    store = ohm_fact_store_get_fact_store();
+    g_signal_handlers_disconnect_by_func(G_OBJECT(store), cache_changed, vm);
+    g_signal_handlers_disconnect_by_func(G_OBJECT(store), cache_updated, vm);
+    
+    g_hash_table_foreach(vm->gcache, free_entry, NULL);
+    g_hash_table_destroy(vm->gcache);
+    vm->gcache = NULL;
+}
 
-    case VM_TYPE_STRING:
-        switch (G_VALUE_TYPE(gval)) {
-        case G_TYPE_STRING: s = g_value_get_string(gval); break;
-        default: VM_RAISE(vm, EINVAL,
-                          "string type expected for field %s", field);
-        }
-        return !strcmp(s, value->s);
 
-    default:
-        VM_RAISE(vm, EINVAL, "unexpected field type 0x%x for filter", type);
-    }
-    
-    return 0;
+/*****************************************************************************
+ *                            *** field indexes ***                          *
+ *****************************************************************************/
 
-    (void)vm;
-    (void)fact;
-}
+/*
+ * Notes:
+ *
+ *   Selecting facts by field value (eg. $stream[id: 5]) means checking
+ *   every fact of the given name. For cached entries with enough facts
+ *   we build a hash index on a field the first time it is selected on,
+ *   and use it to pick the matching facts directly. An index maps each
+ *   value to the first matching fact, the rest of the matching facts
+ *   are chained in fact order, so the result is the same as a scan.
+ *
+ *   Only integer and string fields are indexed, and only if all facts
+ *   having the field agree on its type. Otherwise a scan might raise a
+ *   type error which we need to preserve, so the index is marked
+ *   unusable and selects keep scanning.
+ *
+ *   Indexes are freed along with their cache entry, and whenever a fact
+ *   of the entry is updated: by the fact store signalling an update or
+ *   by the VM changing fields itself (as the store might defer its
+ *   signals until the end of a transaction). The same goes for the field
+ *   columns below.
+ */
 
 
 /********************
- * vm_fact_get_field
+ * index_type
  ********************/
-int
-vm_fact_get_field(vm_state_t *vm, OhmFact *fact, char *field, vm_value_t *value)
+static inline int
+index_type(GValue *gval)
 {
-    GValue *gval = ohm_fact_get(fact, field);
-
-    if (gval == NULL)
-        return VM_TYPE_UNKNOWN;
-
     switch (G_VALUE_TYPE(gval)) {
-    case G_TYPE_INT:   value->i = g_value_get_int(gval);   goto inttype;
-    case G_TYPE_UINT:  value->i = g_value_get_uint(gval);  goto inttype;
-    case G_TYPE_LONG:  value->i = g_value_get_long(gval);  goto inttype;
-    case G_TYPE_ULONG: value->i = g_value_get_ulong(gval);
-    inttype:
+    case G_TYPE_INT:
+    case G_TYPE_UINT:
+    case G_TYPE_LONG:
+    case G_TYPE_ULONG:
         return VM_TYPE_INTEGER;
-        
-    case G_TYPE_DOUBLE: value->d = g_value_get_double(gval); goto dbltype;
-    case G_TYPE_FLOAT:  value->d = 1.0*g_value_get_float(gval);
-    dbltype:
-        return VM_TYPE_DOUBLE;
-        
-    case G_TYPE_STRING: value->s = (char *)g_value_get_string(gval);
-        return VM_TYPE_STRING;
-
+    case G_TYPE_STRING:
+        return g_value_get_string(gval) ? VM_TYPE_STRING : VM_TYPE_UNKNOWN;
     default:
-        VM_RAISE(vm, EINVAL, "unexpected field type field %s", field);
+        return VM_TYPE_UNKNOWN;
     }
-    
-    return VM_TYPE_UNKNOWN;
-    (void)vm;
 }
 
 
 /********************
- * vm_fact_collect_fields
+ * index_key
  ********************/
-int
-vm_fact_collect_fields(OhmFact *f, char **fields, int nfield, GValue **values)
+static inline gpointer
+index_key(GValue *gval)
 {
     int i;
     
-    for (i = 0; i < nfield; i++)
-        if ((values[i] = ohm_fact_get(f, fields[i])) == NULL)
-            return -i;
-    
-    return 0;
+    switch (G_VALUE_TYPE(gval)) {
+    case G_TYPE_INT:   i = g_value_get_int(gval);   break;
+    case G_TYPE_UINT:  i = g_value_get_uint(gval);  break;
+    case G_TYPE_LONG:  i = g_value_get_long(gval);  break;
+    case G_TYPE_ULONG: i = g_value_get_ulong(gval); break;
+    default:
+        return (gpointer)g_value_get_string(gval);
+    }
+
+    return GINT_TO_POINTER(i);
 }
 
 
 /********************
- * vm_field_matches
+ * index_build
  ********************/
-static inline int
-vm_field_matches(OhmFact *f, char *field, GValue *value)
+static gindex_t *
+index_build(gcache_entry_t *e, GQuark field)
 {
-#define GV(v, t) g_value_get_##t(v)
-#define CMP(s, d, t) (GV(s, t) == GV(d, t))
-    
-    GValue *v;
+    gindex_t *x;
+    GValue   *gval;
+    gpointer  key;
+    int       i, type;
+
+    if ((x = ALLOC(gindex_t)) == NULL)
+        return NULL;
+
+    x->field = field;
+    x->type  = VM_TYPE_UNKNOWN;
+    
+    /* check that all values are of the same indexable type */
+    for (i = 0; i < e->nfact; i++) {
+        if ((gval = ohm_structure_qget(OHM_STRUCTURE(e->facts[i]),
+                                       field)) == NULL)
+            continue;
+        
+        type = index_type(gval);
+        if (type == VM_TYPE_UNKNOWN ||
+            (x->type != VM_TYPE_UNKNOWN && x->type != type)) {
+            x->type = VM_TYPE_UNKNOWN;
+            return x;                             /* unusable */
+        }
+        x->type = type;
+    }
+
+    if (x->type == VM_TYPE_UNKNOWN)
+        return x;
+    
+    if (x->type == VM_TYPE_STRING)
+        x->heads = g_hash_table_new(g_str_hash, g_str_equal);
+    else
+        x->heads = g_hash_table_new(g_direct_hash, g_direct_equal);
+    x->chain = ALLOC_ARR(int, e->nfact);
+    
+    if (x->heads == NULL || x->chain == NULL) {
+        if (x->heads != NULL)
+            g_hash_table_destroy(x->heads);
+        FREE(x->chain);
+        FREE(x);
+        return NULL;
+    }
+    
+    /* chain facts backwards, so lookups find them in fact order */
+    for (i = e->nfact - 1; i >= 0; i--) {
+        if ((gval = ohm_structure_qget(OHM_STRUCTURE(e->facts[i]),
+                                       field)) == NULL)
+            continue;
+
+        key         = index_key(gval);
+        x->chain[i] = GPOINTER_TO_INT(g_hash_table_lookup(x->heads, key));
+        g_hash_table_insert(x->heads, key, GINT_TO_POINTER(i + 1));
+    }
+    
+    return x;
+}
+
+
+/********************
+ * index_free
+ ********************/
+static void
+index_free(gcache_entry_t *e)
+{
+    gindex_t *x, *next;
+
+    for (x = e->indexes; x != NULL; x = next) {
+        next = x->next;
+        if (x->heads != NULL)
+            g_hash_table_destroy(x->heads);
+        FREE(x->chain);
+        FREE(x);
+    }
+
+    e->indexes = NULL;
+}
+
+
+/********************
+ * vm_global_index_invalidate
+ ********************/
+void
+vm_global_index_invalidate(vm_state_t *vm, const char *name)
+{
+    gcache_entry_t *e;
+    
+    if (vm->gcache != NULL && name != NULL &&
+        (e = g_hash_table_lookup(vm->gcache, name)) != NULL) {
+        index_free(e);
+        column_free(e);
+    }
+}
+
+
+/********************
+ * vm_global_select
+ ********************/
+int
+vm_global_select(vm_state_t *vm, char *name, GQuark field,
+                 int type, vm_value_t *value, vm_global_t **gp)
+{
+    gcache_entry_t *e;
+    gindex_t       *x;
+    vm_global_t    *g;
+    gpointer        key;
+    int             first, i, n;
+
+    /*
+     * Notes:
+     *   Looks up the facts of the given name with field equal to value,
+     *   or returns EOPNOTSUPP if this cannot be done with an index.
+     */
+
+    switch (type) {
+    case VM_TYPE_INTEGER: key = GINT_TO_POINTER(value->i); break;
+    case VM_TYPE_STRING:  key = value->s;                   break;
+    default:              return EOPNOTSUPP;
+    }
+    
+    if (key == NULL && type == VM_TYPE_STRING)
+        return EOPNOTSUPP;
+    
+    if ((e = cache_lookup(vm, name)) == NULL || e->nfact < INDEX_MIN)
+        return EOPNOTSUPP;
+
+    for (x = e->indexes; x != NULL && x->field != field; x = x->next)
+        ;
+    
+    if (x == NULL) {
+        if ((x = index_build(e, field)) == NULL)
+            return EOPNOTSUPP;
+        x->next    = e->indexes;
+        e->indexes = x;
+    }
+
+    if (x->type != type)
+        return EOPNOTSUPP;
+
+    first = GPOINTER_TO_INT(g_hash_table_lookup(x->heads, key));
+
+    for (n = 0, i = first; i != 0; i = x->chain[i - 1])
+        n++;
+
+    if ((g = global_alloc(vm, n)) == NULL)
+        return ENOMEM;
+
+    for (n = 0, i = first; i != 0; i = x->chain[i - 1]) {
+        g->facts[n] = e->facts[i - 1];
+        g_object_ref(g->facts[n]);
+        n++;
+    }
+    g->nfact = n;
+    
+    *gp = g;
+    return 0;
+}
+
+
+/*****************************************************************************
+ *                            *** field columns ***                          *
+ *****************************************************************************/
+
+/*
+ * Notes:
+ *
+ *   Filtering facts by field value checks every remaining fact with a
+ *   field lookup and a type switch. For fields that the rules filter on
+ *   repeatedly, we mirror the values of the cached facts into a typed
+ *   array, a column, and evaluate selectors over the whole column with
+ *   tight compare loops producing a match mask. These loops are written
+ *   to be vectorized by the compiler. Strings are stored as ids, which
+ *   are interned per column, so comparing them is an integer compare
+ *   too.
+ *
+ *   A column is built the COLUMN_USES-th time a field is filtered on,
+ *   for entries of at least COLUMN_MIN facts. As with indexes, it is
+ *   only usable if all facts having the field agree on its type and
+ *   the selector is of the same type. Otherwise filtering might raise
+ *   a type error, so we let the caller scan. Columns are indexed by the
+ *   position of facts in the cache entry, so they can only be used for
+ *   globals that are (what is left of) a copy of the cached facts.
+ */
+
+
+/********************
+ * column_type
+ ********************/
+static inline int
+column_type(GValue *gval)
+{
+    switch (G_VALUE_TYPE(gval)) {
+    case G_TYPE_DOUBLE:
+    case G_TYPE_FLOAT:
+        return VM_TYPE_DOUBLE;
+    default:
+        return index_type(gval);
+    }
+}
+
+
+/********************
+ * column_clear
+ ********************/
+static void
+column_clear(gcolumn_t *c)
+{
+    if (c->strings != NULL)
+        g_hash_table_destroy(c->strings);
+    FREE(c->values.i);
+    FREE(c->present);
+    FREE(c->mask);
+
+    c->strings  = NULL;
+    c->values.i = NULL;
+    c->present  = NULL;
+    c->mask     = NULL;
+    c->type     = VM_TYPE_UNKNOWN;
+}
+
+
+/********************
+ * column_build
+ ********************/
+static int
+column_build(gcache_entry_t *e, gcolumn_t *c)
+{
+    GValue     *gval;
+    const char *s;
+    int         n, i, type, id;
+
+    c->built = TRUE;
+    c->type  = VM_TYPE_UNKNOWN;
+    n        = e->nfact;
+    
+    /* check that all values are of the same type */
+    for (i = 0; i < n; i++) {
+        if ((gval = ohm_structure_qget(OHM_STRUCTURE(e->facts[i]),
+                                       c->field)) == NULL)
+            continue;
+
+        type = column_type(gval);
+        if (type == VM_TYPE_UNKNOWN ||
+            (c->type != VM_TYPE_UNKNOWN && c->type != type)) {
+            c->type = VM_TYPE_UNKNOWN;
+            return 0;                             /* unusable */
+        }
+        c->type = type;
+    }
+
+    switch (c->type) {
+    case VM_TYPE_INTEGER:
+        c->values.i = ALLOC_ARR(int, n);
+        break;
+    case VM_TYPE_DOUBLE:
+        c->values.d = ALLOC_ARR(double, n);
+        break;
+    case VM_TYPE_STRING:
+        c->values.s = ALLOC_ARR(int, n);
+        c->strings  = g_hash_table_new(g_str_hash, g_str_equal);
+        if (c->strings == NULL)
+            goto nomem;
+        break;
+    default:
+        return 0;
+    }
+    c->present = ALLOC_ARR(unsigned char, n);
+    c->mask    = ALLOC_ARR(unsigned char, n);
+
+    if (c->values.i == NULL || c->present == NULL || c->mask == NULL)
+        goto nomem;
+
+    for (i = 0; i < n; i++) {
+        if ((gval = ohm_structure_qget(OHM_STRUCTURE(e->facts[i]),
+                                       c->field)) == NULL)
+            continue;
+
+        c->present[i] = TRUE;
+        
+        switch (c->type) {
+        case VM_TYPE_INTEGER:
+            c->values.i[i] = GPOINTER_TO_INT(index_key(gval));
+            break;
+        case VM_TYPE_DOUBLE:
+            if (G_VALUE_TYPE(gval) == G_TYPE_DOUBLE)
+                c->values.d[i] = g_value_get_double(gval);
+            else
+                c->values.d[i] = 1.0 * g_value_get_float(gval);
+            break;
+        case VM_TYPE_STRING:
+            s  = g_value_get_string(gval);
+            id = GPOINTER_TO_INT(g_hash_table_lookup(c->strings, s));
+            if (id == 0) {
+                id = g_hash_table_size(c->strings) + 1;
+                g_hash_table_insert(c->strings, (gpointer)s,
+                                    GINT_TO_POINTER(id));
+            }
+            c->values.s[i] = id;
+            break;
+        }
+    }
+    
+    return 0;
+
+ nomem:
+    column_clear(c);
+    return ENOMEM;
+}
+
+
+/********************
+ * column_free
+ ********************/
+static void
+column_free(gcache_entry_t *e)
+{
+    gcolumn_t *c, *next;
+
+    for (c = e->columns; c != NULL; c = next) {
+        next = c->next;
+        column_clear(c);
+        FREE(c);
+    }
+
+    e->columns = NULL;
+}
+
+
+/********************
+ * column_match
+ ********************/
+static void
+column_match(gcolumn_t *c, int n, int type, vm_value_t *value)
+{
+    unsigned char *mask    = c->mask;
+    unsigned char *present = c->present;
+    int            i;
+
+    switch (type) {
+    case VM_TYPE_INTEGER: {
+        const int *v = c->values.i;
+        int        x = value->i;
+        
+        for (i = 0; i < n; i++)
+            mask[i] = present[i] & (v[i] == x);
+    }
+        break;
+        
+    case VM_TYPE_DOUBLE: {
+        const double *v = c->values.d;
+        double        x = value->d;
+        
+        for (i = 0; i < n; i++)
+            mask[i] = present[i] & (v[i] == x);
+    }
+        break;
+        
+    case VM_TYPE_STRING: {
+        const int *v = c->values.s;
+        int        x;
+        
+        /* a string not in the column matches nothing */
+        if ((x = GPOINTER_TO_INT(g_hash_table_lookup(c->strings,
+                                                     value->s))) == 0) {
+            memset(mask, 0, n);
+            break;
+        }
+        
+        for (i = 0; i < n; i++)
+            mask[i] = (v[i] == x);
+    }
+        break;
+    }
+}
+
+
+/********************
+ * vm_global_filter
+ ********************/
+int
+vm_global_filter(vm_state_t *vm, vm_global_t *g, GQuark field, int type,
+                 vm_value_t *value, int neq, int *nfactp)
+{
+    gcache_entry_t *e;
+    gcolumn_t      *c;
+    OhmFact        *fact;
+    const char     *name;
+    int             n, nfact, i;
+
+    /*
+     * Notes:
+     *   Filters the facts of g like FILTER would, or returns EOPNOTSUPP
+     *   if this cannot be done with a column. nfactp holds the number of
+     *   remaining facts in g, and is updated on success.
+     */
+
+    n = g->nfact;
+    
+    if (n < COLUMN_MIN || vm->gcache == NULL)
+        return EOPNOTSUPP;
+
+    switch (type) {
+    case VM_TYPE_INTEGER:
+    case VM_TYPE_DOUBLE:
+        break;
+    case VM_TYPE_STRING:
+        if (value->s == NULL)
+            return EOPNOTSUPP;
+        break;
+    default:
+        return EOPNOTSUPP;
+    }
+
+    for (i = 0; i < n && g->facts[i] == NULL; i++)
+        ;
+    if (i >= n)
+        return EOPNOTSUPP;
+    
+    name = ohm_structure_get_name(OHM_STRUCTURE(g->facts[i]));
+    
+    if ((e = g_hash_table_lookup(vm->gcache, name)) == NULL ||
+        e->stamp != vm->gstamp || e->nfact != n)
+        return EOPNOTSUPP;
+    
+    for (i = 0; i < n; i++)
+        if (g->facts[i] != NULL && g->facts[i] != e->facts[i])
+            return EOPNOTSUPP;
+    
+    for (c = e->columns; c != NULL && c->field != field; c = c->next)
+        ;
+    
+    if (c == NULL) {
+        if ((c = ALLOC(gcolumn_t)) == NULL)
+            return EOPNOTSUPP;
+        c->field   = field;
+        c->type    = VM_TYPE_UNKNOWN;
+        c->next    = e->columns;
+        e->columns = c;
+    }
+
+    if (!c->built) {
+        if (++c->nuse < COLUMN_USES)
+            return EOPNOTSUPP;
+        if (column_build(e, c) != 0)
+            return EOPNOTSUPP;
+    }
+    
+    if (c->type != type)
+        return EOPNOTSUPP;
+
+    column_match(c, n, type, value);
+
+    /* drop facts that match if neq, or that don't if not */
+    neq   = !!neq;
+    nfact = *nfactp;
+    for (i = 0; i < n; i++) {
+        if ((fact = g->facts[i]) == NULL || c->mask[i] != neq)
+            continue;
+        
+        g_object_unref(fact);
+        g->facts[i] = NULL;
+        nfact--;
+    }
+    
+    *nfactp = nfact;
+    return 0;
+}
+
+
+/*****************************************************************************
+ *                            *** fact handling ***                          *
+ *****************************************************************************/
+
+/********************
+ * vm_fact_lookup
+ ********************/
+GSList *
+vm_fact_lookup(char *name)
+{
+    return ohm_fact_store_get_facts_by_name(ohm_get_fact_store(), name);
+}
+
+
+/********************
+ * vm_fact_reset
+ ********************/
+void
+vm_fact_reset(OhmFact *fact)
+{
+    GSList *l, *next;
+    GQuark  field;
+
+    for (l = ohm_fact_get_fields(fact); l != NULL; l = next) {
+        next  = l->next;
+        field = GPOINTER_TO_INT(l->data);
+        if (field != 0)
+            ohm_structure_qset(OHM_STRUCTURE(fact), field,
+                               NULL);                    /* invalidates l */
+        else
+            fprintf(stderr, "*** NULL field name in fact\n");
+    }
+}
+
+
+/********************
+ * vm_fact_dup
+ ********************/
+OhmFact *
+vm_fact_dup(OhmFact *src, char *name)
+{
+    OhmFact *dst = ohm_fact_new(name);
+    GSList  *l   = (GSList *)ohm_fact_get_fields(src);
+    GValue  *value;
+    GQuark   q;
+
+    
+    if (dst == NULL)
+        return NULL;
+    
+    for ( ; l != NULL; l = g_slist_next(l)){
+        q     = GPOINTER_TO_INT(l->data);
+        value = ohm_copy_value(ohm_structure_qget(OHM_STRUCTURE(src), q));
+        ohm_structure_qset(OHM_STRUCTURE(dst), q, value);
+    }
+
+    return dst;
+}
+
+
+/********************
+ * vm_fact_copy
+ ********************/
+int
+vm_fact_copy(OhmFact *dst, OhmFact *src)
+{
+    GSList *l, *next;
+    GQuark  q;
+    int     nchange, n;
+
+    /*
+     * Notes:
+     *   Instead of clearing dst and setting all fields of src, we only
+     *   delete the fields src does not have and let vm_fact_update set
+     *   the ones that differ. Every field set makes the fact store emit
+     *   an "updated" signal, which in turn schedules another resolution,
+     *   so fields that would not change are best left alone. Changed
+     *   fields still get a new value, as the store needs to see (and be
+     *   able to roll back) every change.
+     *
+     *   Returns the number of fields changed, or -1 on failure.
+     */
+    
+    if (dst == src)
+        return 0;
+
+    nchange = 0;
+    for (l = ohm_fact_get_fields(dst); l != NULL; l = next) {
+        next = l->next;
+        q    = GPOINTER_TO_INT(l->data);
+        if (q == 0) {
+            fprintf(stderr, "*** NULL field name in fact\n");
+            continue;
+        }
+        
+        if (ohm_structure_qget(OHM_STRUCTURE(src), q) == NULL) {
+            ohm_structure_qset(OHM_STRUCTURE(dst), q,
+                               NULL);                    /* invalidates l */
+            nchange++;
+        }
+    }
+
+    if ((n = vm_fact_update(dst, src)) < 0)
+        return -1;
+    
+    return nchange + n;
+}
+
+
+/********************
+ * vm_fact_update
+ ********************/
+int
+vm_fact_update(OhmFact *dst, OhmFact *src)
+{
+    GSList *l = (GSList *)ohm_fact_get_fields(src);
+    GQuark  q;
+    int     nchange;
+
+    /* returns the number of fields changed, or -1 on failure */
+    
+    for (nchange = 0; l != NULL; l = g_slist_next(l)) {
+        GValue *value;
+        
+        q     = GPOINTER_TO_INT(l->data);
+        value = ohm_structure_qget(OHM_STRUCTURE(src), q);
+
+        if (vm_field_matches(dst, q, value))
+            continue;
+        
+        if ((value = ohm_copy_value(value)) == NULL)
+            return -1;
+        
+        ohm_structure_qset(OHM_STRUCTURE(dst), q, value);
+        nchange++;
+    }
+
+    return nchange;
+}
+
+
+/********************
+ * vm_fact_remove
+ ********************/
+void
+vm_fact_remove(char *name)
+{
+    OhmFactStore *store = ohm_fact_store_get_fact_store();
+    OhmFact      *fact;
+    GSList       *l;
+
+    for (l = vm_fact_lookup(name); l != NULL; l = g_slist_next(l)) {
+        fact = (OhmFact *)l->data;
+        ohm_fact_store_remove(store, fact);
+        g_object_unref(fact);
+    }
+}
+
+
+/********************
+ * vm_fact_remove_instance
+ ********************/
+void
+vm_fact_remove_instance(OhmFact *fact)
+{
+    OhmFactStore *store = ohm_fact_store_get_fact_store();
+    
+    ohm_fact_store_remove(store, fact);
+    g_object_unref(fact);
+}
+
+
+/********************
+ * vm_fact_insert
+ ********************/
+void
+vm_fact_insert(OhmFact *fact)
+{
+    OhmFactStore *store = ohm_fact_store_get_fact_store();
+    
+    ohm_fact_store_insert(store, fact);
+}
+
+
+/********************
+ * vm_fact_set_field
+ ********************/
+int
+vm_fact_set_field(vm_state_t *vm, OhmFact *fact, GQuark field,
+                  int type, vm_value_t *value)
+{
+    GValue     *gval;
+    const char *s;
+    int         same;
+
+    /*
+     * Notes:
+     *   Returns 1 if the field was changed, 0 if it already had the given
+     *   value, -EINVAL for a value of invalid type, or -ENOMEM. We do not
+     *   raise errors ourselves, so our callers get to free what they hold.
+     *   The current value is checked before we allocate a new one, as most
+     *   of the time it does not change.
+     */
+
+    gval = ohm_structure_qget(OHM_STRUCTURE(fact), field);
+    
+    switch (type) {
+    case VM_TYPE_INTEGER:
+        same = (gval != NULL && G_VALUE_TYPE(gval) == G_TYPE_INT &&
+                g_value_get_int(gval) == value->i);
+        break;
+    case VM_TYPE_DOUBLE:
+        same = (gval != NULL && G_VALUE_TYPE(gval) == G_TYPE_DOUBLE &&
+                g_value_get_double(gval) == value->d);
+        break;
+    case VM_TYPE_STRING:
+        same = (gval != NULL && G_VALUE_TYPE(gval) == G_TYPE_STRING &&
+                (s = g_value_get_string(gval)) != NULL && value->s != NULL &&
+                !strcmp(s, value->s));
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (same)
+        return 0;
+    
+    switch (type) {
+    case VM_TYPE_INTEGER: gval = ohm_value_from_int(value->i);    break;
+    case VM_TYPE_DOUBLE:  gval = ohm_value_from_double(value->d); break;
+    default:              gval = ohm_value_from_string(value->s); break;
+    }
+
+    if (gval == NULL)
+        return -ENOMEM;
+    
+    ohm_structure_qset(OHM_STRUCTURE(fact), field, gval);
+    return 1;
+
+    (void)vm;
+}
+
+
+/********************
+ * vm_value_match
+ ********************/
+int
+vm_value_match(GValue *gval, int type, vm_value_t *value)
+{
+    int         i;
+    double      d;
+    const char *s;
+
+    /*
+     * Notes:
+     *   Returns -1 if gval is not of the given type. All integer types
+     *   compare alike, and so do doubles and floats.
+     */
+    
+    switch (type) {
+    case VM_TYPE_INTEGER:
+        switch (G_VALUE_TYPE(gval)) {
+        case G_TYPE_INT:   i = g_value_get_int(gval);   break;
+        case G_TYPE_UINT:  i = g_value_get_uint(gval);  break;
+        case G_TYPE_LONG:  i = g_value_get_long(gval);  break;
+        case G_TYPE_ULONG: i = g_value_get_ulong(gval); break;
+        default:           return -1;
+        }
+        return i == value->i;
+
+    case VM_TYPE_DOUBLE:
+        switch (G_VALUE_TYPE(gval)) {
+        case G_TYPE_DOUBLE: d = g_value_get_double(gval);    break;
+        case G_TYPE_FLOAT:  d = 1.0*g_value_get_float(gval); break;
+        default:            return -1;
+        }
+        return d == value->d;
+
+    case VM_TYPE_STRING:
+        if (G_VALUE_TYPE(gval) != G_TYPE_STRING)
+            return -1;
+        s = g_value_get_string(gval);
+        return s != NULL && !strcmp(s, value->s);
+
+    default:
+        return -1;
+    }
+}
+
+
+/********************
+ * vm_fact_match_field
+ ********************/
+int
+vm_fact_match_field(vm_state_t *vm, OhmFact *fact, GQuark field,
+                    GValue *gval, int type, vm_value_t *value)
+{
+    int match;
+
+    if ((match = vm_value_match(gval, type, value)) >= 0)
+        return match;
+
+    switch (type) {
+    case VM_TYPE_INTEGER:
+        VM_RAISE(vm, EINVAL, "integer type expected for field %s",
+                 g_quark_to_string(field));
+    case VM_TYPE_DOUBLE:
+        VM_RAISE(vm, EINVAL, "double type expected for field %s",
+                 g_quark_to_string(field));
+    case VM_TYPE_STRING:
+        VM_RAISE(vm, EINVAL, "string type expected for field %s",
+                 g_quark_to_string(field));
+    default:
+        VM_RAISE(vm, EINVAL, "unexpected field type 0x%x for filter", type);
+    }
+    
+    return 0;
+
+    (void)fact;
+}
+
+
+/********************
+ * vm_fact_get_field
+ ********************/
+int
+vm_fact_get_field(vm_state_t *vm, OhmFact *fact, GQuark field,
+                  vm_value_t *value)
+{
+    GValue *gval = ohm_structure_qget(OHM_STRUCTURE(fact), field);
+
+    if (gval == NULL)
+        return VM_TYPE_UNKNOWN;
+
+    switch (G_VALUE_TYPE(gval)) {
+    case G_TYPE_INT:   value->i = g_value_get_int(gval);   goto inttype;
+    case G_TYPE_UINT:  value->i = g_value_get_uint(gval);  goto inttype;
+    case G_TYPE_LONG:  value->i = g_value_get_long(gval);  goto inttype;
+    case G_TYPE_ULONG: value->i = g_value_get_ulong(gval);
+    inttype:
+        return VM_TYPE_INTEGER;
+        
+    case G_TYPE_DOUBLE: value->d = g_value_get_double(gval); goto dbltype;
+    case G_TYPE_FLOAT:  value->d = 1.0*g_value_get_float(gval);
+    dbltype:
+        return VM_TYPE_DOUBLE;
+        
+    case G_TYPE_STRING: value->s = (char *)g_value_get_string(gval);
+        return VM_TYPE_STRING;
+
+    default:
+        VM_RAISE(vm, EINVAL, "unexpected field type field %s",
+                 g_quark_to_string(field));
+    }
+    
+    return VM_TYPE_UNKNOWN;
+    (void)vm;
+}
+
+
+/********************
+ * vm_fact_collect_fields
+ ********************/
+int
+vm_fact_collect_fields(OhmFact *f, GQuark *fields, int nfield, GValue **values)
+{
+    int i;
+    
+    for (i = 0; i < nfield; i++)
+        if ((values[i] = ohm_structure_qget(OHM_STRUCTURE(f),
+                                            fields[i])) == NULL)
+            return -i;
+    
+    return 0;
+}
+
+
+/********************
+ * vm_field_matches
+ ********************/
+static inline int
+vm_field_matches(OhmFact *f, GQuark field, GValue *value)
+{
+#define GV(v, t) g_value_get_##t(v)
+#define CMP(s, d, t) (GV(s, t) == GV(d, t))
     
-    if ((v = ohm_fact_get(f, field)) == NULL)
+    GValue *v;
+    
+    if ((v = ohm_structure_qget(OHM_STRUCTURE(f), field)) == NULL)
         return 0;
     
     if (G_VALUE_TYPE(v) != G_VALUE_TYPE(value))
@@ -493,7 +1538,7 @@ vm_field_matches(OhmFact *f, char *field, GValue *value)
  * vm_fact_matches
  ********************/
 int
-vm_fact_matches(OhmFact *f, char **fields, GValue **values, int nfield)
+vm_fact_matches(OhmFact *f, GQuark *fields, GValue **values, int nfield)
 {
     int i;
     
@@ -518,11 +1563,189 @@ vm_fact_print(FILE *fp, OhmFact *fact)
 }
 
 
+/********************
+ * hash_mix
+ ********************/
+static inline uint64_t
+hash_mix(uint64_t k)
+{
+    /*
+     * Notes:
+     *   This is the 64-bit finalizer of MurmurHash3. The constant added
+     *   first keeps 0 from mapping to 0, so that NULL values and removals
+     *   do not vanish from the sums and digests built on top of this.
+     */
+    
+    k += 0x9e3779b97f4a7c15ULL;
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+
+    return k;
+}
+
+
+/********************
+ * vm_hash_mix
+ ********************/
+uint64_t
+vm_hash_mix(uint64_t k)
+{
+    return hash_mix(k);
+}
+
+
+/********************
+ * string_hash
+ ********************/
+static uint64_t
+string_hash(const char *p)
+{
+    uint64_t hash;
+
+    hash = 0xcbf29ce484222325ULL;                          /* FNV-1a */
+    for (; p && *p; p++) {
+        hash ^= (unsigned char)*p;
+        hash *= 0x100000001b3ULL;
+    }
+    
+    return hash_mix(hash);
+}
+
+
+/********************
+ * vm_fact_digest
+ ********************/
+void
+vm_fact_digest(vm_state_t *vm, OhmFact *fact, int removed)
+{
+    uint64_t hash;
+    
+    if (!VM_TST_FLAG(vm, DIGEST))
+        return;
+
+    hash = vm_fact_hash(fact);
+    
+    if (removed)
+        hash = ~hash;
+    
+    vm->digest = hash_mix(vm->digest ^ hash);
+    VM_SET_FLAG(vm, WRITTEN);
+}
+
+
+/********************
+ * vm_field_digest
+ ********************/
+void
+vm_field_digest(vm_state_t *vm, OhmFact *fact, GQuark field)
+{
+    GValue   *value;
+    uint64_t  hash;
+    
+    if (!VM_TST_FLAG(vm, DIGEST))
+        return;
+
+    /*
+     * Notes:
+     *   Only the written field is hashed, together with the identity of
+     *   the fact. Hashing the whole fact would make the digest depend on
+     *   the fields of the fact still to be written by the same code, so
+     *   a rerun writing the very same values would look like a change.
+     */
+    
+    value = ohm_structure_qget(OHM_STRUCTURE(fact), field);
+    hash  = hash_mix((uint64_t)(uintptr_t)fact ^ hash_mix(field));
+    hash  = hash_mix(hash ^ vm_value_hash(value));
+    
+    vm->digest = hash_mix(vm->digest ^ hash);
+    VM_SET_FLAG(vm, WRITTEN);
+}
+
+
+/********************
+ * vm_value_hash
+ ********************/
+uint64_t
+vm_value_hash(GValue *value)
+{
+    uint64_t tag, bits;
+    double   d;
+
+    /*
+     * Notes:
+     *   All integer types hash alike, and so do doubles and floats, since
+     *   they compare equal to each other (cf. vm_fact_match_field).
+     */
+    
+    if (value == NULL)
+        return hash_mix(0);
+    
+    switch (G_VALUE_TYPE(value)) {
+    case G_TYPE_INT:   tag = 1; bits = g_value_get_int(value);   break;
+    case G_TYPE_UINT:  tag = 1; bits = g_value_get_uint(value);  break;
+    case G_TYPE_LONG:  tag = 1; bits = g_value_get_long(value);  break;
+    case G_TYPE_ULONG: tag = 1; bits = g_value_get_ulong(value); break;
+    case G_TYPE_DOUBLE:
+    case G_TYPE_FLOAT:
+        d   = G_VALUE_TYPE(value) == G_TYPE_DOUBLE ?
+            g_value_get_double(value) : g_value_get_float(value);
+        tag = 2;
+        if (d == 0.0)                       /* -0.0 == 0.0, hash them alike */
+            d = 0.0;
+        memcpy(&bits, &d, sizeof(bits));
+        break;
+    case G_TYPE_STRING:
+        tag  = 3;
+        bits = string_hash(g_value_get_string(value));
+        break;
+    default:
+        tag  = 4;
+        bits = G_VALUE_TYPE(value);
+    }
+
+    return hash_mix(hash_mix(tag) ^ bits);
+}
+
+
+/********************
+ * vm_fact_hash
+ ********************/
+uint64_t
+vm_fact_hash(OhmFact *fact)
+{
+    GSList   *l;
+    GValue   *value;
+    GQuark    q;
+    uint64_t  hash;
+    
+    hash = string_hash(ohm_structure_get_name(OHM_STRUCTURE(fact)));
+
+    /*
+     * Notes:
+     *   Every field is mixed separately with its name and the mixes are
+     *   summed, so the hash does not depend on the order of the fields but
+     *   swapping values between fields still changes it.
+     */
+
+    for (l = ohm_fact_get_fields(fact); l != NULL; l = g_slist_next(l)) {
+        q     = GPOINTER_TO_INT(l->data);
+        value = ohm_structure_qget(OHM_STRUCTURE(fact), q);
+        hash += hash_mix(hash_mix(q) ^ vm_value_hash(value));
+    }
+    
+    return hash;
+}
+
+
 /********************
  * vm_global_find_first
  ********************/
 int
-vm_global_find_first(vm_global_t *g, char **fields, GValue **values, int nfield)
+vm_global_find_first(vm_global_t *g, GQuark *fields, GValue **values,
+                     int nfield)
 {
     int i;
 
@@ -541,7 +1764,7 @@ vm_global_find_first(vm_global_t *g, char **fields, GValue **values, int nfield)
  ********************/
 int
 vm_global_find_next(vm_global_t *g, int idx,
-                    char **fields, GValue **values, int nfield)
+                    GQuark *fields, GValue **values, int nfield)
 {
     int i;
 
@@ -555,6 +1778,387 @@ vm_global_find_next(vm_global_t *g, int idx,
 }
 
 
+/*****************************************************************************
+ *                              *** hash joins ***                           *
+ *****************************************************************************/
+
+/*
+ * Notes:
+ *
+ *   UPDATE and REPLACE look up the destination facts matching each source
+ *   fact on a set of key fields. Instead of scanning all of the destination
+ *   for every source fact, we hash the destination facts on their key
+ *   values once and then only check the facts with the same hash. Facts
+ *   with a given hash are chained in fact order, so the matches are found
+ *   in the same order as by scanning. We always hash the destination: the
+ *   source facts are processed strictly in order, as later ones override
+ *   the updates of earlier ones.
+ *
+ *   Hashing a key is cheaper than comparing it, but not by that much, so
+ *   small destinations are simply scanned. The same goes if we fail to
+ *   allocate the hash.
+ *
+ *   REPLACE clears the matched destination facts and decreases nfact as
+ *   it goes, so we remember the original number of slots and look at all
+ *   of them instead of stopping at nfact.
+ */
+
+
+/********************
+ * join_hash
+ ********************/
+static unsigned int
+join_hash(GValue **values, int nfield)
+{
+    unsigned int hash;
+    int          i;
+
+    for (i = 0, hash = 0; i < nfield; i++)
+        hash = hash * 31 + vm_value_hash(values[i]);
+
+    return hash;
+}
+
+
+/********************
+ * join_scan
+ ********************/
+static int
+join_scan(vm_join_t *j, vm_global_t *g, int i, GValue **values)
+{
+    OhmFact *fact;
+    
+    if (j->heads == NULL) {
+        /* i is the index of the first fact to check */
+        for ( ; i < j->nslot; i++) {
+            if ((fact = g->facts[i]) != NULL &&
+                vm_fact_matches(fact, j->fields, values, j->nfield))
+                return i;
+        }
+    }
+    else {
+        /* i is the index of the fact + 1, 0 ends the chain */
+        for ( ; i != 0; i = j->chain[i - 1]) {
+            if ((fact = g->facts[i - 1]) != NULL &&
+                vm_fact_matches(fact, j->fields, values, j->nfield))
+                return i - 1;
+        }
+    }
+    
+    return -1;
+}
+
+
+/********************
+ * vm_join_init
+ ********************/
+void
+vm_join_init(vm_join_t *j, vm_global_t *g, GQuark *fields, int nfield)
+{
+    GValue       *values[nfield > 0 ? nfield : 1];
+    OhmFact      *fact;
+    unsigned int  hash;
+    gpointer      key;
+    int           i, k;
+
+    memset(j, 0, sizeof(*j));
+    j->fields = fields;
+    j->nfield = nfield;
+    j->nslot  = g->nfact;
+    
+    if (nfield <= 0 || g->nfact < JOIN_MIN)
+        return;
+
+    j->heads = g_hash_table_new(g_direct_hash, g_direct_equal);
+    j->chain = ALLOC_ARR(int, g->nfact);
+
+    if (j->heads == NULL || j->chain == NULL) {
+        vm_join_exit(j);
+        return;
+    }
+
+    /* chain facts backwards, so lookups find them in fact order */
+    for (i = g->nfact - 1; i >= 0; i--) {
+        if ((fact = g->facts[i]) == NULL)
+            continue;
+        
+        for (k = 0; k < nfield; k++)
+            if ((values[k] = ohm_structure_qget(OHM_STRUCTURE(fact),
+                                                fields[k])) == NULL)
+                break;
+        if (k < nfield)                           /* can't match anything */
+            continue;
+        
+        hash        = join_hash(values, nfield);
+        key         = GUINT_TO_POINTER(hash);
+        j->chain[i] = GPOINTER_TO_INT(g_hash_table_lookup(j->heads, key));
+        g_hash_table_insert(j->heads, key, GINT_TO_POINTER(i + 1));
+    }
+}
+
+
+/********************
+ * vm_join_exit
+ ********************/
+void
+vm_join_exit(vm_join_t *j)
+{
+    if (j->heads != NULL)
+        g_hash_table_destroy(j->heads);
+    FREE(j->chain);
+
+    j->heads = NULL;
+    j->chain = NULL;
+}
+
+
+/********************
+ * vm_join_first
+ ********************/
+int
+vm_join_first(vm_join_t *j, vm_global_t *g, GValue **values)
+{
+    gpointer key, first;
+    
+    if (j->heads == NULL)
+        return join_scan(j, g, 0, values);
+
+    key   = GUINT_TO_POINTER(join_hash(values, j->nfield));
+    first = g_hash_table_lookup(j->heads, key);
+    
+    return join_scan(j, g, GPOINTER_TO_INT(first), values);
+}
+
+
+/********************
+ * vm_join_next
+ ********************/
+int
+vm_join_next(vm_join_t *j, vm_global_t *g, int idx, GValue **values)
+{
+    if (j->heads == NULL)
+        return join_scan(j, g, idx + 1, values);
+    
+    return join_scan(j, g, j->chain[idx], values);
+}
+
+
+/*****************************************************************************
+ *                            *** batched writes ***                         *
+ *****************************************************************************/
+
+/*
+ * Notes:
+ *
+ *   Inserting or removing a fact makes the fact store update its views
+ *   and emit a signal, which the resolver plugin turns into another
+ *   resolution. Instead of writing to the store right away, the VM
+ *   queues these writes and applies them in one pass:
+ *
+ *     - at the end of vm_exec, ie. once per executed target,
+ *     - before calling a method, which might look at the store,
+ *     - before looking up facts by a name with queued writes, so the
+ *       VM always sees its own writes, in the order the store keeps
+ *       them.
+ *
+ *   A fact removed while its insertion is still queued never reaches
+ *   the store, and neither do any field changes made to it meanwhile.
+ *   A fact removed twice is removed from the store only once. Field
+ *   changes to facts already in the store are not queued, as the VM
+ *   reads fields directly from the facts.
+ *
+ *   Every queued write holds its own reference to the fact. Otherwise
+ *   the writes have the same effect on references as vm_fact_insert
+ *   and vm_fact_remove_instance. If queueing fails we flush the queue
+ *   and write directly.
+ */
+
+
+/********************
+ * batch_add
+ ********************/
+static int
+batch_add(vm_state_t *vm, OhmFact *fact, int op)
+{
+    vm_batch_t *b = &vm->batch;
+    int         n;
+
+    if (b->pending == NULL) {
+        b->pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+        if (b->pending == NULL)
+            return ENOMEM;
+    }
+    
+    if (b->nwrite >= b->nalloc) {
+        n = b->nalloc ? 2 * b->nalloc : BATCH_MIN;
+        if (REALLOC_ARR(b->writes, b->nalloc, n) == NULL)
+            return ENOMEM;
+        b->nalloc = n;
+    }
+
+    b->writes[b->nwrite].fact = g_object_ref(fact);
+    b->writes[b->nwrite].op   = op;
+    b->nwrite++;
+    
+    g_hash_table_insert(b->pending, fact, GINT_TO_POINTER(b->nwrite));
+    
+    return 0;
+}
+
+
+/********************
+ * batch_sync
+ ********************/
+static void
+batch_sync(vm_state_t *vm, const char *name)
+{
+    vm_batch_t *b = &vm->batch;
+    vm_write_t *w;
+    const char *n;
+    int         i;
+
+    for (i = 0, w = b->writes; i < b->nwrite; i++, w++) {
+        if (w->op == VM_BATCH_NONE)
+            continue;
+        
+        n = ohm_structure_get_name(OHM_STRUCTURE(w->fact));
+        if (n != NULL && !strcmp(n, name)) {
+            b->status = vm_batch_flush(vm);
+            return;
+        }
+    }
+}
+
+
+/********************
+ * vm_batch_insert
+ ********************/
+int
+vm_batch_insert(vm_state_t *vm, OhmFact *fact)
+{
+    OhmFactStore *store;
+    
+    if (batch_add(vm, fact, VM_BATCH_INSERT) == 0)
+        return 0;
+
+    vm_batch_flush(vm);
+    store = ohm_fact_store_get_fact_store();
+    
+    return ohm_fact_store_insert(store, fact) ? 0 : EINVAL;
+}
+
+
+/********************
+ * vm_batch_remove
+ ********************/
+int
+vm_batch_remove(vm_state_t *vm, OhmFact *fact)
+{
+    vm_batch_t *b = &vm->batch;
+    vm_write_t *w;
+    int         i;
+
+    i = 0;
+    if (b->pending != NULL)
+        i = GPOINTER_TO_INT(g_hash_table_lookup(b->pending, fact));
+    
+    if (i > 0) {
+        w = b->writes + i - 1;
+        
+        switch (w->op) {
+        case VM_BATCH_INSERT:                 /* never reaches the store */
+            g_hash_table_remove(b->pending, fact);
+            g_object_unref(w->fact);
+            w->fact = NULL;
+            w->op   = VM_BATCH_NONE;
+            g_object_unref(fact);
+            return 0;
+            
+        case VM_BATCH_REMOVE:                 /* already being removed */
+            g_object_unref(fact);
+            return 0;
+        }
+    }
+    
+    if (batch_add(vm, fact, VM_BATCH_REMOVE) == 0)
+        return 0;
+
+    vm_batch_flush(vm);
+    vm_fact_remove_instance(fact);
+    
+    return 0;
+}
+
+
+/********************
+ * vm_batch_flush
+ ********************/
+int
+vm_batch_flush(vm_state_t *vm)
+{
+    OhmFactStore *store;
+    vm_batch_t   *b = &vm->batch;
+    vm_write_t   *w;
+    int           status, nwrite, i;
+
+    status    = b->status;
+    b->status = 0;
+    
+    if (b->nwrite == 0)
+        return status;
+    
+    /*
+     * Notes:
+     *   The store might signal the writes right away, and its handlers
+     *   might end up looking facts up (and flushing) again, so we take
+     *   the writes off the queue before we apply them.
+     */
+
+    store     = ohm_fact_store_get_fact_store();
+    nwrite    = b->nwrite;
+    b->nwrite = 0;
+    if (b->pending != NULL)
+        g_hash_table_remove_all(b->pending);
+
+    for (i = 0, w = b->writes; i < nwrite; i++, w++) {
+        switch (w->op) {
+        case VM_BATCH_INSERT:
+            if (!ohm_fact_store_insert(store, w->fact))
+                status = EINVAL;
+            break;
+        case VM_BATCH_REMOVE:
+            ohm_fact_store_remove(store, w->fact);
+            g_object_unref(w->fact);          /* cf. vm_fact_remove_instance */
+            break;
+        default:
+            continue;
+        }
+        
+        g_object_unref(w->fact);
+    }
+    
+    return status;
+}
+
+
+/********************
+ * vm_batch_free
+ ********************/
+void
+vm_batch_free(vm_state_t *vm)
+{
+    vm_batch_t *b = &vm->batch;
+
+    vm_batch_flush(vm);
+    
+    if (b->pending != NULL)
+        g_hash_table_destroy(b->pending);
+    FREE(b->writes);
+
+    memset(b, 0, sizeof(*b));
+}
+
+
 /* 
  * Local Variables:
  * c-basic-offset: 4
@@ -26,6 +26,7 @@ USA.
 #include <limits.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <arpa/inet.h>
 
 #include <dres/mm.h>
 #include <dres/vm.h>
@@ -45,55 +46,171 @@ int vm_instr_cmp    (vm_state_t *vm);
 int vm_instr_branch (vm_state_t *vm);
 int vm_instr_debug  (vm_state_t *vm);
 int vm_instr_replace(vm_state_t *vm);
+int vm_instr_select (vm_state_t *vm);
+
+static GQuark chunk_quark(vm_chunk_t *c, int idx);
 
 /*****************************************************************************
  *                            *** code interpreter ***                       *
  *****************************************************************************/
 
 
+/*
+ * Notes:
+ *
+ *   Instruction handlers return the number of code words they consumed,
+ *   leaving the bookkeeping of pc, ninstr and nsize to the interpreter
+ *   loop. BRANCH is the only exception, it sets pc itself and returns 0.
+ */
+
+#define VM_ADVANCE(vm, n) do {                                          \
+        (vm)->ninstr--;                                                 \
+        (vm)->pc    += (n);                                             \
+        (vm)->nsize -= (n) * sizeof(vm_instr_t);                        \
+    } while (0)
+
+/* field names are quarks, or strings in hand-assembled code */
+#define IS_FIELD(type) ((type) == VM_TYPE_FIELD || (type) == VM_TYPE_STRING)
+
+
 /********************
- * vm_run
+ * vm_run_traced
  ********************/
-int
-vm_run(vm_state_t *vm)
+static int
+vm_run_traced(vm_state_t *vm)
 {
     int status = EOPNOTSUPP;
+    int n;
 
     while (vm->ninstr > 0) {
         if (DEBUG_ON(DBG_VM)) {
-            uintptr_t    *pc = vm->pc;
+            vm_instr_t   *pc = vm->pc;
             char          instr[128];
-            int           n;
+            int           len;
             
-            if ((n = vm_dump_instr(&pc, instr, sizeof(instr), 0)) > 0) {
-                if (instr[n-1] == '\n')
-                    instr[n-1] = '\0';
+            if ((len = vm_dump_instr(vm->chunk, &pc, instr, sizeof(instr), 0)) > 0) {
+                if (instr[len-1] == '\n')
+                    instr[len-1] = '\0';
                 DEBUG(DBG_VM, "executing %s", instr);
             }
         }
         
         switch ((vm_opcode_t)VM_OP_CODE(*vm->pc)) {
-        case VM_OP_PUSH:    status = vm_instr_push(vm);   break;
-        case VM_OP_POP:     status = vm_instr_pop(vm);    break;
-        case VM_OP_FILTER:  status = vm_instr_filter(vm); break;
-        case VM_OP_UPDATE:  status = vm_instr_update(vm); break;
-        case VM_OP_SET:     status = vm_instr_set(vm);    break;
-        case VM_OP_GET:     status = vm_instr_get(vm);    break;
-        case VM_OP_CREATE:  status = vm_instr_create(vm); break;
-        case VM_OP_CALL:    status = vm_instr_call(vm);   break;
-        case VM_OP_CMP:     status = vm_instr_cmp(vm);    break;
-        case VM_OP_BRANCH:  status = vm_instr_branch(vm); break;
-        case VM_OP_DEBUG:   status = vm_instr_debug(vm);  break;
+        case VM_OP_PUSH:    n = vm_instr_push(vm);    break;
+        case VM_OP_POP:     n = vm_instr_pop(vm);     break;
+        case VM_OP_FILTER:  n = vm_instr_filter(vm);  break;
+        case VM_OP_UPDATE:  n = vm_instr_update(vm);  break;
+        case VM_OP_SET:     n = vm_instr_set(vm);     break;
+        case VM_OP_GET:     n = vm_instr_get(vm);     break;
+        case VM_OP_CREATE:  n = vm_instr_create(vm);  break;
+        case VM_OP_CALL:    n = vm_instr_call(vm);    break;
+        case VM_OP_CMP:     n = vm_instr_cmp(vm);     break;
+        case VM_OP_BRANCH:  n = vm_instr_branch(vm);  break;
+        case VM_OP_DEBUG:   n = vm_instr_debug(vm);   break;
         case VM_OP_HALT:    return status;
-        case VM_OP_REPLACE: status = vm_instr_replace(vm); break;
-        default: VM_RAISE(vm, EILSEQ, "invalid instruction 0x%" PRIxPTR, *vm->pc);
+        case VM_OP_REPLACE: n = vm_instr_replace(vm); break;
+        case VM_OP_SELECT:  n = vm_instr_select(vm);  break;
+        default: VM_RAISE(vm, EILSEQ, "invalid instruction 0x%" PRIx32, *vm->pc);
         }
+
+        if (n > 0)
+            VM_ADVANCE(vm, n);
+        status = 0;
     }
     
     return status;
 }
 
 
+/********************
+ * vm_run
+ ********************/
+int
+vm_run(vm_state_t *vm)
+{
+#ifdef __GNUC__
+    static void *dispatch[] = {
+        [VM_OP_UNKNOWN]       = &&op_invalid,
+        [VM_OP_PUSH]          = &&op_push,
+        [VM_OP_POP]           = &&op_pop,
+        [VM_OP_FILTER]        = &&op_filter,
+        [VM_OP_UPDATE]        = &&op_update,
+        [VM_OP_SET]           = &&op_set,
+        [VM_OP_GET]           = &&op_get,
+        [VM_OP_CREATE]        = &&op_create,
+        [VM_OP_CALL]          = &&op_call,
+        [VM_OP_CMP]           = &&op_cmp,
+        [VM_OP_BRANCH]        = &&op_branch,
+        [VM_OP_DEBUG]         = &&op_debug,
+        [VM_OP_HALT]          = &&op_halt,
+        [VM_OP_REPLACE]       = &&op_replace,
+        [VM_OP_SELECT]        = &&op_select,
+    };
+    int       status = EOPNOTSUPP;
+    vm_instr_t op;
+
+    /*
+     * Notes:
+     *
+     *   This is the fast, direct-threaded interpreter. Every handler jumps
+     *   straight to the handler of the next instruction without going back
+     *   to a central switch. Tracing is left to vm_run_traced which we pick
+     *   once per run if VM debugging is on.
+     */
+
+    if (DEBUG_ON(DBG_VM))
+        return vm_run_traced(vm);
+
+#define DISPATCH() do {                                                 \
+        if (vm->ninstr <= 0)                                            \
+            return status;                                              \
+        if ((op = VM_OP_CODE(*vm->pc)) > VM_OP_SELECT)                  \
+            goto op_invalid;                                            \
+        goto *dispatch[op];                                             \
+    } while (0)
+
+#define NEXT(handler) do {                                              \
+        int __n = handler(vm);                                          \
+        VM_ADVANCE(vm, __n);                                            \
+        status = 0;                                                     \
+        DISPATCH();                                                     \
+    } while (0)
+
+    DISPATCH();
+
+ op_push:    NEXT(vm_instr_push);
+ op_pop:     NEXT(vm_instr_pop);
+ op_filter:  NEXT(vm_instr_filter);
+ op_update:  NEXT(vm_instr_update);
+ op_set:     NEXT(vm_instr_set);
+ op_get:     NEXT(vm_instr_get);
+ op_create:  NEXT(vm_instr_create);
+ op_call:    NEXT(vm_instr_call);
+ op_cmp:     NEXT(vm_instr_cmp);
+ op_debug:   NEXT(vm_instr_debug);
+ op_replace: NEXT(vm_instr_replace);
+ op_select:  NEXT(vm_instr_select);
+
+ op_branch:
+    vm_instr_branch(vm);
+    status = 0;
+    DISPATCH();
+
+ op_halt:
+    return status;
+
+ op_invalid:
+    VM_RAISE(vm, EILSEQ, "invalid instruction 0x%" PRIx32, *vm->pc);
+    return EILSEQ; /* not reached */
+    
+#undef NEXT
+#undef DISPATCH
+#else
+    return vm_run_traced(vm);
+#endif
+}
+
+
 
 /*
  * PUSH
@@ -107,9 +224,12 @@ int
 vm_instr_push(vm_state_t *vm)
 {
 #define CHECK_AND_GROW(t, nbyte) do {                                    \
-        if (vm->nsize - sizeof(uintptr_t) < nbyte)                       \
-            VM_RAISE(vm, EINVAL, "PUSH "#t": not enough data");          \
-        if (vm_stack_grow(vm->stack, VM_ALIGN_TO_INSTR(nbyte)))          \
+        if (VM_TST_FLAG(vm, VERIFIED))                                   \
+            break;                                                       \
+        if (VM_PUSH_IS_CONST(*vm->pc) &&                                 \
+            (int)(data * VM_CONST_ALIGN + nbyte) > vm->chunk->nconst)    \
+            VM_RAISE(vm, EINVAL, "PUSH "#t": constant out of range");    \
+        if (vm_stack_grow(vm->stack, 1))                                 \
             VM_RAISE(vm, ENOMEM, "PUSH "#t": failed to grow the stack"); \
     } while (0)
 
@@ -120,37 +240,42 @@ vm_instr_push(vm_state_t *vm)
     uintptr_t     data = VM_PUSH_DATA(*vm->pc);
     uintptr_t     i;
     char         *name;
-    int           nsize, id;
+    int           id;
     
 
     switch (type) {
     case VM_TYPE_INTEGER:
-        CHECK_AND_GROW(int, sizeof(int));
-        vm_push_int(vm->stack, data ? data - 1 : *(vm->pc + 1));
-        nsize = data ? 1 : 2;
+        CHECK_AND_GROW(int, sizeof(int32_t));
+        if (VM_PUSH_IS_CONST(*vm->pc))
+            vm_push_int(vm->stack, vm_const_int(vm->chunk, data));
+        else
+            vm_push_int(vm->stack, data - 1);
         break;
 
     case VM_TYPE_DOUBLE:
         CHECK_AND_GROW(double, sizeof(double));
-        vm_push_double(vm->stack, *(double *)(vm->pc + 1));
-        nsize = 1 + VM_ALIGN_TO_INSTR(sizeof(double));
+        vm_push_double(vm->stack, vm_const_double(vm->chunk, data));
         break;
 
     case VM_TYPE_STRING:
-        CHECK_AND_GROW(char *, data);
-        vm_push_string(vm->stack, (char *)(vm->pc + 1));
-        nsize = 1 + VM_ALIGN_TO_INSTR(data);
+        CHECK_AND_GROW(char *, 1);
+        vm_push_string(vm->stack, VM_CONST_STRING(vm->chunk, data));
+        break;
+
+    case VM_TYPE_FIELD:
+        CHECK_AND_GROW(field, 1);
+        vm_push_cell(vm->stack,
+                     VM_CELL_FIELD(vm_const_field(vm->chunk, data)));
         break;
 
     case VM_TYPE_GLOBAL:
-        CHECK_AND_GROW(char *, data);
-        name = (char *)(vm->pc + 1);
-        if (vm_global_lookup(name, &g) == ENOENT)
-            g = vm_global_name(name);
+        CHECK_AND_GROW(char *, 1);
+        name = VM_CONST_STRING(vm->chunk, data);
+        if (vm_global_lookup(vm, name, &g) == ENOENT)
+            g = vm_global_name(vm, name);
         if (g == NULL)
             VM_RAISE(vm, ENOENT, "PUSH GLOBAL: failed to look up %s", name);
         vm_push_global(vm->stack, g);
-        nsize = 1 + VM_ALIGN_TO_INSTR(data);
         break;
 
     case VM_TYPE_LOCAL:
@@ -162,7 +287,8 @@ vm_instr_push(vm_state_t *vm)
         if (vm_scope_push(vm) != 0)
             VM_RAISE(vm, ENOMEM, "PUSH LOCALS: failed to push new scope");
         for (i = 0; i < data; i++) {
-            if (vm_type(vm->stack) != VM_TYPE_INTEGER)
+            if (!VM_TST_FLAG(vm, TYPED) &&
+                vm_type(vm->stack) != VM_TYPE_INTEGER)
                 VM_RAISE(vm, EINVAL, "PUSH LOCALS: expecting integer ID");
             id   = vm_pop_int(vm->stack);
             type = vm_pop(vm->stack, &v);
@@ -170,18 +296,14 @@ vm_instr_push(vm_state_t *vm)
                 VM_RAISE(vm, EINVAL,
                              "PUSH LOCALS: failed to set local #0x%x", id);
         }
-        nsize = 1;
         break;
         
     default: VM_RAISE(vm, EINVAL, "invalid type 0x%" PRIxPTR " to push", type);
     }
 
         
-    vm->ninstr--;
-    vm->pc    += nsize;
-    vm->nsize -= nsize * sizeof(uintptr_t);
-    
-    return 0;
+    return 1;
+#undef CHECK_AND_GROW
 }
 
 
@@ -214,12 +336,8 @@ vm_instr_pop(vm_state_t *vm)
     default:
         VM_RAISE(vm, EINVAL, "POP: invalid POP type 0x%x", kind);
     }
-    
-    vm->ninstr--;
-    vm->pc    += 1;
-    vm->nsize -= sizeof(uintptr_t);
 
-    return 0;
+    return 1;
 }
 
 
@@ -228,6 +346,59 @@ vm_instr_pop(vm_state_t *vm)
  */
 
 
+/********************
+ * filter_facts
+ ********************/
+static int
+filter_facts(vm_state_t *vm, vm_global_t *g, int nfact,
+             GQuark field, int type, vm_value_t *value, int neq)
+{
+    OhmFact *fact;
+    GValue  *gval;
+    int      j, match;
+
+    if (vm_global_filter(vm, g, field, type, value, neq, &nfact) == 0)
+        return nfact;
+    
+    for (j = 0; j < g->nfact; j++) {
+        if ((fact = g->facts[j]) == NULL)
+            continue;
+        
+        if ((gval = ohm_structure_qget(OHM_STRUCTURE(fact), field)) == NULL)
+            match = FALSE;
+        else
+            match = vm_fact_match_field(vm, fact, field, gval, type, value);
+        
+        if ((!match && !neq) || (match && neq)) {
+            g_object_unref(fact);
+            g->facts[j] = NULL;
+            nfact--;
+        }
+    }
+
+    return nfact;
+}
+
+
+/********************
+ * pack_facts
+ ********************/
+static void
+pack_facts(vm_global_t *g, int nfact)
+{
+    int i, j;
+    
+    if (nfact != g->nfact) {
+        for (i = 0, j = 0; j < nfact; i++) {       /* pack facts tightly */
+            if (g->facts[i] != NULL)
+                g->facts[j++] = g->facts[i];
+        }
+    }
+    
+    g->nfact = nfact;
+}
+
+
 /********************
  * vm_instr_filter
  ********************/
@@ -236,10 +407,10 @@ vm_instr_filter(vm_state_t *vm)
 {
     vm_global_t *g = NULL;
     int          nfield, nfact;
-    char        *field;
+    GQuark       field;
     vm_value_t   value;
     int          type, neq;
-    int          i, j, match;
+    int          i;
     
     
     nfield = VM_FILTER_NFIELD(*vm->pc);
@@ -252,48 +423,147 @@ vm_instr_filter(vm_state_t *vm)
     
     for (i = 0; i < nfield; i++) {
 
-        if (vm_type(vm->stack) != VM_TYPE_STRING)
-            VM_RAISE(vm, EINVAL, "FILTER: invalid field name, string expected");
+        if (!VM_TST_FLAG(vm, TYPED) && !IS_FIELD(vm_type(vm->stack)))
+            VM_RAISE(vm, EINVAL, "FILTER: invalid field name");
         
-        field = vm_pop_string(vm->stack);
+        field = vm_pop_field(vm->stack);
         type  = vm_pop(vm->stack, &value);
         neq   = vm_pop_int(vm->stack) == VM_RELOP_NE;
 
-        for (j = 0; j < g->nfact; j++) {
-            OhmFact    *fact;
-            GValue     *gval;
-            
-            if ((fact = g->facts[j]) == NULL)
-                continue;
+        nfact = filter_facts(vm, g, nfact, field, type, &value, neq);
+    }
 
-            if ((gval = ohm_fact_get(fact, field)) == NULL)
-                match = FALSE;
-            else
-                match = vm_fact_match_field(vm, fact, field, gval, type,&value);
-            
-            if ((!match && !neq) || (match && neq)) {
-                g_object_unref(fact);
-                g->facts[j] = NULL;
-                nfact--;
-            }
+    pack_facts(g, nfact);
+
+    return 1;
+}
+
+
+/*
+ * SELECT
+ */
+
+
+/********************
+ * select_operand
+ ********************/
+static void
+select_operand(vm_state_t *vm, vm_instr_t *pc, int *type, vm_value_t *value)
+{
+    uintptr_t data;
+    int       idx;
+    
+    if (VM_OP_CODE(*pc) == VM_OP_GET) {
+        idx = VM_OP_ARGS(*pc) & ~VM_GET_LOCAL;
+        if ((*type = vm_scope_get(vm->scope, idx, value)) == VM_TYPE_UNKNOWN) {
+            *type    = VM_TYPE_NIL;
+            value->i = 0;
         }
+        return;
     }
 
-    if (nfact != g->nfact) {
-        for (i = 0, j = 0; j < nfact; i++) {       /* pack facts tightly */
-            if (g->facts[i] != NULL)
-                g->facts[j++] = g->facts[i];
+    data = VM_PUSH_DATA(*pc);
+    
+    switch ((*type = VM_PUSH_TYPE(*pc))) {
+    case VM_TYPE_INTEGER:
+        if (VM_PUSH_IS_CONST(*pc))
+            value->i = vm_const_int(vm->chunk, data);
+        else
+            value->i = (int)(data - 1);
+        break;
+    case VM_TYPE_DOUBLE:
+        value->d = vm_const_double(vm->chunk, data);
+        break;
+    case VM_TYPE_STRING:
+        value->s = VM_CONST_STRING(vm->chunk, data);
+        break;
+    default:
+        VM_RAISE(vm, EINVAL, "SELECT: invalid operand 0x%" PRIx32, *pc);
+    }
+}
+
+
+/********************
+ * select_field
+ ********************/
+static inline GQuark
+select_field(vm_state_t *vm, vm_instr_t instr)
+{
+    if (VM_PUSH_TYPE(instr) == VM_TYPE_FIELD)
+        return vm_const_field(vm->chunk, VM_PUSH_DATA(instr));
+    else
+        return g_quark_from_string(VM_CONST_STRING(vm->chunk,
+                                                   VM_PUSH_DATA(instr)));
+}
+
+
+/********************
+ * vm_instr_select
+ ********************/
+int
+vm_instr_select(vm_state_t *vm)
+{
+    vm_global_t *g;
+    vm_instr_t  *pc;
+    char        *name;
+    GQuark       field;
+    vm_value_t   value, op;
+    int          nfield, nfact, type, i;
+
+    /*
+     * Notes:
+     *   This is PUSH GLOBAL followed by FILTER, with the selectors decoded
+     *   in place instead of being pushed onto and popped off the stack.
+     *   If the first selector is an equality we try to look up the facts
+     *   matching it from an index.
+     */
+    
+    nfield = VM_SELECT_NFIELD(*vm->pc);
+    pc     = vm->pc + 1;
+    name   = VM_CONST_STRING(vm->chunk, VM_PUSH_DATA(*pc));
+    pc++;
+    g      = NULL;
+    i      = 0;
+    
+    if (nfield > 0) {
+        select_operand(vm, pc    , &type, &op);
+        select_operand(vm, pc + 1, &type, &value);
+        if (op.i != VM_RELOP_NE &&
+            vm_global_select(vm, name, select_field(vm, pc[2]),
+                             type, &value, &g) == 0) {
+            i   = 1;
+            pc += 3;
         }
     }
+
+    if (g == NULL) {
+        if (vm_global_lookup(vm, name, &g) == ENOENT)
+            g = vm_global_name(vm, name);
+        if (g == NULL)
+            VM_RAISE(vm, ENOENT, "SELECT: failed to look up %s", name);
+    }
+
+    /* push it right away so it gets freed if we raise an exception */
+    if (!VM_TST_FLAG(vm, VERIFIED) && vm_stack_grow(vm->stack, 1)) {
+        vm_global_free(g);
+        VM_RAISE(vm, ENOMEM, "SELECT: failed to grow the stack");
+    }
+    vm_push_global(vm->stack, g);
     
-    g->nfact = nfact;
+    nfact = g->nfact;
     
+    for ( ; i < nfield; i++, pc += 3) {
+        select_operand(vm, pc    , &type, &op);
+        select_operand(vm, pc + 1, &type, &value);
+        field = select_field(vm, pc[2]);
+        
+        nfact = filter_facts(vm, g, nfact, field, type, &value,
+                             op.i == VM_RELOP_NE);
+    }
 
-    vm->ninstr--;
-    vm->pc++;
-    vm->nsize -= sizeof(uintptr_t);
-
-    return 0;
+    pack_facts(g, nfact);
+    
+    return pc - vm->pc;
 }
 
 
@@ -309,25 +579,29 @@ int
 vm_instr_update(vm_state_t *vm)
 {
 #define FAIL(err, fmt, args...) do {                                    \
+        vm_join_exit(&join);                                            \
         if (src) vm_global_free(src);                                   \
         if (dst) vm_global_free(dst);                                   \
         VM_RAISE(vm, err, fmt, ## args);                                \
     } while (0)
 
     vm_global_t *src, *dst;
+    vm_join_t    join;
     int          nsrc;
     vm_value_t   sval, dval;
     OhmFact     *sfact, *dfact;
-    int          partial, nfield, i, j, success;
-    int          match;
+    int          partial, nfield, i, j, n;
+    int          match, changed;
+    const char  *name;
     
     src     = NULL;
     dst     = NULL;
     nfield  = VM_UPDATE_NFIELD(*vm->pc);
     partial = VM_UPDATE_PARTIAL(*vm->pc);
+    memset(&join, 0, sizeof(join));
 
     {
-        char   *fields[nfield];
+        GQuark  fields[nfield];
         GValue *values[nfield];
         
         if (vm_peek(vm->stack, nfield, &dval) != VM_TYPE_GLOBAL)
@@ -337,7 +611,7 @@ vm_instr_update(vm_state_t *vm)
             FAIL(ENOENT, "UPDATE: no global source found in stack");
     
         for (i = 0; i < nfield; i++)
-            if ((fields[i] = vm_pop_string(vm->stack)) == NULL)
+            if ((fields[i] = vm_pop_field(vm->stack)) == 0)
                 FAIL(ENOENT, "UPDATE: expected #%d field name not in stack", i);
     
         dst  = dval.g;
@@ -346,35 +620,49 @@ vm_instr_update(vm_state_t *vm)
         
         vm_pop_global(vm->stack);                    /* pop destination */
         vm_pop_global(vm->stack);                    /* pop source */
+
+        vm_join_init(&join, dst, fields, nfield);
         
         for (i = 0; i < nsrc; i++) {
             sfact = src->facts[i];
             if ((j = vm_fact_collect_fields(sfact, fields, nfield, values)) < 0)
-                FAIL(ENOENT, "UPDATE: source has no field %s", fields[-j]);
+                FAIL(ENOENT, "UPDATE: source has no field %s",
+                     g_quark_to_string(fields[-j]));
             
-            match = FALSE;
-            for (j = vm_global_find_first(dst, fields, values, nfield);
+            match   = FALSE;
+            changed = 0;
+            for (j = vm_join_first(&join, dst, values);
                  j >= 0;
-                 j = vm_global_find_next(dst, j, fields, values, nfield)) {
+                 j = vm_join_next(&join, dst, j, values)) {
                 match = TRUE;
                 
                 dfact = dst->facts[j];
                 if (partial)
-                    success = (vm_fact_update(dfact, sfact) != NULL);
+                    n = vm_fact_update(dfact, sfact);
                 else
-                    success = (vm_fact_copy(dfact, sfact) != NULL);
-                if (!success)
+                    n = vm_fact_copy(dfact, sfact);
+                if (n < 0)
                     FAIL(EINVAL, "UPDATE: failed to update source fact #%d", i);
+                vm_fact_digest(vm, dfact, FALSE);
+                changed += n;
             }
             
             if (!match)
                 FAIL(ENOENT,
                      "UPDATE: source #%d has no matching destination", i);
+
+            /* field values changed, indexes are stale */
+            if (changed) {
+                name = ohm_structure_get_name(OHM_STRUCTURE(dfact));
+                vm_global_index_invalidate(vm, name);
+            }
             
             g_object_unref(sfact);
             src->facts[i] = NULL;
             src->nfact--;
         }
+        vm_join_exit(&join);
+        
         for (j = 0; j < dst->nfact; j++) {
             g_object_unref(dst->facts[j]);
             dst->facts[j] = NULL;
@@ -387,11 +675,7 @@ vm_instr_update(vm_state_t *vm)
     if (dst)
         vm_global_free(dst);
 
-    vm->ninstr--;
-    vm->pc++;
-    vm->nsize -= sizeof(uintptr_t);
-
-    return 0;
+    return 1;
 #undef FAIL
 }
 
@@ -407,22 +691,25 @@ int
 vm_instr_replace(vm_state_t *vm)
 {
 #define FAIL(err, fmt, args...) do {                                    \
+        vm_join_exit(&join);                                            \
         if (src) vm_global_free(src);                                   \
         if (dst) vm_global_free(dst);                                   \
         VM_RAISE(vm, err, fmt, ## args);                                \
     } while (0)
 
     vm_global_t *src, *dst;
+    vm_join_t    join;
     int          nsrc;
     vm_value_t   sval, dval;
     OhmFact     *sfact, *dfact;
     int          nfield, i, j, cnt;
-    int          match, success;
+    int          match;
     char         name[256];
     
     src     = NULL;
     dst     = NULL;
     nfield  = VM_REPLACE_NFIELD(*vm->pc);
+    memset(&join, 0, sizeof(join));
     
     if (vm_peek(vm->stack, nfield, &dval) != VM_TYPE_GLOBAL)
         FAIL(ENOENT, "REPLACE: no global destination found in stack");
@@ -449,12 +736,12 @@ vm_instr_replace(vm_state_t *vm)
     }
     
     {
-        char    *fields[nfield];
+        GQuark   fields[nfield];
         GValue  *values[nfield];
         
         if (nfield > 0) {
             for (i = 0; i < nfield; i++)
-                if ((fields[i] = vm_pop_string(vm->stack)) == NULL)
+                if ((fields[i] = vm_pop_field(vm->stack)) == 0)
                     FAIL(ENOENT, "REPLACE: #%d field name not in stack", i);
         }
     
@@ -462,22 +749,25 @@ vm_instr_replace(vm_state_t *vm)
         vm_pop_global(vm->stack);                        /* pop source */
             
         if (nfield > 0) {
+            vm_join_init(&join, dst, fields, nfield);
+            
             for (i = 0; i < nsrc; i++) {
                 sfact = src->facts[i];
                 if ((j = vm_fact_collect_fields(sfact,
                                                 fields, nfield, values)) < 0)
-                    FAIL(ENOENT, "REPLACE: source has no field %s", fields[-j]);
+                    FAIL(ENOENT, "REPLACE: source has no field %s",
+                         g_quark_to_string(fields[-j]));
                 
                 match = FALSE;
-                for (j = vm_global_find_first(dst, fields, values, nfield);
+                for (j = vm_join_first(&join, dst, values);
                      j >= 0;
-                     j = vm_global_find_next(dst, j, fields, values, nfield)) {
+                     j = vm_join_next(&join, dst, j, values)) {
                     match = TRUE;
                 
                     dfact = dst->facts[j];
-                    success = (vm_fact_update(dfact, sfact) != NULL);
-                    if (!success)
+                    if (vm_fact_update(dfact, sfact) < 0)
                         FAIL(EINVAL, "REPLACE: failed to update fact #%d", i);
+                    vm_fact_digest(vm, dfact, FALSE);
 
                     g_object_unref(dst->facts[j]);
                     dst->facts[j] = NULL;
@@ -490,12 +780,15 @@ vm_instr_replace(vm_state_t *vm)
                     src->nfact--;
                 }
             }
+
+            vm_join_exit(&join);
         }
         
         /* remove leftover destinations */
         for (i = 0, cnt = dst->nfact; cnt > 0; i++) {
             if ((dfact = dst->facts[i]) != NULL) {
-                vm_fact_remove_instance(dfact);
+                vm_fact_digest(vm, dfact, TRUE);
+                vm_batch_remove(vm, dfact);
 
                 g_object_unref(dfact);
                 dst->facts[i] = NULL;
@@ -517,7 +810,9 @@ vm_instr_replace(vm_state_t *vm)
                  */
                 
                 ohm_structure_set_name(OHM_STRUCTURE(sfact), name);
-                vm_fact_insert(sfact);
+                if (vm_batch_insert(vm, sfact) != 0)
+                    FAIL(EINVAL, "REPLACE: failed to insert fact");
+                vm_fact_digest(vm, sfact, FALSE);
 
                 src->facts[i] = NULL;
                 src->nfact--;
@@ -526,6 +821,7 @@ vm_instr_replace(vm_state_t *vm)
             }
         }
 
+        vm_global_cache_invalidate(vm, name);
     }
     
     if (src)
@@ -533,11 +829,7 @@ vm_instr_replace(vm_state_t *vm)
     if (dst)
         vm_global_free(dst);
 
-    vm->ninstr--;
-    vm->pc++;
-    vm->nsize -= sizeof(uintptr_t);
-
-    return 0;
+    return 1;
 #undef FAIL
 }
 
@@ -556,7 +848,8 @@ vm_instr_set_var(vm_state_t *vm)
     OhmFactStore *store = ohm_fact_store_get_fact_store();
     OhmFact      *fact;
     vm_global_t  *src, *dst;
-    int          i;
+    const char   *name;
+    int          i, n;
 
     if (store == NULL)
         VM_RAISE(vm, EINVAL, "SET: could not determine fact store");
@@ -574,8 +867,9 @@ vm_instr_set_var(vm_state_t *vm)
     if (VM_GLOBAL_IS_NAME(dst)) {              /* dst a name-only global */
         if (VM_GLOBAL_IS_ORPHAN(src)) {        /* src orphan, assign directly */
             ohm_structure_set_name(OHM_STRUCTURE(src->facts[0]), dst->name);
-            if (!ohm_fact_store_insert(store, src->facts[0]))
+            if (vm_batch_insert(vm, src->facts[0]) != 0)
                 VM_RAISE(vm, ENOMEM, "SET: failed to insert fact to factstore");
+            vm_fact_digest(vm, src->facts[0], FALSE);
             g_object_unref(src->facts[0]);
             src->facts[0] = NULL;
             src->nfact    = 0;
@@ -583,11 +877,13 @@ vm_instr_set_var(vm_state_t *vm)
         else {
             for (i = 0; i < src->nfact; i++) {
                 fact = vm_fact_dup(src->facts[i], dst->name);
-                if (!ohm_fact_store_insert(store, fact))
+                if (vm_batch_insert(vm, fact) != 0)
                     VM_RAISE(vm, ENOMEM,
                              "SET: failed to insert fact to factstore");
+                vm_fact_digest(vm, fact, FALSE);
             }
         }
+        vm_global_cache_invalidate(vm, dst->name);
     }
     else {
         if (src->nfact != dst->nfact)
@@ -595,19 +891,23 @@ vm_instr_set_var(vm_state_t *vm)
                          "SET: argument dimensions do not match (%d != %d)",
                          src->nfact, dst->nfact);
         
-        for (i = 0; i < src->nfact; i++)
-            if (vm_fact_copy(dst->facts[i], src->facts[i]) == NULL)
+        for (i = 0; i < src->nfact; i++) {
+            if ((n = vm_fact_copy(dst->facts[i], src->facts[i])) < 0)
                 VM_RAISE(vm, EINVAL, "SET: failed to copy fact");
+            vm_fact_digest(vm, dst->facts[i], FALSE);
+            
+            /* field values changed, indexes are stale */
+            if (n > 0) {
+                name = ohm_structure_get_name(OHM_STRUCTURE(dst->facts[i]));
+                vm_global_index_invalidate(vm, name);
+            }
+        }
     }
     
     vm_global_free(src);
     vm_global_free(dst);
     
-    vm->ninstr--;
-    vm->pc++;
-    vm->nsize -= sizeof(uintptr_t);
-    
-    return 0;
+    return 1;
 }
 
 
@@ -625,19 +925,20 @@ vm_instr_set_field(vm_state_t *vm)
 
     OhmFactStore *store = ohm_fact_store_get_fact_store();
     vm_global_t  *g = NULL;
-    char         *field;
+    GQuark        field;
     vm_value_t   value;
-    int          type;
+    int          type, changed;
+    const char   *name;
 
     if (store == NULL)
         FAIL(EINVAL, "SET FIELD: could not determine fact store");
 
-    if (vm_type(vm->stack) != VM_TYPE_STRING)
-        FAIL(EINVAL, "SET FIELD: invalid field name, string expected");
+    if (!VM_TST_FLAG(vm, TYPED) && !IS_FIELD(vm_type(vm->stack)))
+        FAIL(EINVAL, "SET FIELD: invalid field name");
 
-    field = vm_pop_string(vm->stack);
+    field = vm_pop_field(vm->stack);
 
-    if (vm_type(vm->stack) != VM_TYPE_GLOBAL)
+    if (!VM_TST_FLAG(vm, TYPED) && vm_type(vm->stack) != VM_TYPE_GLOBAL)
         FAIL(EINVAL, "SET FIELD: destination, global expected");
     
     g    = vm_pop_global(vm->stack);
@@ -649,14 +950,17 @@ vm_instr_set_field(vm_state_t *vm)
     if (g->nfact > 1)
         FAIL(EINVAL, "SET FIELD: cannot set field of multiple globals");
     
-    vm_fact_set_field(vm, g->facts[0], field, type, &value);
+    if ((changed = vm_fact_set_field(vm, g->facts[0], field, type, &value)) < 0)
+        FAIL(-changed, "SET FIELD: failed to set field %s (type 0x%x)",
+             g_quark_to_string(field), type);
+    vm_field_digest(vm, g->facts[0], field);
+    if (changed) {
+        name = ohm_structure_get_name(OHM_STRUCTURE(g->facts[0]));
+        vm_global_index_invalidate(vm, name);
+    }
     vm_global_free(g);
     
-    vm->ninstr--;
-    vm->pc++;
-    vm->nsize -= sizeof(uintptr_t);
-    
-    return 0;
+    return 1;
 }
 
 
@@ -692,19 +996,19 @@ vm_instr_get_field(vm_state_t *vm)
 
     OhmFactStore *store = ohm_fact_store_get_fact_store();
     vm_global_t  *g = NULL;
-    char         *field;
+    GQuark        field;
     vm_value_t   value;
     int          type;
 
     if (store == NULL)
         FAIL(EINVAL, "GET FIELD: could not determine fact store");
 
-    if (vm_type(vm->stack) != VM_TYPE_STRING)
-        FAIL(EINVAL, "GET FIELD: invalid field name, string expected");
+    if (!VM_TST_FLAG(vm, TYPED) && !IS_FIELD(vm_type(vm->stack)))
+        FAIL(EINVAL, "GET FIELD: invalid field name");
 
-    field = vm_pop_string(vm->stack);
+    field = vm_pop_field(vm->stack);
 
-    if (vm_type(vm->stack) != VM_TYPE_GLOBAL)
+    if (!VM_TST_FLAG(vm, TYPED) && vm_type(vm->stack) != VM_TYPE_GLOBAL)
         FAIL(EINVAL, "GET FIELD: destination, global expected");
     
     g = vm_pop_global(vm->stack);
@@ -717,16 +1021,13 @@ vm_instr_get_field(vm_state_t *vm)
 
     type = vm_fact_get_field(vm, g->facts[0], field, &value);
     if (type == VM_TYPE_UNKNOWN)
-        FAIL(ENOENT, "GET FIELD: global has no field %s", field);
+        FAIL(ENOENT, "GET FIELD: global has no field %s",
+             g_quark_to_string(field));
 
     vm_push(vm->stack, type, value);
     vm_global_free(g);
     
-    vm->ninstr--;
-    vm->pc++;
-    vm->nsize -= sizeof(uintptr_t);
-    
-    return 0;
+    return 1;
 }
 
 
@@ -749,11 +1050,7 @@ vm_instr_get_local(vm_state_t *vm)
         VM_RAISE(vm, ENOMEM,
                      "GET LOCAL: failed to push value of #0x%x", idx);
 
-    vm->ninstr--;
-    vm->pc++;
-    vm->nsize -= sizeof(uintptr_t);
-    
-    return 0;
+    return 1;
 }
 
 
@@ -817,39 +1114,38 @@ vm_instr_create(vm_state_t *vm)
     vm_global_t *g = NULL;
     OhmFact     *fact;
     int          nfield;
-    char        *field;
+    GQuark       field;
     vm_value_t   value;
-    int          type;
+    int          type, status;
     int          i;
     
     nfield = VM_CREATE_NFIELD(*vm->pc);    
 
-    if (ALLOC_VAROBJ(g, nfield, facts) == NULL)
+    if ((g = vm_global_pool_alloc(vm, 1)) == NULL)
         FAIL(ENOMEM, "CREATE: failed to allocate memory for new global");
+    g->nfact = 0;
 
     if ((fact = ohm_fact_new(VM_UNNAMED_GLOBAL)) == NULL)
         FAIL(ENOMEM, "CREATE: failed to allocate fact for new global");
     
+    g->facts[0] = fact;                         /* freed with g on failure */
+    g->nfact    = 1;
+    
     for (i = 0; i < nfield; i++) {
-        if (vm_type(vm->stack) != VM_TYPE_STRING)
-            FAIL(EINVAL, "invalid field name, string expected");
+        if (!VM_TST_FLAG(vm, TYPED) && !IS_FIELD(vm_type(vm->stack)))
+            FAIL(EINVAL, "invalid field name");
         
-        field = vm_pop_string(vm->stack);
+        field = vm_pop_field(vm->stack);
         type  = vm_pop(vm->stack, &value);
 
-        if (!vm_fact_set_field(vm, fact, field, type, &value))
-            FAIL(ENOMEM, "failed to add field %s", field);
+        if ((status = vm_fact_set_field(vm, fact, field, type, &value)) < 0)
+            FAIL(-status, "failed to add field %s (type 0x%x)",
+                 g_quark_to_string(field), type);
     }
 
-    g->facts[0] = fact;
-    g->nfact    = 1;
     vm_push_global(vm->stack, g);
     
-    vm->ninstr--;
-    vm->pc++;
-    vm->nsize -= sizeof(uintptr_t);
-
-    return 0;
+    return 1;
 #undef FAIL
 }
 
@@ -867,33 +1163,53 @@ vm_instr_call(vm_state_t *vm)
 {
     vm_value_t   id;
     vm_method_t *m;
-    int          narg = VM_OP_ARGS(*vm->pc);
+    int          narg  = VM_CALL_NARG(*vm->pc);
+    int          flags = VM_CALL_FLAGS(*vm->pc);
     int          type, status;
     char        *name;
 
-    switch ((type = vm_pop(vm->stack, &id))) {
+    if (flags & VM_CALL_METHOD) {
+        type = VM_TYPE_INTEGER;
+        id.i = VM_CALL_ID(*vm->pc);
+    }
+    else
+        type = vm_pop(vm->stack, &id);
+    
+    switch (type) {
     case VM_TYPE_STRING:  m = vm_method_lookup(vm, id.s); name = id.s; break;
     case VM_TYPE_INTEGER: m = vm_method_by_id(vm, id.i);  name = m->name; break;
     default: VM_RAISE(vm, EINVAL, "CALL: unknown method ID type 0x%x",type);
     }
     
-    if (vm_stack_grow(vm->stack, narg))
+    /* make sure there is room for the return value even if narg is 0 */
+    if (!VM_TST_FLAG(vm, VERIFIED) && vm_stack_grow(vm->stack, narg + 1))
         VM_RAISE(vm, ENOMEM,
-                     "CALL: failed to grow the stack by %d entries", narg);
+                     "CALL: failed to grow the stack by %d entries", narg + 1);
 
+    /* methods might look at the fact store, write any queued facts */
+    if ((status = vm_batch_flush(vm)) != 0)
+        VM_RAISE(vm, status,
+                 "CALL: failed to write facts before calling '%s'", name);
+    
     status = vm_method_call(vm, name, m, narg);
+    vm_global_cache_invalidate(vm, NULL);
 
     if (status < 0)
         VM_RAISE(vm, status,
                  "CALL: method '%s' failed (error %d)", name, status);
     else if (status == 0)
         VM_FAIL(vm, "CALL: method '%s' failed without an error", name);
+
+    /* we can't hash the side-effects of methods, whatever their result */
+    if (!m->pure && VM_TST_FLAG(vm, DIGEST))
+        VM_SET_FLAG(vm, OPAQUE);
     
-    vm->ninstr--;
-    vm->pc++;
-    vm->nsize -= sizeof(uintptr_t);
+    if (flags & VM_CALL_DISCARD) {                   /* cf. POP DISCARD */
+        if (vm_pop(vm->stack, &id) == VM_TYPE_GLOBAL)
+            vm_global_free(id.g);
+    }
     
-    return 0;
+    return 1;
 }
 
 
@@ -966,16 +1282,12 @@ vm_instr_cmp(vm_state_t *vm)
  push_result:
     vm_push_int(vm->stack, result);
     
-    vm->ninstr--;
-    vm->pc++;
-    vm->nsize -= sizeof(uintptr_t);
-
     if (type1 == VM_TYPE_GLOBAL)
         vm_global_free(arg1.g);
     if (type2 == VM_TYPE_GLOBAL)
         vm_global_free(arg2.g);
     
-    return 0;
+    return 1;
 #undef FAIL
 }
 
@@ -1053,17 +1365,17 @@ vm_instr_branch (vm_state_t *vm)
     
 #if 0
     vm->ninstr--;
-    vm->nsize -= sizeof(uintptr_t);
+    vm->nsize -= sizeof(vm_instr_t);
     vm->pc++;
 #endif
     
     if (branch) {
         if (brdiff > 0) {
-            if (vm->nsize < (int)(brdiff * sizeof(uintptr_t)))
+            if (vm->nsize < (int)(brdiff * sizeof(vm_instr_t)))
                 VM_RAISE(vm, EOVERFLOW, "branch beyond end of code");
         }
         else {
-            if ((uintptr_t)(brdiff * sizeof(uintptr_t)) > vm->nsize)
+            if ((uintptr_t)(brdiff * sizeof(vm_instr_t)) > vm->nsize)
                 VM_RAISE(vm, EOVERFLOW, "branch beyond beginning of code");
         }
         
@@ -1087,20 +1399,71 @@ vm_instr_branch (vm_state_t *vm)
 int
 vm_instr_debug(vm_state_t *vm)
 {
-    char *info  = (char *)(vm->pc + 1);
-    int   len   = VM_DEBUG_LEN(*vm->pc);
-    int   nsize = 1 + VM_ALIGN_TO_INSTR(len);
+    char *info = VM_CONST_STRING(vm->chunk, VM_DEBUG_IDX(*vm->pc));
     
     DEBUG(DBG_VM, "%s", info);
     vm->info = info;
 
-    vm->ninstr--;
-    vm->pc    += nsize;
-    vm->nsize -= nsize * sizeof(uintptr_t);
+    return 1;
+}
+
+/********************
+ * vm_instr_size
+ ********************/
+int
+vm_instr_size(vm_instr_t *pc)
+{
+    vm_instr_t data;
+    int        i;
+
+    /*
+     * Notes:
+     *   Returns the size of the instruction at pc in code words, or -1 for
+     *   invalid instructions. Branch targets and constant pool references
+     *   are not checked here.
+     */
     
-    return 0;
+    switch ((vm_opcode_t)VM_OP_CODE(*pc)) {
+    case VM_OP_PUSH:
+        switch (VM_PUSH_TYPE(*pc)) {
+        case VM_TYPE_INTEGER:
+        case VM_TYPE_DOUBLE:
+        case VM_TYPE_STRING:
+        case VM_TYPE_GLOBAL:
+        case VM_TYPE_FIELD:
+        case VM_TYPE_LOCAL:   return 1;
+        default:              return -1;
+        }
+
+    case VM_OP_SELECT:
+        for (i = 1; i <= 1 + 3 * (int)VM_SELECT_NFIELD(*pc); i++) {
+            data = *(pc + i);
+            if (VM_OP_CODE(data) != VM_OP_PUSH &&
+                VM_OP_CODE(data) != VM_OP_GET)
+                return -1;
+        }
+        return i;
+        
+    case VM_OP_POP:
+    case VM_OP_FILTER:
+    case VM_OP_UPDATE:
+    case VM_OP_SET:
+    case VM_OP_GET:
+    case VM_OP_CREATE:
+    case VM_OP_CALL:
+    case VM_OP_CMP:
+    case VM_OP_BRANCH:
+    case VM_OP_DEBUG:
+    case VM_OP_HALT:
+    case VM_OP_REPLACE:
+        return 1;
+
+    default:
+        return -1;
+    }
 }
 
+
 /*****************************************************************************
  *                        *** (code) chunk generation ***                    *
  *****************************************************************************/
@@ -1117,14 +1480,14 @@ vm_chunk_new(int ninstr)
         return NULL;
 
     if (ninstr > 0)
-        if ((chunk->instrs = (uintptr_t *)ALLOC_ARR(uintptr_t, ninstr)) == NULL) {
+        if ((chunk->instrs = ALLOC_ARR(vm_instr_t, ninstr)) == NULL) {
             FREE(chunk);
             return NULL;
         }
 
     chunk->ninstr = 0;
     chunk->nsize  = 0;
-    chunk->nleft  = ninstr * sizeof(uintptr_t);
+    chunk->nleft  = ninstr * sizeof(vm_instr_t);
 
     return chunk;
 }
@@ -1138,6 +1501,8 @@ vm_chunk_del(vm_chunk_t *chunk)
 {
     if (chunk) {
         FREE(chunk->instrs);
+        FREE(chunk->consts);
+        FREE(chunk->quarks);
         FREE(chunk);
     }
 }
@@ -1146,7 +1511,7 @@ vm_chunk_del(vm_chunk_t *chunk)
 /********************
  * vm_chunk_grow
  ********************/
-uintptr_t *
+vm_instr_t *
 vm_chunk_grow(vm_chunk_t *c, int nsize)
 {
     /* Notes: nsize is the min. desired amount of free space in the buffer. */
@@ -1158,7 +1523,7 @@ vm_chunk_grow(vm_chunk_t *c, int nsize)
         c->nleft += nsize;
     }
     
-    return (uintptr_t *)(((char *)c->instrs) + c->nsize);
+    return (vm_instr_t *)(((char *)c->instrs) + c->nsize);
 }
 
 
@@ -1166,11 +1531,11 @@ vm_chunk_grow(vm_chunk_t *c, int nsize)
  * vm_chunk_add
  ********************/
 int
-vm_chunk_add(vm_chunk_t *c, uintptr_t *code, int ninstr, int nsize)
+vm_chunk_add(vm_chunk_t *c, vm_instr_t *code, int ninstr, int nsize)
 {
-    uintptr_t *cp = vm_chunk_grow(c, nsize);
+    vm_instr_t *cp = vm_chunk_grow(c, nsize);
 
-    if (!VM_ALIGNED_OK(nsize)) {
+    if (nsize % sizeof(vm_instr_t)) {
         VM_ERROR("%s: code aligment problem, size: %d.", __FUNCTION__, nsize);
         return EINVAL;
     }
@@ -1187,6 +1552,192 @@ vm_chunk_add(vm_chunk_t *c, uintptr_t *code, int ninstr, int nsize)
 }
 
 
+/********************
+ * vm_chunk_const
+ ********************/
+int
+vm_chunk_const(vm_chunk_t *c, int type, void *value, int *idx)
+{
+    char      buf[sizeof(uint32_t) * 2], *data;
+    uint32_t  word[2];
+    uint64_t  bits;
+    double    d;
+    int       size, nsize, offs;
+
+    /*
+     * Notes:
+     *   Constants are stored in network byte order. Identical constants
+     *   are folded, which also works for one being the tail of another as
+     *   we only ever compare raw bytes at constant boundaries.
+     */
+
+    switch (type) {
+    case VM_TYPE_INTEGER:
+        word[0] = htonl((uint32_t)*(int *)value);
+        memcpy(buf, word, sizeof(word[0]));
+        data = buf;
+        size = sizeof(word[0]);
+        break;
+    case VM_TYPE_DOUBLE:
+        d = *(double *)value;
+        memcpy(&bits, &d, sizeof(bits));
+        word[0] = htonl((uint32_t)(bits >> 32));
+        word[1] = htonl((uint32_t)(bits & 0xffffffff));
+        memcpy(buf, word, sizeof(word));
+        data = buf;
+        size = sizeof(word);
+        break;
+    case VM_TYPE_STRING:
+    case VM_TYPE_GLOBAL:
+    case VM_TYPE_FIELD:
+        data = (char *)value;
+        size = strlen(data) + 1;
+        break;
+    default:
+        return EINVAL;
+    }
+
+    for (offs = 0; offs + size <= c->nconst; offs += VM_CONST_ALIGN) {
+        if (!memcmp(c->consts + offs, data, size)) {
+            *idx = offs / VM_CONST_ALIGN;
+            goto out;
+        }
+    }
+    
+    if (c->nconst / VM_CONST_ALIGN > VM_CONST_MAXIDX)
+        return EOVERFLOW;
+    
+    nsize = VM_ALIGN_TO(size, VM_CONST_ALIGN);
+
+    if (c->cleft < nsize) {
+        int nold = c->nconst + c->cleft;
+        int nnew = nold + (nsize > 64 ? nsize : 64);
+        if (REALLOC_ARR(c->consts, nold, nnew) == NULL)
+            return ENOMEM;
+        c->cleft = nnew - c->nconst;
+    }
+
+    memcpy(c->consts + c->nconst, data, size);
+    *idx = c->nconst / VM_CONST_ALIGN;
+    c->nconst += nsize;
+    c->cleft  -= nsize;
+
+ out:
+    if (type == VM_TYPE_FIELD && !chunk_quark(c, *idx))
+        return ENOMEM;
+    
+    return 0;
+}
+
+
+/********************
+ * vm_chunk_resolve
+ ********************/
+int
+vm_chunk_resolve(vm_chunk_t *c)
+{
+    vm_instr_t *pc;
+    int         nword, i, idx, left;
+
+    /*
+     * Notes:
+     *   Resolves all field names of a loaded chunk. Nested SELECT operands
+     *   are plain PUSH instructions, so we can simply look at every word.
+     *   The verifier stops checking constants where it gives up on a chunk
+     *   (EOPNOTSUPP), so we check every name we resolve ourselves.
+     */
+
+    nword = c->nsize / sizeof(vm_instr_t);
+    
+    for (i = 0, pc = c->instrs; i < nword; i++, pc++) {
+        if (VM_OP_CODE(*pc) != VM_OP_PUSH ||
+            VM_PUSH_TYPE(*pc) != VM_TYPE_FIELD || !VM_PUSH_IS_CONST(*pc))
+            continue;
+        
+        idx  = VM_PUSH_DATA(*pc);
+        left = c->nconst - idx * VM_CONST_ALIGN;
+        if (left <= 0 || !memchr(VM_CONST_ADDR(c, idx), '\0', left))
+            return EINVAL;
+        if (!chunk_quark(c, idx))
+            return ENOMEM;
+    }
+    
+    return 0;
+}
+
+
+/********************
+ * chunk_quark
+ ********************/
+static GQuark
+chunk_quark(vm_chunk_t *c, int idx)
+{
+    int n = c->nconst / VM_CONST_ALIGN;
+
+    if (n > c->nquark) {
+        if (REALLOC_ARR(c->quarks, c->nquark, n) == NULL)
+            return 0;
+        c->nquark = n;
+    }
+    
+    if (!c->quarks[idx])
+        c->quarks[idx] = g_quark_from_string(VM_CONST_STRING(c, idx));
+    
+    return c->quarks[idx];
+}
+
+
+/********************
+ * vm_const_int
+ ********************/
+int
+vm_const_int(vm_chunk_t *c, int idx)
+{
+    uint32_t word;
+
+    memcpy(&word, VM_CONST_ADDR(c, idx), sizeof(word));
+
+    return (int32_t)ntohl(word);
+}
+
+
+/********************
+ * vm_const_double
+ ********************/
+double
+vm_const_double(vm_chunk_t *c, int idx)
+{
+    uint32_t word[2];
+    uint64_t bits;
+    double   d;
+
+    memcpy(word, VM_CONST_ADDR(c, idx), sizeof(word));
+    bits = ((uint64_t)ntohl(word[0]) << 32) | ntohl(word[1]);
+    memcpy(&d, &bits, sizeof(d));
+
+    return d;
+}
+
+
+/********************
+ * vm_const_field
+ ********************/
+GQuark
+vm_const_field(vm_chunk_t *c, int idx)
+{
+    GQuark q;
+    
+    if (idx < c->nquark && (q = c->quarks[idx]) != 0)
+        return q;
+
+    /* not resolved (hand-assembled code), or out of memory */
+    if ((q = chunk_quark(c, idx)) != 0)
+        return q;
+    
+    return g_quark_from_string(VM_CONST_STRING(c, idx));
+}
+
+
 
 
 /* 
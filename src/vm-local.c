@@ -30,6 +30,8 @@ USA.
 
 #include "dres-debug.h"
 
+#define SCOPE_ARENA_MIN 8                     /* initial arena size */
+
 
 /********************
  * vm_set_varname
@@ -77,15 +79,48 @@ vm_free_varnames(vm_state_t *vm)
 int
 vm_scope_push(vm_state_t *vm)
 {
-    vm_scope_t *scope = NULL;
-    
-    if (ALLOC_VAROBJ(scope, vm->nlocal, variables) == NULL)
-        return ENOMEM;
+    vm_scope_t *scope;
+    size_t      size = VM_SCOPE_SIZE(vm->nlocal);
+    int         nalloc, i;
+
+    /*
+     * Notes:
+     *   Scopes live in a single arena owned by the VM. Every scope has
+     *   room for all the vm->nlocal variables, so pushing and popping a
+     *   scope is just bumping the scope count. The arena is grown by
+     *   doubling and is only freed by vm_exit.
+     *
+     *   A new scope starts out as a copy of its parent, which makes any
+     *   variable not set in the new scope inherit its value from there.
+     *   Since only the innermost scope is ever modified this is the same
+     *   as walking the parent chain in vm_scope_get, only done once per
+     *   push instead of on every lookup.
+     */
+
+    if (vm->nscope >= vm->nscopealloc) {
+        nalloc = vm->nscopealloc ? 2 * vm->nscopealloc : SCOPE_ARENA_MIN;
+        if (REALLOC_ARR(vm->scopes,
+                        vm->nscopealloc * size, nalloc * size) == NULL)
+            return ENOMEM;
+        vm->nscopealloc = nalloc;
+    }
 
-    scope->nvariable = vm->nlocal;
+    scope = (vm_scope_t *)(vm->scopes + vm->nscope * size);
 
-    scope->parent = vm->scope;
-    vm->scope     = scope;
+#undef  DISABLE_NESTED_SCOPING
+#ifndef DISABLE_NESTED_SCOPING
+    if (vm->nscope > 0)
+        memcpy(scope, vm->scopes + (vm->nscope - 1) * size, size);
+    else
+#endif
+    {
+        scope->nvariable = vm->nlocal;
+        for (i = 0; i < vm->nlocal; i++)
+            scope->variables[i] = VM_CELL_UNKNOWN;
+    }
+
+    vm->nscope++;
+    vm->scope = scope;
 
     return 0;
 }
@@ -97,20 +132,37 @@ vm_scope_push(vm_state_t *vm)
 int
 vm_scope_pop(vm_state_t *vm)
 {
-    vm_scope_t *scope;
+    size_t size = VM_SCOPE_SIZE(vm->nlocal);
 
-    if (vm->scope == NULL)
+    if (vm->nscope <= 0)
         return ENOENT;
     
-    scope     = vm->scope;
-    vm->scope = vm->scope->parent;
+    vm->nscope--;
     
-    FREE(scope);
+    if (vm->nscope > 0)
+        vm->scope = (vm_scope_t *)(vm->scopes + (vm->nscope - 1) * size);
+    else
+        vm->scope = NULL;
     
     return 0;
 }
 
 
+/********************
+ * vm_free_scopes
+ ********************/
+void
+vm_free_scopes(vm_state_t *vm)
+{
+    FREE(vm->scopes);
+    
+    vm->scopes      = NULL;
+    vm->scope       = NULL;
+    vm->nscope      = 0;
+    vm->nscopealloc = 0;
+}
+
+
 /********************
  * vm_scope_set
  ********************/
@@ -119,18 +171,14 @@ vm_scope_set(vm_scope_t *scope, int id, int type, vm_value_t value)
 {
     unsigned int idx = VM_LOCAL_INDEX(id);
 
-    if (scope->nvariable <= idx)
+    if (scope == NULL || scope->nvariable <= idx)
         return ENOENT;
 
-    if (scope->variables == NULL)
-        return ENOMEM;
-
     switch (type) {
     case VM_TYPE_INTEGER:
     case VM_TYPE_DOUBLE:
     case VM_TYPE_STRING:
-        scope->variables[idx].type = type;
-        scope->variables[idx].v    = value;
+        scope->variables[idx] = VM_CELL_PACK(type, value);
     case VM_TYPE_NIL: /* happens when setting to the value of an unset local */
         return 0;
     default:
@@ -148,30 +196,14 @@ vm_scope_get(vm_scope_t *scope, int id, vm_value_t *value)
     unsigned int idx = VM_LOCAL_INDEX(id);
     int          type;
 
-    if (scope == NULL || scope->nvariable <= idx || scope->variables == NULL)
+    if (scope == NULL || scope->nvariable <= idx)
         return VM_TYPE_UNKNOWN;
     
-    switch ((type = scope->variables[idx].type)) {
+    switch ((type = VM_CELL_UNPACK(scope->variables[idx], value))) {
     case VM_TYPE_INTEGER:
     case VM_TYPE_DOUBLE:
     case VM_TYPE_STRING:
-        *value = scope->variables[idx].v;
-        break;
-
-#undef  DISABLE_NESTED_SCOPING
-#ifndef DISABLE_NESTED_SCOPING
-    case VM_TYPE_UNKNOWN: {
-        vm_scope_t *p = scope->parent;
-        while (p != NULL && type == VM_TYPE_UNKNOWN) {
-            type   = p->variables[idx].type;
-            *value = p->variables[idx].v;
-
-            p = p->parent;
-        }
-    }
         break;
-#endif        
-        
     default:
         type = VM_TYPE_UNKNOWN;
     }
@@ -28,15 +28,22 @@ USA.
 #include <dres/vm.h>
 
 #define UNKNOWN_ID 0xefffffff
+#define MAX_ARGS   16                   /* args unpacked without allocation */
 
 static int vm_unknown_handler(void *data, char *name,
                               vm_stack_entry_t *args, int narg,
                               vm_stack_entry_t *retval);
 
+static int method_add(vm_state_t *vm, char *name,
+                      vm_action_t handler, vm_native_t native, void *data);
+static int method_set(vm_state_t *vm, char *name,
+                      vm_action_t handler, vm_native_t native, void *data);
+
 static vm_method_t default_method = {
  name:    "default",
  id:      UNKNOWN_ID,
  handler: vm_unknown_handler,
+ native:  NULL,
  data:    NULL
 };
 
@@ -46,11 +53,33 @@ static vm_method_t default_method = {
  ********************/
 int
 vm_method_add(vm_state_t *vm, char *name, vm_action_t handler, void *data)
+{
+    return method_add(vm, name, handler, NULL, data);
+}
+
+
+/********************
+ * vm_method_add_native
+ ********************/
+int
+vm_method_add_native(vm_state_t *vm, char *name, vm_native_t native,
+                     void *data)
+{
+    return method_add(vm, name, NULL, native, data);
+}
+
+
+/********************
+ * method_add
+ ********************/
+static int
+method_add(vm_state_t *vm, char *name,
+           vm_action_t handler, vm_native_t native, void *data)
 {
     vm_method_t *m;
     
     if ((m = vm_method_lookup(vm, name)) != &default_method) {
-        if (m->handler != NULL)
+        if (m->handler != NULL || m->native != NULL)
             return EEXIST;
     }
     else {
@@ -68,8 +97,9 @@ vm_method_add(vm_state_t *vm, char *name, vm_action_t handler, void *data)
         vm->nmethod++;
     }
 
-    if (handler != NULL) {
+    if (handler != NULL || native != NULL) {
         m->handler = handler;
+        m->native  = native;
         m->data    = data;
     }
     
@@ -92,7 +122,32 @@ vm_method_del(vm_state_t *vm, char *name, vm_action_t handler)
         return EINVAL;
     
     m->handler = NULL;
+    m->native  = NULL;
     m->data    = NULL;
+    m->pure    = FALSE;
+    return 0;
+}
+
+
+/********************
+ * vm_method_pure
+ ********************/
+int
+vm_method_pure(vm_state_t *vm, char *name)
+{
+    vm_method_t *m;
+
+    /*
+     * Notes:
+     *   Pure methods have no effects on the fact store other than through
+     *   their return value, so calling them does not keep the output of
+     *   a target from being hashed for early cutoff.
+     */
+    
+    if ((m = vm_method_lookup(vm, name)) == &default_method)
+        return ENOENT;
+    
+    m->pure = TRUE;
     return 0;
 }
 
@@ -102,16 +157,39 @@ vm_method_del(vm_state_t *vm, char *name, vm_action_t handler)
  ********************/
 int
 vm_method_set(vm_state_t *vm, char *name, vm_action_t handler, void *data)
+{
+    return method_set(vm, name, handler, NULL, data);
+}
+
+
+/********************
+ * vm_method_set_native
+ ********************/
+int
+vm_method_set_native(vm_state_t *vm, char *name, vm_native_t native,
+                     void *data)
+{
+    return method_set(vm, name, NULL, native, data);
+}
+
+
+/********************
+ * method_set
+ ********************/
+static int
+method_set(vm_state_t *vm, char *name,
+           vm_action_t handler, vm_native_t native, void *data)
 {
     vm_method_t *m;
     
     if ((m = vm_method_lookup(vm, name)) == &default_method)
         return ENOENT;
     
-    if (m->handler != NULL)
+    if (m->handler != NULL || m->native != NULL)
         return EEXIST;
     
     m->handler = handler;
+    m->native  = native;
     m->data    = data;
     return 0;
 }
@@ -193,21 +271,58 @@ vm_method_call(vm_state_t *vm, char *name, vm_method_t *m, int narg)
 {
     vm_action_t       handler;
     void             *data;
-    vm_stack_entry_t *args = vm_args(vm->stack, narg);
-    vm_stack_entry_t  retval;
-    int               status;
+    vm_cell_t        *args = vm_args(vm->stack, narg);
+    vm_cell_t         retval;
+    vm_stack_entry_t  buf[MAX_ARGS], *entries, rv;
+    int               status, i;
+
+    /*
+     * Notes:
+     *   Native handlers get their arguments in place on the stack. For
+     *   classic handlers we unpack the arguments to a temporary array
+     *   (on our C stack unless there are lots of them) and pack the
+     *   return value.
+     */
 
     if (args == NULL && narg > 0)
         VM_RAISE(vm, ENOENT,
                  "CALL: failed to pop %d args for %s", narg, m->name);
     
-    handler = m->handler ? m->handler : default_method.handler;
-    data    = m->handler ? m->data    : default_method.data;
-    status  = handler(data, name, args, narg, &retval);
+    if (m->native != NULL) {
+        retval = VM_CELL_UNKNOWN;
+        status = m->native(m->data, name, args, narg, &retval);
+    }
+    else {
+        if (m->handler != NULL) {
+            handler = m->handler;
+            data    = m->data;
+        }
+        else {
+            handler = default_method.handler;
+            data    = default_method.data;
+        }
+        
+        if (narg <= MAX_ARGS)
+            entries = buf;
+        else if ((entries = ALLOC_ARR(vm_stack_entry_t, narg)) == NULL)
+            VM_RAISE(vm, ENOMEM,
+                     "CALL: failed to allocate %d args for %s", narg, m->name);
+        
+        for (i = 0; i < narg; i++)
+            entries[i].type = VM_CELL_UNPACK(args[i], &entries[i].v);
+        
+        rv.type = VM_TYPE_UNKNOWN;
+        status  = handler(data, name, entries, narg, &rv);
+        retval  = VM_CELL_PACK(rv.type, rv.v);
+        
+        if (entries != buf)
+            FREE(entries);
+    }
+    
     vm_stack_cleanup(vm->stack, narg);
     
     if (status > 0)
-        vm_push(vm->stack, retval.type, retval.v);
+        vm_push_cell(vm->stack, retval);
 
     return status;
 }
@@ -0,0 +1,312 @@
+/*************************************************************************
+This file is part of dres the resource policy dependency resolver.
+
+Copyright (C) 2010 Nokia Corporation.
+
+This library is free software; you can redistribute
+it and/or modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation
+version 2.1 of the License.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+USA.
+*************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <dres/mm.h>
+#include <dres/vm.h>
+
+
+typedef struct {
+    vm_instr_t *code;                         /* original code */
+    int         nword;                        /* its size in words */
+    char       *target;                       /* branch target map */
+} peephole_t;
+
+
+static int fuse_select(peephole_t *p, int offs, vm_instr_t *out, int *nin);
+static int fuse_call  (peephole_t *p, int offs, vm_instr_t *out, int *nin);
+
+
+/*****************************************************************************
+ *                         *** peephole optimization ***                     *
+ *****************************************************************************/
+
+/********************
+ * vm_chunk_optimize
+ ********************/
+int
+vm_chunk_optimize(vm_chunk_t *c)
+{
+    peephole_t  p;
+    vm_chunk_t  reloc;
+    vm_instr_t *code, *out, instr;
+    int        *map, *branch;
+    int         nword, nbranch, ninstr, offs, o, nin, nout, n, t, i, type;
+    int         status;
+
+    /*
+     * Notes:
+     *
+     *   We fuse frequent instruction sequences into superinstructions:
+     *
+     *     PUSH GLOBAL, (PUSH INT, PUSH <value>, PUSH FIELD)*, FILTER
+     *       => SELECT (with the selectors decoded inline)
+     *     PUSH INT <method id>, CALL [, POP DISCARD]
+     *       => CALL with the method ID inlined [and discarding]
+     *     CALL, POP DISCARD
+     *       => CALL discarding
+     *
+     *   No sequence containing a branch target other than at its start
+     *   is fused. As fusing can shrink the code, we keep a map of old to
+     *   new offsets and relocate all branches once we're done. If
+     *   anything fails the chunk is left untouched.
+     */
+
+    code  = c->instrs;
+    nword = c->nsize / sizeof(vm_instr_t);
+
+    if (nword == 0)
+        return 0;
+
+    p.code   = code;
+    p.nword  = nword;
+    p.target = ALLOC_ARR(char, nword + 1);
+    map      = ALLOC_ARR(int, nword + 1);
+    branch   = ALLOC_ARR(int, 2 * nword);
+    out      = ALLOC_ARR(vm_instr_t, nword);
+    status   = ENOMEM;
+
+    reloc.instrs = out;
+
+    if (p.target == NULL || map == NULL || branch == NULL || out == NULL)
+        goto out;
+
+    status = EILSEQ;
+
+    /* mark all branch targets */
+    for (offs = 0; offs < nword; offs += n) {
+        if ((n = vm_instr_size(code + offs)) <= 0 || offs + n > nword)
+            goto out;
+
+        if (VM_OP_CODE(code[offs]) == VM_OP_BRANCH) {
+            t = offs + VM_BRANCH_DIFF(code[offs]);
+            if (t < 0 || t > nword)
+                goto out;
+            p.target[t] = TRUE;
+        }
+    }
+
+    /* fuse or copy instructions, collecting branches for relocation */
+    ninstr = nbranch = 0;
+    for (offs = o = 0; offs < nword; offs += nin, o += nout) {
+        map[offs] = o;
+        ninstr++;
+
+        if ((nout = fuse_select(&p, offs, out + o, &nin)) > 0)
+            continue;
+        if ((nout = fuse_call(&p, offs, out + o, &nin)) > 0)
+            continue;
+
+        nin = nout = vm_instr_size(code + offs);
+        memcpy(out + o, code + offs, nin * sizeof(*out));
+
+        if (VM_OP_CODE(code[offs]) == VM_OP_BRANCH) {
+            branch[2*nbranch]   = offs;
+            branch[2*nbranch+1] = o;
+            nbranch++;
+        }
+    }
+    map[nword] = o;
+
+    /* relocate branches */
+    for (i = 0; i < nbranch; i++) {
+        instr = code[branch[2*i]];
+        type  = VM_BRANCH_TYPE(instr);
+        t     = branch[2*i] + VM_BRANCH_DIFF(instr);
+        n     = branch[2*i+1];
+        
+        VM_BRANCH_PATCH(&reloc, n, out, status, type, map[t] - n);
+    }
+
+    memcpy(code, out, o * sizeof(*out));
+    c->nleft  += c->nsize - o * sizeof(*out);
+    c->nsize   = o * sizeof(*out);
+    c->ninstr  = ninstr;
+    status     = 0;
+
+ out:
+    FREE(p.target);
+    FREE(map);
+    FREE(branch);
+    FREE(out);
+
+    return status;
+}
+
+
+/********************
+ * fuse_select
+ ********************/
+static int
+fuse_select(peephole_t *p, int offs, vm_instr_t *out, int *nin)
+{
+    vm_instr_t *code = p->code;
+    vm_instr_t  instr;
+    int         pos, nfield, i, n;
+
+    if (VM_OP_CODE(code[offs]) != VM_OP_PUSH ||
+        VM_PUSH_TYPE(code[offs]) != VM_TYPE_GLOBAL)
+        return 0;
+
+    pos    = offs + vm_instr_size(code + offs);
+    nfield = 0;
+
+    while (pos < p->nword) {
+        if (p->target[pos])
+            return 0;
+
+        instr = code[pos];
+
+        if (VM_OP_CODE(instr) == VM_OP_FILTER) {
+            if (nfield == 0 || (int)VM_FILTER_NFIELD(instr) != nfield)
+                return 0;
+            break;
+        }
+
+        /* PUSH INT relop */
+        if (VM_OP_CODE(instr) != VM_OP_PUSH ||
+            VM_PUSH_TYPE(instr) != VM_TYPE_INTEGER)
+            return 0;
+        pos += vm_instr_size(code + pos);
+
+        /* PUSH <constant> or GET LOCAL */
+        if (pos >= p->nword || p->target[pos])
+            return 0;
+        instr = code[pos];
+        switch (VM_OP_CODE(instr)) {
+        case VM_OP_PUSH:
+            switch (VM_PUSH_TYPE(instr)) {
+            case VM_TYPE_INTEGER:
+            case VM_TYPE_DOUBLE:
+            case VM_TYPE_STRING:
+                break;
+            default:
+                return 0;
+            }
+            break;
+        case VM_OP_GET:
+            if (!(VM_OP_ARGS(instr) & VM_GET_LOCAL) ||
+                (VM_OP_ARGS(instr) & VM_GET_FIELD))
+                return 0;
+            break;
+        default:
+            return 0;
+        }
+        pos += vm_instr_size(code + pos);
+
+        /* PUSH FIELD field (PUSH STRING in hand-assembled code) */
+        if (pos >= p->nword || p->target[pos])
+            return 0;
+        instr = code[pos];
+        if (VM_OP_CODE(instr) != VM_OP_PUSH ||
+            (VM_PUSH_TYPE(instr) != VM_TYPE_FIELD &&
+             VM_PUSH_TYPE(instr) != VM_TYPE_STRING))
+            return 0;
+        pos += vm_instr_size(code + pos);
+
+        if (++nfield > 0xff)
+            return 0;
+    }
+
+    if (pos >= p->nword)
+        return 0;
+
+    /* SELECT replaces FILTER, so the size stays the same */
+    n = pos - offs;
+    out[0] = VM_SELECT_INSTR(nfield);
+    for (i = 0; i < n; i++)
+        out[1 + i] = code[offs + i];
+
+    *nin = n + 1;
+    return n + 1;
+}
+
+
+/********************
+ * fuse_call
+ ********************/
+static int
+fuse_call(peephole_t *p, int offs, vm_instr_t *out, int *nin)
+{
+    vm_instr_t *code = p->code;
+    vm_instr_t  instr, data, narg, flags, id;
+    int         pos;
+
+    instr = code[offs];
+    flags = 0;
+    id    = 0;
+    pos   = offs;
+
+    /* PUSH INT <short method id> */
+    if (VM_OP_CODE(instr) == VM_OP_PUSH &&
+        VM_PUSH_TYPE(instr) == VM_TYPE_INTEGER && !VM_PUSH_IS_CONST(instr) &&
+        (data = VM_PUSH_DATA(instr)) != 0 && data - 1 <= VM_CALL_MAXID &&
+        pos + 1 < p->nword && !p->target[pos + 1] &&
+        VM_OP_CODE(code[pos + 1]) == VM_OP_CALL &&
+        VM_CALL_FLAGS(code[pos + 1]) == 0 &&
+        VM_CALL_NARG(code[pos + 1]) <= 0xff) {
+        flags |= VM_CALL_METHOD;
+        id     = data - 1;
+        pos++;
+        instr  = code[pos];
+    }
+
+    if (VM_OP_CODE(instr) != VM_OP_CALL || VM_CALL_FLAGS(instr) != 0)
+        return 0;
+
+    narg = VM_CALL_NARG(instr);
+    pos++;
+
+    /* POP DISCARD */
+    if (pos < p->nword && !p->target[pos] &&
+        VM_OP_CODE(code[pos]) == VM_OP_POP &&
+        VM_OP_ARGS(code[pos]) == VM_POP_DISCARD) {
+        flags |= VM_CALL_DISCARD;
+        pos++;
+    }
+
+    if (flags == 0)
+        return 0;
+
+    if (flags & VM_CALL_METHOD)
+        out[0] = VM_INSTR(VM_OP_CALL, flags | (id << 8) | narg);
+    else
+        out[0] = VM_INSTR(VM_OP_CALL, flags | narg);
+
+    *nin = pos - offs;
+    return 1;
+}
+
+
+
+/*
+ * Local Variables:
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:set expandtab shiftwidth=4:
+ */
@@ -44,11 +44,7 @@ USA.
 
 #define STACK_TYPE(s)                                   \
     ((s)->nentry <= (s)->nalloc && (s)->nentry > 0 ?    \
-     (s)->entries[(s)->nentry-1].type : VM_TYPE_UNKNOWN)
-
-#define STACK_POP(s, v)                                         \
-    ((s)->nentry <= (s)->nalloc && (s)->nentry > 0 ?            \
-     (s)->entries[(s)->nentry--].type : VM_TYPE_UNKNOWN)
+     VM_CELL_TYPE((s)->entries[(s)->nentry-1]) : VM_TYPE_UNKNOWN)
 
 
 
@@ -69,7 +65,7 @@ vm_stack_new(int size)
         return NULL;
 
     if (size > 0)
-        if ((stack->entries = ALLOC_ARR(vm_stack_entry_t, size)) == NULL) {
+        if ((stack->entries = ALLOC_ARR(vm_cell_t, size)) == NULL) {
             FREE(stack);
             return NULL;
         }
@@ -158,13 +154,12 @@ vm_stack_cleanup(vm_stack_t *s, int narg)
 int
 vm_push_int(vm_stack_t *s, int i)
 {
-    vm_stack_entry_t *e = STACK_PUSH(s);
+    vm_cell_t *e = STACK_PUSH(s);
     
     if (e == NULL)
         return ENOMEM;
     
-    e->type = VM_TYPE_INTEGER;
-    e->v.i  = i;
+    *e = VM_CELL_INT(i);
     
     return 0;
 }
@@ -176,13 +171,12 @@ vm_push_int(vm_stack_t *s, int i)
 int
 vm_push_double(vm_stack_t *s, double d)
 {
-    vm_stack_entry_t *e = STACK_PUSH(s);
+    vm_cell_t *e = STACK_PUSH(s);
 
     if (e == NULL)
         return ENOMEM;
 
-    e->type = VM_TYPE_DOUBLE;
-    e->v.d  = d;
+    *e = VM_CELL_DOUBLE(d);
 
     return 0;
 }
@@ -194,13 +188,12 @@ vm_push_double(vm_stack_t *s, double d)
 int
 vm_push_string(vm_stack_t *s, char *str)
 {
-    vm_stack_entry_t *e = STACK_PUSH(s);
+    vm_cell_t *e = STACK_PUSH(s);
 
     if (e == NULL)
         return ENOMEM;
 
-    e->type = VM_TYPE_STRING;
-    e->v.s  = str;
+    *e = VM_CELL_STRING(str);
 
     return 0;
 }
@@ -212,13 +205,12 @@ vm_push_string(vm_stack_t *s, char *str)
 int
 vm_push_global(vm_stack_t *s, vm_global_t *g)
 {
-    vm_stack_entry_t *e = STACK_PUSH(s);
+    vm_cell_t *e = STACK_PUSH(s);
     
     if (e == NULL)
         return ENOMEM;
     
-    e->type = VM_TYPE_GLOBAL;
-    e->v.g  = g;
+    *e = VM_CELL_GLOBAL(g);
     
     return 0;
 }
@@ -230,13 +222,29 @@ vm_push_global(vm_stack_t *s, vm_global_t *g)
 int
 vm_push(vm_stack_t *s, int type, vm_value_t value)
 {
-    vm_stack_entry_t *e = STACK_PUSH(s);
+    vm_cell_t *e = STACK_PUSH(s);
     
     if (e == NULL)
         return ENOMEM;
     
-    e->type = type;
-    e->v    = value;
+    *e = VM_CELL_PACK(type, value);
+
+    return 0;
+}
+
+
+/********************
+ * vm_push_cell
+ ********************/
+int
+vm_push_cell(vm_stack_t *s, vm_cell_t c)
+{
+    vm_cell_t *e = STACK_PUSH(s);
+    
+    if (e == NULL)
+        return ENOMEM;
+    
+    *e = c;
 
     return 0;
 }
@@ -258,23 +266,19 @@ vm_type(vm_stack_t *s)
 int
 vm_peek(vm_stack_t *s, int idx, vm_value_t *value)
 {
-    vm_stack_entry_t *e = STACK_ENTRY(s, idx);
-    int               t;
+    vm_cell_t *e = STACK_ENTRY(s, idx);
 
     if (e == NULL)
         return VM_TYPE_UNKNOWN;
     
-    *value = e->v;
-    t      = e->type;
-    
-    return t;
+    return VM_CELL_UNPACK(*e, value);
 }
 
 
 /********************
  * vm_args
  ********************/
-vm_stack_entry_t *
+vm_cell_t *
 vm_args(vm_stack_t *s, int narg)
 {
     return STACK_ENTRY(s, narg - 1);
@@ -287,19 +291,14 @@ vm_args(vm_stack_t *s, int narg)
 int
 vm_pop(vm_stack_t *s, vm_value_t *value)
 {
-    vm_stack_entry_t *e = STACK_TOP(s);
-    int               t;
+    vm_cell_t *e = STACK_TOP(s);
 
     if (e == NULL)
         return VM_TYPE_UNKNOWN;
     
-    *value = e->v;
-    t      = e->type;
-    
-    e->type = VM_TYPE_UNKNOWN;
     s->nentry--;
     
-    return t;
+    return VM_CELL_UNPACK(*e, value);
 }
 
 
@@ -309,15 +308,14 @@ vm_pop(vm_stack_t *s, vm_value_t *value)
 int
 vm_pop_int(vm_stack_t *s)
 {
-    vm_stack_entry_t *e = STACK_TOP(s);
+    vm_cell_t *e = STACK_TOP(s);
 
-    if (e == NULL || e->type != VM_TYPE_INTEGER)
+    if (e == NULL || VM_CELL_TYPE(*e) != VM_TYPE_INTEGER)
         return INT_MAX;
     
-    e->type = VM_TYPE_UNKNOWN;
     s->nentry--;
 
-    return e->v.i;
+    return VM_CELL_TO_INT(*e);
 }
 
 
@@ -327,15 +325,14 @@ vm_pop_int(vm_stack_t *s)
 double
 vm_pop_double(vm_stack_t *s)
 {
-    vm_stack_entry_t *e = STACK_TOP(s);
+    vm_cell_t *e = STACK_TOP(s);
 
-    if (e == NULL || e->type != VM_TYPE_DOUBLE)
+    if (e == NULL || VM_CELL_TYPE(*e) != VM_TYPE_DOUBLE)
         return 666.666;
     
-    e->type = VM_TYPE_UNKNOWN;
     s->nentry--;
 
-    return e->v.d;
+    return VM_CELL_TO_DOUBLE(*e);
 }
 
 
@@ -345,15 +342,40 @@ vm_pop_double(vm_stack_t *s)
 char *
 vm_pop_string(vm_stack_t *s)
 {
-    vm_stack_entry_t *e = STACK_TOP(s);
+    vm_cell_t *e = STACK_TOP(s);
 
-    if (e == NULL || e->type != VM_TYPE_STRING)
+    if (e == NULL || VM_CELL_TYPE(*e) != VM_TYPE_STRING)
         return NULL;
     
-    e->type = VM_TYPE_UNKNOWN;
     s->nentry--;
 
-    return e->v.s;
+    return VM_CELL_TO_STRING(*e);
+}
+
+
+/********************
+ * vm_pop_field
+ ********************/
+GQuark
+vm_pop_field(vm_stack_t *s)
+{
+    vm_cell_t *e = STACK_TOP(s);
+    char      *name;
+
+    if (e == NULL)
+        return 0;
+
+    switch (VM_CELL_TYPE(*e)) {
+    case VM_TYPE_FIELD:
+        s->nentry--;
+        return VM_CELL_TO_FIELD(*e);
+    case VM_TYPE_STRING:                     /* hand-assembled code */
+        s->nentry--;
+        name = VM_CELL_TO_STRING(*e);
+        return name ? g_quark_from_string(name) : 0;
+    default:
+        return 0;
+    }
 }
 
 
@@ -363,15 +385,14 @@ vm_pop_string(vm_stack_t *s)
 vm_global_t *
 vm_pop_global(vm_stack_t *s)
 {
-    vm_stack_entry_t *e = STACK_TOP(s);
+    vm_cell_t *e = STACK_TOP(s);
 
-    if (e == NULL || e->type != VM_TYPE_GLOBAL)
+    if (e == NULL || VM_CELL_TYPE(*e) != VM_TYPE_GLOBAL)
         return NULL;
     
-    e->type = VM_TYPE_UNKNOWN;
     s->nentry--;
 
-    return e->v.g;
+    return VM_CELL_TO_GLOBAL(*e);
 }
 
 
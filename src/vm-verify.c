@@ -0,0 +1,547 @@
+/*************************************************************************
+This file is part of dres the resource policy dependency resolver.
+
+Copyright (C) 2010 Nokia Corporation.
+
+This library is free software; you can redistribute
+it and/or modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation
+version 2.1 of the License.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+USA.
+*************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <dres/mm.h>
+#include <dres/vm.h>
+
+
+typedef struct {
+    vm_chunk_t *chunk;                        /* chunk being verified */
+    vm_instr_t *code;                         /* its code */
+    int         nword;                        /* its size in words */
+    int        *depth;                        /* stack depth at branch targets */
+    char      **types;                        /* stack types at branch targets */
+    char       *stack;                        /* abstract stack of types */
+    int         nstack;                       /* current stack depth */
+    int         nalloc;                       /* allocated stack size */
+    int         maxdepth;                     /* maximum stack depth */
+    int         typed;                        /* all checked operands known */
+} verifier_t;
+
+
+static int verify_instr (verifier_t *v, int offs, int *size, int *next);
+static int verify_select(verifier_t *v, int offs, int *size);
+static int instr_size   (verifier_t *v, int offs);
+
+
+/*****************************************************************************
+ *                          *** bytecode verification ***                    *
+ *****************************************************************************/
+
+/********************
+ * vm_chunk_verify
+ ********************/
+int
+vm_chunk_verify(vm_chunk_t *c)
+{
+    verifier_t v;
+    int        offs, n, next, i, reachable, status;
+
+    /*
+     * Notes:
+     *
+     *   We check that every instruction is well-formed and within the
+     *   chunk, that every branch lands on an instruction boundary and
+     *   that no instruction can underflow the stack. While doing so we
+     *   keep an abstract stack of operand types. This gives us the
+     *   maximum stack depth of the chunk and tells us whether the
+     *   operands the interpreter would otherwise type check at runtime
+     *   are always of the right type.
+     *
+     *   The compiler only ever branches forward, so a single linear pass
+     *   suffices: the stack at a branch target is known by the time we
+     *   get there. Code with backward branches is not verified and keeps
+     *   running with all the runtime checks (EOPNOTSUPP). Malformed code
+     *   is rejected (EINVAL).
+     */
+
+    c->flags    = 0;
+    c->maxdepth = 0;
+
+    memset(&v, 0, sizeof(v));
+    v.chunk = c;
+    v.code  = c->instrs;
+    v.nword = c->nsize / sizeof(vm_instr_t);
+    v.typed = TRUE;
+
+    if (v.nword == 0) {
+        c->flags = VM_CHUNK_VERIFIED | VM_CHUNK_TYPED;
+        return 0;
+    }
+
+    v.depth = ALLOC_ARR(int   , v.nword);
+    v.types = ALLOC_ARR(char *, v.nword);
+    status  = ENOMEM;
+
+    if (v.depth == NULL || v.types == NULL)
+        goto out;
+
+    for (i = 0; i < v.nword; i++)
+        v.depth[i] = -1;
+
+    reachable = TRUE;
+    for (offs = 0; offs < v.nword; offs += n) {
+        if (v.depth[offs] >= 0) {                 /* a branch target */
+            if (!reachable) {
+                /* only reached by branching, take the state from there */
+                v.nstack = v.depth[offs];
+                if (v.nstack > 0)
+                    memcpy(v.stack, v.types[offs], v.nstack);
+                reachable = TRUE;
+            }
+            else {
+                /* reached both ways, depths must agree, merge types */
+                if (v.depth[offs] != v.nstack) {
+                    status = EINVAL;
+                    goto out;
+                }
+                for (i = 0; i < v.nstack; i++)
+                    if (v.stack[i] != v.types[offs][i])
+                        v.stack[i] = VM_TYPE_UNKNOWN;
+            }
+        }
+
+        if (!reachable) {                         /* dead code, just skip */
+            if ((n = instr_size(&v, offs)) <= 0) {
+                status = EINVAL;
+                goto out;
+            }
+            next = FALSE;
+        }
+        else if ((status = verify_instr(&v, offs, &n, &next)) != 0)
+            goto out;
+
+        /* branches are forward, so any into this instruction are known */
+        for (i = 1; i < n; i++) {
+            if (v.depth[offs + i] >= 0) {
+                status = EINVAL;
+                goto out;
+            }
+        }
+
+        reachable = next;
+    }
+
+    c->maxdepth = v.maxdepth;
+    c->flags    = VM_CHUNK_VERIFIED | (v.typed ? VM_CHUNK_TYPED : 0);
+    status      = 0;
+
+ out:
+    if (v.types != NULL)
+        for (i = 0; i < v.nword; i++)
+            FREE(v.types[i]);
+    FREE(v.types);
+    FREE(v.depth);
+    FREE(v.stack);
+
+    return status;
+}
+
+
+/*****************************************************************************
+ *                       *** abstract stack operations ***                   *
+ *****************************************************************************/
+
+/********************
+ * push
+ ********************/
+static int
+push(verifier_t *v, int type)
+{
+    if (v->nstack >= v->nalloc) {
+        if (REALLOC_ARR(v->stack, v->nalloc, v->nalloc + 16) == NULL)
+            return ENOMEM;
+        v->nalloc += 16;
+    }
+
+    v->stack[v->nstack++] = type;
+
+    if (v->nstack > v->maxdepth)
+        v->maxdepth = v->nstack;
+
+    return 0;
+}
+
+
+/********************
+ * pop
+ ********************/
+static int
+pop(verifier_t *v, int n)
+{
+    if (v->nstack < n)
+        return EINVAL;
+
+    v->nstack -= n;
+    return 0;
+}
+
+
+/********************
+ * expect
+ ********************/
+static void
+expect(verifier_t *v, int idx, int type)
+{
+    /*
+     * Notes:
+     *   A mismatch is not an error, the interpreter still catches it at
+     *   runtime. We just need to leave the runtime type checks on.
+     */
+
+    if (v->stack[v->nstack - 1 - idx] != type)
+        v->typed = FALSE;
+}
+
+
+/********************
+ * branch
+ ********************/
+static int
+branch(verifier_t *v, int target)
+{
+    int i;
+
+    if (target < 0 || target >= v->nword)
+        return EINVAL;
+
+    if (v->depth[target] < 0) {
+        if (v->nstack > 0) {
+            if ((v->types[target] = ALLOC_ARR(char, v->nstack)) == NULL)
+                return ENOMEM;
+            memcpy(v->types[target], v->stack, v->nstack);
+        }
+        v->depth[target] = v->nstack;
+    }
+    else {
+        if (v->depth[target] != v->nstack)
+            return EINVAL;
+        for (i = 0; i < v->nstack; i++)
+            if (v->types[target][i] != v->stack[i])
+                v->types[target][i] = VM_TYPE_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+/*****************************************************************************
+ *                        *** instruction verification ***                   *
+ *****************************************************************************/
+
+/********************
+ * instr_size
+ ********************/
+static int
+instr_size(verifier_t *v, int offs)
+{
+    vm_instr_t *pc = v->code + offs;
+    int         n, idx, left;
+
+    if (VM_OP_CODE(*pc) == VM_OP_SELECT)          /* nested code, see below */
+        return verify_select(v, offs, &n) == 0 ? n : -1;
+
+    if ((n = vm_instr_size(pc)) <= 0 || offs + n > v->nword)
+        return -1;
+
+    /* check that constants are within the pool and strings terminated */
+    switch (VM_OP_CODE(*pc)) {
+    case VM_OP_PUSH:
+        if (VM_PUSH_TYPE(*pc) == VM_TYPE_LOCAL)
+            break;
+        if (!VM_PUSH_IS_CONST(*pc)) {
+            if (VM_PUSH_TYPE(*pc) != VM_TYPE_INTEGER || !VM_PUSH_DATA(*pc))
+                return -1;
+            break;
+        }
+        idx  = VM_PUSH_DATA(*pc);
+        left = v->chunk->nconst - idx * VM_CONST_ALIGN;
+        switch (VM_PUSH_TYPE(*pc)) {
+        case VM_TYPE_INTEGER: return left >= 4 ? n : -1;
+        case VM_TYPE_DOUBLE:  return left >= 8 ? n : -1;
+        default:              goto check_string;
+        }
+    case VM_OP_DEBUG:
+        idx  = VM_DEBUG_IDX(*pc);
+        left = v->chunk->nconst - idx * VM_CONST_ALIGN;
+    check_string:
+        if (left <= 0 || !memchr(VM_CONST_ADDR(v->chunk, idx), '\0', left))
+            return -1;
+        break;
+    default:
+        break;
+    }
+
+    return n;
+}
+
+
+/********************
+ * verify_select
+ ********************/
+static int
+verify_select(verifier_t *v, int offs, int *size)
+{
+    vm_instr_t *pc;
+    int         nfield, pos, n, i;
+
+    /*
+     * Notes:
+     *   The nested instructions are decoded inline by SELECT and never
+     *   touch the stack. We only check that they have the expected form.
+     */
+
+    nfield = VM_SELECT_NFIELD(v->code[offs]);
+    pos    = offs + 1;
+
+    if (pos >= v->nword || (n = instr_size(v, pos)) <= 0)
+        return EINVAL;
+    pc = v->code + pos;
+    if (VM_OP_CODE(*pc) != VM_OP_PUSH || VM_PUSH_TYPE(*pc) != VM_TYPE_GLOBAL)
+        return EINVAL;
+    pos += n;
+
+    for (i = 0; i < nfield; i++) {
+        /* relop */
+        if (pos >= v->nword || (n = instr_size(v, pos)) <= 0)
+            return EINVAL;
+        pc = v->code + pos;
+        if (VM_OP_CODE(*pc) != VM_OP_PUSH ||
+            VM_PUSH_TYPE(*pc) != VM_TYPE_INTEGER)
+            return EINVAL;
+        pos += n;
+
+        /* value */
+        if (pos >= v->nword || (n = instr_size(v, pos)) <= 0)
+            return EINVAL;
+        pc = v->code + pos;
+        switch (VM_OP_CODE(*pc)) {
+        case VM_OP_PUSH:
+            switch (VM_PUSH_TYPE(*pc)) {
+            case VM_TYPE_INTEGER:
+            case VM_TYPE_DOUBLE:
+            case VM_TYPE_STRING:
+                break;
+            default:
+                return EINVAL;
+            }
+            break;
+        case VM_OP_GET:
+            if (!(VM_OP_ARGS(*pc) & VM_GET_LOCAL) ||
+                (VM_OP_ARGS(*pc) & VM_GET_FIELD))
+                return EINVAL;
+            break;
+        default:
+            return EINVAL;
+        }
+        pos += n;
+
+        /* field name */
+        if (pos >= v->nword || (n = instr_size(v, pos)) <= 0)
+            return EINVAL;
+        pc = v->code + pos;
+        if (VM_OP_CODE(*pc) != VM_OP_PUSH ||
+            (VM_PUSH_TYPE(*pc) != VM_TYPE_FIELD &&
+             VM_PUSH_TYPE(*pc) != VM_TYPE_STRING))
+            return EINVAL;
+        pos += n;
+    }
+
+    *size = pos - offs;
+    return 0;
+}
+
+
+/********************
+ * verify_instr
+ ********************/
+static int
+verify_instr(verifier_t *v, int offs, int *size, int *next)
+{
+    vm_instr_t instr = v->code[offs];
+    int        n, narg, flags, i, err;
+
+#define NEED(n) do {                                                    \
+        if (v->nstack < (n))                                            \
+            return EINVAL;                                              \
+    } while (0)
+
+#define PUSH(type) do {                                                 \
+        if ((err = push(v, type)) != 0)                                 \
+            return err;                                                 \
+    } while (0)
+
+    if ((*size = instr_size(v, offs)) <= 0)
+        return EINVAL;
+
+    *next = TRUE;
+
+    switch ((vm_opcode_t)VM_OP_CODE(instr)) {
+    case VM_OP_PUSH:
+        if (VM_PUSH_TYPE(instr) == VM_TYPE_LOCAL) {
+            n = VM_PUSH_DATA(instr);
+            NEED(2 * n);
+            for (i = 0; i < n; i++) {
+                expect(v, 0, VM_TYPE_INTEGER);    /* local ID, then value */
+                pop(v, 2);
+            }
+        }
+        else
+            PUSH(VM_PUSH_TYPE(instr));
+        break;
+
+    case VM_OP_POP:
+        switch (VM_OP_ARGS(instr)) {
+        case VM_POP_LOCALS:                       break;
+        case VM_POP_DISCARD: NEED(1); pop(v, 1);  break;
+        default:             return EINVAL;
+        }
+        break;
+
+    case VM_OP_FILTER:
+        n = VM_FILTER_NFIELD(instr);
+        NEED(3 * n + 1);
+        expect(v, 3 * n, VM_TYPE_GLOBAL);
+        for (i = 0; i < n; i++) {
+            expect(v, 0, VM_TYPE_FIELD);          /* field, value, relop */
+            pop(v, 3);
+        }
+        break;
+
+    case VM_OP_UPDATE:
+    case VM_OP_REPLACE:
+        n = VM_OP_CODE(instr) == VM_OP_UPDATE ?
+            (int)VM_UPDATE_NFIELD(instr) : (int)VM_REPLACE_NFIELD(instr);
+        NEED(n + 2);                              /* fields, dst, src */
+        pop(v, n + 2);
+        break;
+
+    case VM_OP_SET:
+        if (VM_OP_ARGS(instr) & VM_SET_FIELD) {
+            NEED(3);                              /* field, global, value */
+            expect(v, 0, VM_TYPE_FIELD);
+            expect(v, 1, VM_TYPE_GLOBAL);
+            pop(v, 3);
+        }
+        else {
+            NEED(2);                              /* dst, src */
+            pop(v, 2);
+        }
+        break;
+
+    case VM_OP_GET:
+        if (VM_OP_ARGS(instr) & VM_GET_FIELD) {
+            NEED(2);                              /* field, global */
+            expect(v, 0, VM_TYPE_FIELD);
+            expect(v, 1, VM_TYPE_GLOBAL);
+            pop(v, 2);
+            PUSH(VM_TYPE_UNKNOWN);
+        }
+        else if (VM_OP_ARGS(instr) & VM_GET_LOCAL)
+            PUSH(VM_TYPE_UNKNOWN);
+        else
+            return EOPNOTSUPP;                    /* not implemented */
+        break;
+
+    case VM_OP_CREATE:
+        n = VM_CREATE_NFIELD(instr);
+        NEED(2 * n);
+        for (i = 0; i < n; i++) {
+            expect(v, 0, VM_TYPE_FIELD);          /* field, value */
+            pop(v, 2);
+        }
+        PUSH(VM_TYPE_GLOBAL);
+        break;
+
+    case VM_OP_CALL:
+        narg  = VM_CALL_NARG(instr);
+        flags = VM_CALL_FLAGS(instr);
+        n     = narg + (flags & VM_CALL_METHOD ? 0 : 1);
+        NEED(n);
+        pop(v, n);
+        PUSH(VM_TYPE_UNKNOWN);
+        if (flags & VM_CALL_DISCARD)
+            pop(v, 1);
+        break;
+
+    case VM_OP_CMP:
+        n = VM_CMP_RELOP(instr) == VM_RELOP_NOT ? 1 : 2;
+        NEED(n);
+        pop(v, n);
+        PUSH(VM_TYPE_INTEGER);
+        break;
+
+    case VM_OP_BRANCH:
+        if (VM_BRANCH_DIFF(instr) <= 0)
+            return EOPNOTSUPP;
+        switch (VM_BRANCH_TYPE(instr)) {
+        case VM_BRANCH:
+            *next = FALSE;
+            break;
+        case VM_BRANCH_EQ:
+        case VM_BRANCH_NE:
+            NEED(1);
+            pop(v, 1);
+            break;
+        default:
+            return EINVAL;
+        }
+        if ((err = branch(v, offs + VM_BRANCH_DIFF(instr))) != 0)
+            return err;
+        break;
+
+    case VM_OP_DEBUG:
+        break;
+
+    case VM_OP_HALT:
+        *next = FALSE;
+        break;
+
+    case VM_OP_SELECT:
+        PUSH(VM_TYPE_GLOBAL);
+        break;
+
+    default:
+        return EINVAL;
+    }
+
+    return 0;
+
+#undef NEED
+#undef PUSH
+}
+
+
+
+/*
+ * Local Variables:
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:set expandtab shiftwidth=4:
+ */
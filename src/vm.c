@@ -59,10 +59,13 @@ vm_exit(vm_state_t *vm)
 {
     if (vm) {
         vm_stack_del(vm->stack);
-        if (!VM_TST_FLAG(vm, COMPILED)) {
+        vm_free_scopes(vm);
+        vm_batch_free(vm);
+        vm_global_cache_free(vm);
+        vm_global_pool_reset(vm, 0);
+        vm_free_varnames(vm);                 /* copied even if compiled */
+        if (!VM_TST_FLAG(vm, COMPILED))
             vm_free_methods(vm);
-            vm_free_varnames(vm);
-        }
     }
 }
 
@@ -73,15 +76,56 @@ vm_exit(vm_state_t *vm)
 int
 vm_exec(vm_state_t *vm, vm_chunk_t *code)
 {
-    int status;
-
+    int status, flags, err;
+
+    /*
+     * Notes:
+     *   For verified code we grow the stack once for the whole chunk and
+     *   let the interpreter skip its per-instruction stack and type checks.
+     *   We might be nested in another vm_exec (resolve builtin), so the
+     *   flags of the outer chunk are saved and restored.
+     *
+     *   Once the outermost vm_exec is done the free lists of the global
+     *   pool are trimmed, to not hold on to the peak number of globals
+     *   of a resolution burst, and the fact cache is released.
+     *
+     *   Fact store writes queued by the chunk are applied once it is done,
+     *   even if it failed, as the store would already have them without
+     *   queueing. Rolling them back is up to the caller's transaction.
+     */
+
+    flags = vm->flags & (VM_FLAG_VERIFIED | VM_FLAG_TYPED);
+    VM_CLR_FLAG(vm, VERIFIED);
+    VM_CLR_FLAG(vm, TYPED);
+
+    if ((code->flags & VM_CHUNK_VERIFIED) &&
+        vm_stack_grow(vm->stack, code->maxdepth) == 0) {
+        VM_SET_FLAG(vm, VERIFIED);
+        if (code->flags & VM_CHUNK_TYPED)
+            VM_SET_FLAG(vm, TYPED);
+    }
 
     vm->chunk  = code;
     vm->pc     = code->instrs;
     vm->ninstr = code->ninstr;
     vm->nsize  = code->nsize;
-    
+
+    vm->nexec++;
     status = VM_TRY(vm);
+    vm->nexec--;
+
+    if ((err = vm_batch_flush(vm)) != 0) {
+        VM_ERROR("failed to write facts to the fact store (%d)", err);
+        if (status > 0)
+            status = -err;
+    }
+
+    vm->flags = (vm->flags & ~(VM_FLAG_VERIFIED | VM_FLAG_TYPED)) | flags;
+
+    if (vm->nexec == 0) {
+        vm_global_cache_reset(vm);
+        vm_global_pool_reset(vm, VM_GPOOL_KEEP);
+    }
 
     return status;
 }
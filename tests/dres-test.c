@@ -22,6 +22,7 @@ USA.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
@@ -40,12 +41,20 @@ USA.
 static const char   *ruleset;
 static dres_t       *dres;
 static OhmFactStore *store;
-static int           quit = 0;
+static int           quit   = 0;
+static int           cutoff = 0;
+static int           failed = 0;
 
 typedef void (*handler_t)(char *command, char *args);
 
 static void resolve_handler(char *, char *);
+static void prepared_handler(char *, char *);
 static void show_handler(char *, char *);
+static void set_handler(char *, char *);
+static void expect_handler(char *, char *);
+static void count_handler(char *, char *);
+static void cutoff_handler(char *, char *);
+static void save_handler(char *, char *);
 static void help_handler(char *, char *);
 static void quit_handler(char *, char *);
 
@@ -57,9 +66,15 @@ typedef struct {
 
 
 static command_t commands[] = {
-    { "resolve", resolve_handler },
-    { "show"   , show_handler    },
-    { "dump"   , show_handler    },
+    { "resolve" , resolve_handler  },
+    { "prepared", prepared_handler },
+    { "show"    , show_handler     },
+    { "dump"    , show_handler     },
+    { "set"     , set_handler      },
+    { "expect"  , expect_handler   },
+    { "count"   , count_handler    },
+    { "cutoff"  , cutoff_handler   },
+    { "save"    , save_handler     },
 #if 0
     { "trace"  , trace_handler   },
 #endif
@@ -146,10 +161,19 @@ help_handler(char *command, char *args)
     
     if (args == NULL || !*args) {
         printf("Possible commands are:\n");
-        printf("  resolve goal  resolve \n");
-        printf("  show [name]   show all or a given fact\n");
-        printf("  help          minimal help on usage\n");
-        printf("  quit          clean up and exit\n");
+        printf("  resolve goal         resolve goal(s), several in a batch\n");
+        printf("                       name=value arguments set locals\n");
+        printf("  prepared goal        resolve goal as a prepared goal\n");
+        printf("  show [name]          show all or a given fact\n");
+        printf("  set fact field val   set field of fact(s)\n");
+        printf("  expect fact field val [val-without-cutoff]\n");
+        printf("                       check field of a single fact\n");
+        printf("  count fact n         check the number of facts\n");
+        printf("  cutoff on|off        enable/disable early cutoff\n");
+        printf("  save path            save the ruleset precompiled\n");
+        printf("  help                 minimal help on usage\n");
+        printf("  quit                 clean up and exit\n");
+        printf("Facts are given as name or name[field=value].\n");
     }
 }
 
@@ -173,20 +197,60 @@ quit_handler(char *command, char *args)
 static void
 resolve_handler(char *command, char *args)
 {
-    char *goal, *end;
-    int   status;
+#define MAX_GOALS  16
+#define MAX_LOCALS 16
+    char *goals[MAX_GOALS], *locals[3 * MAX_LOCALS + 1], **lp;
+    char *goal, *end, *value;
+    int   ngoal, nlocal, status;
 
     (void)command;
         
-    goal = args;
-    end  = strchr(goal, ' ');
-
-    if (end != NULL)
-        *end = '\0';
+    /*
+     * The arguments are goals and name=value local variable settings,
+     * separated by spaces. Values are passed as strings.
+     */
+
+    for (ngoal = nlocal = 0, goal = args; goal && *goal; ) {
+        if ((end = strchr(goal, ' ')) != NULL)
+            *end++ = '\0';
+
+        if ((value = strchr(goal, '=')) != NULL) {
+            if (nlocal >= MAX_LOCALS) {
+                printf("Too many local variables, at most %d can be set.\n",
+                       MAX_LOCALS);
+                return;
+            }
+            *value++ = '\0';
+            locals[3 * nlocal + 0] = goal;
+            locals[3 * nlocal + 1] = GINT_TO_POINTER('s');
+            locals[3 * nlocal + 2] = value;
+            nlocal++;
+        }
+        else {
+            if (ngoal >= MAX_GOALS) {
+                printf("Too many goals, at most %d can be updated at once.\n",
+                       MAX_GOALS);
+                return;
+            }
+            goals[ngoal++] = goal;
+        }
 
-    /* XXX parse and construct argument list */
+        if ((goal = end) != NULL)
+            while (*goal == ' ')
+                goal++;
+    }
 
-    status = dres_update_goal(dres, goal, NULL);
+    locals[3 * nlocal] = NULL;
+    lp = nlocal ? locals : NULL;
+    
+    if (ngoal <= 1) {
+        goal   = ngoal ? goals[0] : args;
+        status = dres_update_goal(dres, goal, lp);
+    }
+    else {
+        goal   = "batch";
+        status = dres_update_goals(dres, goals, ngoal, lp);
+    }
 
     if (status < 0)
         printf("Updating goal '%s' failed with and error.\n", goal);
@@ -194,6 +258,291 @@ resolve_handler(char *command, char *args)
         printf("Failed to update goal '%s.'\n", goal);
     else
         printf("Goal '%s' successfully updated.\n", goal);
+
+    if (status <= 0)
+        failed++;
+#undef MAX_LOCALS
+#undef MAX_GOALS
+}
+
+
+/********************
+ * prepared_handler
+ ********************/
+static void
+prepared_handler(char *command, char *args)
+{
+    dres_goal_t *goal;
+    int          status;
+
+    (void)command;
+
+    if ((goal = dres_prepare_goal(dres, args, NULL)) == NULL) {
+        printf("Failed to prepare goal '%s'.\n", args ? args : "");
+        failed++;
+        return;
+    }
+
+    status = dres_update_prepared(goal, NULL);
+    dres_free_prepared(goal);
+    
+    if (status < 0)
+        printf("Updating prepared goal '%s' failed with and error.\n", args);
+    else if (!status)
+        printf("Failed to update prepared goal '%s.'\n", args);
+    else
+        printf("Prepared goal '%s' successfully updated.\n", args);
+
+    if (status <= 0)
+        failed++;
+}
+
+
+/********************
+ * split_args
+ ********************/
+static int
+split_args(char *args, char **argv, int size)
+{
+    char *s, *e;
+    int   argc;
+
+    for (argc = 0, s = args; s != NULL && *s && argc < size; s = e) {
+        argv[argc++] = s;
+        
+        if ((e = strchr(s, ' ')) != NULL) {
+            *e++ = '\0';
+            while (*e == ' ')
+                e++;
+        }
+    }
+
+    return (s != NULL && *s) ? -1 : argc;
+}
+
+
+/********************
+ * value_matches
+ ********************/
+static int
+value_matches(GValue *value, const char *str)
+{
+    const char *s;
+    char        buf[64];
+
+    if (value == NULL)
+        return FALSE;
+    
+    switch (G_VALUE_TYPE(value)) {
+    case G_TYPE_STRING:
+        s = g_value_get_string(value);
+        return s != NULL && !strcmp(s, str);
+    case G_TYPE_INT:
+        snprintf(buf, sizeof(buf), "%d", g_value_get_int(value));
+        return !strcmp(buf, str);
+    case G_TYPE_DOUBLE:
+        snprintf(buf, sizeof(buf), "%g", g_value_get_double(value));
+        return !strcmp(buf, str);
+    default:
+        return FALSE;
+    }
+}
+
+
+/********************
+ * lookup_facts
+ ********************/
+static GSList *
+lookup_facts(const char *spec)
+{
+    char    name[128], *field, *value, *end;
+    GSList *facts, *l;
+
+    /* spec is either a fact name or name[field=value] */
+    
+    strncpy(name, spec, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    field = value = NULL;
+    
+    if ((field = strchr(name, '[')) != NULL) {
+        *field++ = '\0';
+        if ((value = strchr(field, '=')) == NULL ||
+            (end = strchr(value, ']')) == NULL) {
+            printf("Invalid fact '%s'.\n", spec);
+            return NULL;
+        }
+        *value++ = '\0';
+        *end     = '\0';
+    }
+
+    facts = NULL;
+    for (l = ohm_fact_store_get_facts_by_name(store, name);
+         l != NULL;
+         l = g_slist_next(l)) {
+        if (field == NULL || value_matches(ohm_fact_get(l->data, field), value))
+            facts = g_slist_append(facts, l->data);
+    }
+
+    return facts;
+}
+
+
+/********************
+ * set_handler
+ ********************/
+static void
+set_handler(char *command, char *args)
+{
+    char   *argv[3], *end;
+    GSList *facts, *l;
+    GValue *value;
+    long    i;
+
+    (void)command;
+    
+    if (args == NULL || split_args(args, argv, 3) != 3) {
+        printf("Usage: set fact field value\n");
+        failed++;
+        return;
+    }
+
+    if ((facts = lookup_facts(argv[0])) == NULL) {
+        printf("FAILED: no fact %s to set.\n", argv[0]);
+        failed++;
+        return;
+    }
+
+    i = strtol(argv[2], &end, 10);
+    
+    for (l = facts; l != NULL; l = g_slist_next(l)) {
+        if (*end)
+            value = ohm_value_from_string(argv[2]);
+        else
+            value = ohm_value_from_int(i);
+        ohm_fact_set(l->data, argv[1], value);
+    }
+
+    g_slist_free(facts);
+}
+
+
+/********************
+ * expect_handler
+ ********************/
+static void
+expect_handler(char *command, char *args)
+{
+    char   *argv[4], *expected, *actual;
+    GSList *facts;
+    GValue *value;
+    int     n;
+
+    (void)command;
+
+    /* an optional 4th argument is the value expected without cutoff */
+    
+    if (args == NULL || (n = split_args(args, argv, 4)) < 3) {
+        printf("Usage: expect fact field value [value-without-cutoff]\n");
+        failed++;
+        return;
+    }
+
+    expected = (n == 4 && !cutoff) ? argv[3] : argv[2];
+    facts    = lookup_facts(argv[0]);
+
+    if (g_slist_length(facts) != 1) {
+        printf("FAILED: %d facts %s, expected a single one.\n",
+               g_slist_length(facts), argv[0]);
+        failed++;
+    }
+    else {
+        value = ohm_fact_get(facts->data, argv[1]);
+        
+        if (value_matches(value, expected))
+            printf("ok: %s:%s is %s\n", argv[0], argv[1], expected);
+        else {
+            actual = value ? g_strdup_value_contents(value) : NULL;
+            printf("FAILED: %s:%s is %s, expected %s\n", argv[0], argv[1],
+                   actual ? actual : "<none>", expected);
+            g_free(actual);
+            failed++;
+        }
+    }
+    
+    g_slist_free(facts);
+}
+
+
+/********************
+ * count_handler
+ ********************/
+static void
+count_handler(char *command, char *args)
+{
+    char   *argv[2];
+    GSList *facts;
+    int     n, expected;
+
+    (void)command;
+    
+    if (args == NULL || split_args(args, argv, 2) != 2) {
+        printf("Usage: count fact n\n");
+        failed++;
+        return;
+    }
+
+    expected = (int)strtol(argv[1], NULL, 10);
+    facts    = lookup_facts(argv[0]);
+    n        = g_slist_length(facts);
+    g_slist_free(facts);
+
+    if (n == expected)
+        printf("ok: %d facts %s\n", n, argv[0]);
+    else {
+        printf("FAILED: %d facts %s, expected %d\n", n, argv[0], expected);
+        failed++;
+    }
+}
+
+
+/********************
+ * cutoff_handler
+ ********************/
+static void
+cutoff_handler(char *command, char *args)
+{
+    (void)command;
+
+    cutoff = (args != NULL && !strcmp(args, "on"));
+    dres_set_early_cutoff(dres, cutoff);
+    
+    printf("Early cutoff %s.\n", cutoff ? "enabled" : "disabled");
+}
+
+
+/********************
+ * save_handler
+ ********************/
+static void
+save_handler(char *command, char *args)
+{
+    int status;
+
+    (void)command;
+
+    if (args == NULL || !*args) {
+        printf("Usage: save path\n");
+        failed++;
+        return;
+    }
+    
+    if ((status = dres_save(dres, args)) != 0) {
+        printf("Failed to save ruleset to %s (%d: %s).\n", args,
+               status, strerror(status));
+        failed++;
+    }
+    else
+        printf("Ruleset saved to %s.\n", args);
 }
 
 
@@ -269,7 +618,7 @@ command_execute(char *cmdstr)
     if ((end = strrchr(input, '\n')) != NULL)
         *end = '\0';
 
-    if (!input[0])
+    if (!input[0] || input[0] == '#')
         return;
     
     command = input;
@@ -319,7 +668,10 @@ shutdown(void)
     resolver_exit();
     factstore_exit();
 
-    exit(0);
+    if (failed)
+        printf("%d check(s) FAILED.\n", failed);
+    
+    exit(failed ? 1 : 0);
 }
 
 
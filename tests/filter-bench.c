@@ -0,0 +1,218 @@
+/*************************************************************************
+This file is part of dres the resource policy dependency resolver.
+
+Copyright (C) 2010 Nokia Corporation.
+
+This library is free software; you can redistribute
+it and/or modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation
+version 2.1 of the License.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+USA.
+*************************************************************************/
+
+
+/*
+ * Compare filtering facts by a field value one fact at a time with
+ * vm_fact_match_field (the way FILTER used to) against filtering with
+ * the field columns of the fact cache. The VM functions are not exported
+ * from libdres, so we are linked directly against vm-global.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <ohm/ohm-fact.h>
+#include <dres/vm.h>
+
+#define FACT_NAME   "com.nokia.bench.fact"
+#define FACT_ID     "id"
+#define FACT_CLASS  "class"
+#define NVALUE      10                        /* distinct values per field */
+#define NOPS        1000000                   /* fact checks per run */
+
+#define fatal(ec, fmt, args...) do {                            \
+        fprintf(stderr, "FATAL ERROR: "fmt"\n" , ## args);      \
+        exit(ec);                                               \
+    } while (0)
+
+
+static OhmFactStore *store;
+static vm_state_t    vm;
+static GQuark        id_field, class_field;
+
+
+/********************
+ * timestamp
+ ********************/
+static double
+timestamp(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+
+/********************
+ * insert_facts
+ ********************/
+static void
+insert_facts(int n)
+{
+    OhmFact *fact;
+    char     class[32];
+    int      i;
+
+    for (i = 0; i < n; i++) {
+        if ((fact = ohm_fact_new(FACT_NAME)) == NULL)
+            fatal(1, "Failed to create fact #%d.", i);
+
+        snprintf(class, sizeof(class), "class-%d", i % NVALUE);
+        ohm_fact_set(fact, FACT_ID, ohm_value_from_int(i % NVALUE));
+        ohm_fact_set(fact, FACT_CLASS, ohm_value_from_string(class));
+
+        if (!ohm_fact_store_insert(store, fact))
+            fatal(1, "Failed to insert fact #%d.", i);
+    }
+}
+
+
+/********************
+ * filter_scan
+ ********************/
+static int
+filter_scan(vm_global_t *g, int nfact, GQuark field, int type,
+            vm_value_t *value)
+{
+    OhmFact *fact;
+    GValue  *gval;
+    int      i, match;
+
+    for (i = 0; i < g->nfact; i++) {
+        if ((fact = g->facts[i]) == NULL)
+            continue;
+
+        if ((gval = ohm_structure_qget(OHM_STRUCTURE(fact), field)) == NULL)
+            match = FALSE;
+        else
+            match = vm_fact_match_field(&vm, fact, field, gval, type, value);
+
+        if (!match) {
+            g_object_unref(fact);
+            g->facts[i] = NULL;
+            nfact--;
+        }
+    }
+
+    return nfact;
+}
+
+
+/********************
+ * bench
+ ********************/
+static double
+bench(int loops, int columns, GQuark field, int type, vm_value_t *value)
+{
+    vm_global_t *g;
+    double       start;
+    int          nfact, i;
+
+    start = timestamp();
+
+    for (i = 0; i < loops; i++) {
+        if (vm_global_lookup(&vm, FACT_NAME, &g) != 0)
+            fatal(1, "Failed to look up facts %s.", FACT_NAME);
+
+        nfact = g->nfact;
+
+        if (!columns ||
+            vm_global_filter(&vm, g, field, type, value, FALSE, &nfact) != 0)
+            nfact = filter_scan(g, nfact, field, type, value);
+
+        g->nfact = nfact;
+        vm_global_free(g);
+    }
+
+    return (timestamp() - start) / loops;
+}
+
+
+/********************
+ * run
+ ********************/
+static void
+run(int n)
+{
+    vm_value_t value;
+    double     scan, column;
+    int        loops;
+
+    insert_facts(n);
+    loops = NOPS / n;
+
+    value.i = NVALUE / 2;
+    scan    = bench(loops, FALSE, id_field, VM_TYPE_INTEGER, &value);
+    column  = bench(loops, TRUE , id_field, VM_TYPE_INTEGER, &value);
+    printf("%5d facts, integer: scan %8.3f us, column %8.3f us (%.1fx)\n",
+           n, scan, column, scan / column);
+
+    value.s = "class-5";
+    scan    = bench(loops, FALSE, class_field, VM_TYPE_STRING, &value);
+    column  = bench(loops, TRUE , class_field, VM_TYPE_STRING, &value);
+    printf("%5d facts, string:  scan %8.3f us, column %8.3f us (%.1fx)\n",
+           n, scan, column, scan / column);
+
+    vm_global_cache_invalidate(&vm, FACT_NAME);
+    vm_fact_remove(FACT_NAME);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int sizes[] = { 10, 100, 1000 };
+    int i;
+
+#if (GLIB_MAJOR_VERSION <= 2) && (GLIB_MINOR_VERSION < 36)
+    g_type_init();
+#endif
+
+    if ((store = ohm_get_fact_store()) == NULL)
+        fatal(1, "Failed to create fact store.");
+
+    id_field    = g_quark_from_string(FACT_ID);
+    class_field = g_quark_from_string(FACT_CLASS);
+
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+        run(sizes[i]);
+
+    vm_global_cache_free(&vm);
+    vm_global_pool_reset(&vm, 0);
+
+    return 0;
+
+    (void)argc;
+    (void)argv;
+}
+
+
+/*
+ * Local Variables:
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:set expandtab shiftwidth=4:
+ */
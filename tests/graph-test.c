@@ -0,0 +1,407 @@
+/*************************************************************************
+This file is part of dres the resource policy dependency resolver.
+
+Copyright (C) 2010 Nokia Corporation.
+
+This library is free software; you can redistribute
+it and/or modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation
+version 2.1 of the License.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+USA.
+*************************************************************************/
+
+
+/*
+ * Compare updating goals by walking their whole check order (the way
+ * dres_update_goal used to) against walking the dirty set in rank order
+ * (cf. update_dirty) on random dependency graphs. Updating a target is
+ * simulated by stamping it, except for a pseudo-random quarter of the
+ * targets which are cut off early and leave their dependents clean. The
+ * graph functions are not exported from libdres, so we are linked
+ * directly against graph.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <dres/dres.h>
+
+#define NTARGET   60                          /* targets per graph */
+#define NFACTVAR  6                           /* factvars per graph */
+#define NSTAMP    (NTARGET + NFACTVAR)
+#define NGOAL     3                           /* max goals per update */
+#define NSEED     2000                        /* number of graphs */
+#define NSTEP     40                          /* updates per graph */
+
+#define fatal(ec, fmt, args...) do {                            \
+        fprintf(stderr, "FATAL ERROR: "fmt"\n" , ## args);      \
+        exit(ec);                                               \
+    } while (0)
+
+
+/* graph.c dependencies we do not want to pull in */
+int DBG_GRAPH, DBG_RESOLVE;
+
+void vm_log(vm_log_level_t level, const char *format, ...)
+{
+    va_list ap;
+
+    (void)level;
+
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
+char *dres_name(dres_t *dres, int id, char *buf, size_t bufsize)
+{
+    (void)dres;
+
+    snprintf(buf, bufsize, "0x%x", id);
+    return buf;
+}
+
+void dres_dump_sort(dres_t *dres, int *list)
+{
+    (void)dres;
+    (void)list;
+}
+
+
+static int clock_, step_;                     /* stamp clock, update step */
+static int updated[NTARGET], nupdated;        /* targets updated by a step */
+
+
+/********************
+ * check_target
+ ********************/
+static void
+check_target(dres_t *dres, int tid)
+{
+    dres_target_t *t = dres->targets + DRES_INDEX(tid);
+    int           *stamps, stamp, update, cutoff, i;
+
+    /* mimic dres_check_target, with early cutoff */
+
+    if (t->prereqs != NULL && !DRES_TST_FLAG(t, TARGET_DIRTY))
+        return;
+
+    stamps = dres->stamps;
+    stamp  = stamps[DRES_INDEX(tid)];
+
+    if (t->prereqs == NULL)
+        update = TRUE;
+    else
+        for (i = 0, update = FALSE; i < t->ncheck; i++)
+            update |= stamps[t->checks[i]] > stamp;
+
+    if (update) {
+        updated[nupdated++] = DRES_INDEX(tid);
+        cutoff = ((DRES_INDEX(tid) * 2654435761u + step_ * 40503u) >> 7) % 4;
+        if (t->prereqs == NULL || cutoff != 0) {
+            stamps[DRES_INDEX(tid)] = ++clock_;
+            dres_mark_dependents(dres, tid);
+        }
+    }
+
+    dres_clear_dirty(dres, t);
+}
+
+
+/********************
+ * walk_order
+ ********************/
+static void
+walk_order(dres_t *dres, dres_target_t **goals, int ngoal)
+{
+    char seen[NTARGET];
+    int  single[2], *deps, i;
+
+    memset(seen, 0, sizeof(seen));
+
+    for (i = 0; i < ngoal; i++) {
+        if (goals[i]->prereqs == NULL) {
+            single[0] = goals[i]->id;
+            single[1] = DRES_ID_NONE;
+            deps      = single;
+        }
+        else
+            deps = goals[i]->dependencies;
+
+        for ( ; *deps != DRES_ID_NONE; deps++) {
+            if (!seen[DRES_INDEX(*deps)]) {
+                seen[DRES_INDEX(*deps)] = TRUE;
+                check_target(dres, *deps);
+            }
+        }
+    }
+}
+
+
+/********************
+ * walk_dirty
+ ********************/
+static void
+walk_dirty(dres_t *dres, dres_target_t **goals, int ngoal)
+{
+    int rank, i;
+
+    /* mimic update_targets and update_dirty */
+
+    if (ngoal == 1 && goals[0]->prereqs == NULL) {
+        check_target(dres, goals[0]->id);
+        return;
+    }
+
+    for (i = 0; i < ngoal; i++)
+        dres_seed_dirty(dres, goals[i], TRUE);
+
+    for (rank = dres_next_dirty(dres, 0);
+         rank >= 0;
+         rank = dres_next_dirty(dres, rank + 1)) {
+        for (i = 0; i < ngoal; i++)
+            if (dres_in_closure(dres, goals[i], rank))
+                break;
+        if (i < ngoal)
+            check_target(dres, dres->targets[dres->order[rank]].id);
+    }
+
+    /* the dirty set must not hold on to targets without prereqs */
+    for (rank = dres_next_dirty(dres, 0);
+         rank >= 0;
+         rank = dres_next_dirty(dres, rank + 1))
+        if (dres->targets[dres->order[rank]].prereqs == NULL)
+            fatal(1, "target #%d without prereqs left in the dirty set",
+                  dres->order[rank]);
+}
+
+
+/********************
+ * make_graph
+ ********************/
+static dres_t *
+make_graph(unsigned int seed, int lazy)
+{
+    dres_t        *dres;
+    dres_target_t *t;
+    int            perm[NTARGET], ndep[NTARGET], i, j, n;
+
+    if ((dres = calloc(1, sizeof(*dres))) == NULL ||
+        (dres->targets = calloc(NTARGET, sizeof(*dres->targets))) == NULL)
+        fatal(1, "failed to allocate graph");
+
+    dres->ntarget  = NTARGET;
+    dres->nfactvar = NFACTVAR;
+
+    srand(seed);
+
+    /* perm[i] is the index of the i-th target in a topological order */
+    for (i = 0; i < NTARGET; i++)
+        perm[i] = i;
+    for (i = NTARGET - 1; i > 0; i--) {
+        j       = rand() % (i + 1);
+        n       = perm[i];
+        perm[i] = perm[j];
+        perm[j] = n;
+    }
+
+    for (i = 0; i < NTARGET; i++) {
+        t       = dres->targets + perm[i];
+        t->id   = DRES_TARGET(perm[i]);
+        t->name = "target";
+
+        if (i < 3 || rand() % 8 == 0)                   /* no prereqs */
+            continue;
+
+        n = 1 + rand() % 4;
+        if ((t->prereqs = calloc(1, sizeof(*t->prereqs))) == NULL ||
+            (t->prereqs->ids = calloc(n, sizeof(int))) == NULL)
+            fatal(1, "failed to allocate prereqs");
+        t->prereqs->nid = n;
+
+        for (j = 0; j < n; j++)
+            if (rand() % 4 == 0)
+                t->prereqs->ids[j] = DRES_FACTVAR(rand() % NFACTVAR);
+            else
+                t->prereqs->ids[j] = DRES_TARGET(perm[rand() % i]);
+    }
+
+    if (dres_build_index(dres) != 0)
+        fatal(1, "failed to build dependency index");
+
+    if (lazy) {
+        if (dres_rank_targets(dres) != 0)
+            fatal(1, "failed to rank targets");
+    }
+    else {
+        /* ranking sorted targets must keep their check orders */
+        if (dres_sort_targets(dres) != 0)
+            fatal(1, "failed to sort targets");
+        for (i = 0; i < NTARGET; i++)
+            ndep[i] = dres->targets[i].ndependency;
+        if (dres_rank_targets(dres) != 0)
+            fatal(1, "failed to rank sorted targets");
+        for (i = 0; i < NTARGET; i++)
+            if (ndep[i] != dres->targets[i].ndependency)
+                fatal(1, "ranking changed the check order of target #%d", i);
+    }
+
+    srand(seed * 7 + 1);
+
+    return dres;
+}
+
+
+/********************
+ * free_graph
+ ********************/
+static void
+free_graph(dres_t *dres)
+{
+    dres_target_t *t;
+    int            i;
+
+    dres_free_index(dres);
+
+    for (i = 0, t = dres->targets; i < dres->ntarget; i++, t++) {
+        if (t->prereqs != NULL) {
+            free(t->prereqs->ids);
+            free(t->prereqs);
+        }
+        if (dres->dependencies == NULL)
+            free(t->dependencies);
+    }
+
+    free(dres->dependencies);
+    free(dres->reduced);
+    free(dres->ranks);
+    free(dres->order);
+    free(dres->dirty);
+    free(dres->targets);
+    free(dres);
+}
+
+
+/********************
+ * compare
+ ********************/
+static int
+compare(unsigned int seed)
+{
+    dres_t        *a, *b;
+    dres_target_t *ga[NGOAL], *gb[NGOAL];
+    int            ua[NTARGET], na, clock_a, clock_0, r, f, g, i, n, ok;
+    char           sa[NTARGET], sb[NTARGET];
+
+    a  = make_graph(seed, seed & 1);
+    b  = make_graph(seed, seed & 1);
+    ok = TRUE;
+
+    for (step_ = 0; ok && step_ < NSTEP; step_++) {
+        if (rand() % 3 == 0) {                          /* factvar change */
+            f = rand() % NFACTVAR;
+            a->stamps[NTARGET + f] = b->stamps[NTARGET + f] = ++clock_;
+            dres_mark_dependents(a, DRES_FACTVAR(f));
+            dres_mark_dependents(b, DRES_FACTVAR(f));
+        }
+
+        n = 1 + rand() % NGOAL;
+        for (i = 0; i < n; i++) {
+            g     = rand() % NTARGET;
+            ga[i] = a->targets + g;
+            gb[i] = b->targets + g;
+            if (ga[i]->prereqs != NULL) {
+                dres_sort_target(a, ga[i]);
+                dres_sort_target(b, gb[i]);
+            }
+        }
+
+        r       = rand();
+        clock_0 = clock_;
+
+        srand(r);
+        nupdated = 0;
+        walk_order(a, ga, n);
+        na      = nupdated;
+        clock_a = clock_;
+        memcpy(ua, updated, sizeof(ua));
+
+        srand(r);
+        nupdated = 0;
+        clock_   = clock_0;
+        walk_dirty(b, gb, n);
+
+        if (n == 1) {
+            /* a single goal must be updated in exactly the same order */
+            if (na != nupdated || memcmp(ua, updated, na * sizeof(int)) ||
+                memcmp(a->stamps, b->stamps, NSTAMP * sizeof(int))) {
+                printf("seed %u, step %d: %d vs. %d updates\n",
+                       seed, step_, na, nupdated);
+                ok = FALSE;
+            }
+        }
+        else {
+            /* the goals might be interleaved, compare the sets */
+            memset(sa, 0, sizeof(sa));
+            memset(sb, 0, sizeof(sb));
+            for (i = 0; i < na; i++)
+                sa[ua[i]] = TRUE;
+            for (i = 0; i < nupdated; i++)
+                sb[updated[i]] = TRUE;
+            if (memcmp(sa, sb, sizeof(sa))) {
+                printf("seed %u, step %d: updated different targets\n",
+                       seed, step_);
+                ok = FALSE;
+            }
+            for (i = 0; i < NTARGET; i++)
+                if (DRES_TST_FLAG(a->targets + i, TARGET_DIRTY) !=
+                    DRES_TST_FLAG(b->targets + i, TARGET_DIRTY)) {
+                    printf("seed %u, step %d: target #%d dirty mismatch\n",
+                           seed, step_, i);
+                    ok = FALSE;
+                }
+            memcpy(b->stamps, a->stamps, NSTAMP * sizeof(int));
+            clock_ = clock_a;
+        }
+    }
+
+    free_graph(a);
+    free_graph(b);
+
+    return ok;
+}
+
+
+/********************
+ * main
+ ********************/
+int
+main(int argc, char *argv[])
+{
+    unsigned int seed;
+    int          failed;
+
+    (void)argc;
+    (void)argv;
+
+    for (seed = 1, failed = 0; seed < NSEED; seed++)
+        if (!compare(seed))
+            failed++;
+
+    printf("%s: %d of %d graphs failed\n", failed ? "FAIL" : "OK",
+           failed, NSEED - 1);
+
+    return failed ? 1 : 0;
+}
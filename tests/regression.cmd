@@ -0,0 +1,92 @@
+# Commands for dres-test, see regression.sh. The optional last argument
+# of expect is the value expected when early cutoff is off.
+
+# a changed prerequisite propagates
+set source value 1
+set input noise 1
+resolve all
+expect mid value 1
+expect result value 1
+expect byfield seen 0
+
+# unchanged output of mid stops propagation only with early cutoff
+set source value 2
+set input noise 2
+resolve all
+expect result value 1 2
+expect byfield seen 0
+
+# effects of a nested resolve are never cut off
+set source value 8
+resolve after
+expect after value 8
+set source value 9
+set input noise 3
+resolve after
+expect after value 9
+
+# a changed field triggers field-qualified prerequisites
+set source value 3
+set input value 5
+resolve all
+expect mid value 5
+expect result value 3
+expect byfield seen 3
+
+# only changes to the selected facts trigger selector prerequisites
+set source value 4
+resolve watch
+expect watch seen 0
+set call[name=call3] state busy
+resolve watch
+expect watch seen 0
+set call[name=call2] state busy
+resolve watch
+expect watch seen 4
+
+# swapped values of two instances trigger qualified prerequisites
+resolve swapped
+resolve paired
+set source value 10
+set pair[slot=a] value 2
+set pair[slot=b] value 1
+set twin[value=1] value 3
+set twin[value=2] value 1
+set twin[value=3] value 2
+resolve swapped
+resolve paired
+expect swapped seen 10
+expect paired seen 10
+
+# hash-joined partial update
+set source value 5
+resolve calls
+expect call[name=call9] state busy
+expect call[name=call2] state idle
+expect call[name=call3] state busy
+count call 10
+resolve watch
+expect watch seen 5
+
+# batched insertion, then positional update of the inserted facts
+resolve many
+count many 20
+expect many[id=20] id 20
+resolve many
+count many 20
+
+# several goals in one batch
+set source value 6
+set input value 6
+resolve derived byfield
+expect result value 6
+expect byfield seen 6
+
+# prepared goal
+set source value 7
+set input value 7
+prepared all
+expect result value 7
+expect byfield seen 7
+
+quit
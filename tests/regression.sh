@@ -0,0 +1,24 @@
+#!/bin/sh
+
+# Run regression.cmd against regression.dres with and without early
+# cutoff, then save the ruleset precompiled and run it again from the
+# loaded .dresc.
+
+srcdir=${srcdir:-.}
+
+set -e
+
+for c in on off; do
+    echo "*** regression.dres, early cutoff $c"
+    ./dres-test $srcdir/regression.dres "cutoff $c" 1 < $srcdir/regression.cmd
+done
+
+echo "*** saving regression.dresc"
+rm -f regression.dresc
+./dres-test $srcdir/regression.dres "save regression.dresc" 1 quit 1 \
+    < /dev/null
+
+for c in on off; do
+    echo "*** regression.dresc, early cutoff $c"
+    ./dres-test regression.dresc "cutoff $c" 1 < $srcdir/regression.cmd
+done